@@ -12,6 +12,7 @@ import argparse
 import datetime
 import os
 import string
+import struct
 import sys
 from dataclasses import dataclass, field
 from datetime import datetime
@@ -20,13 +21,29 @@ from pathlib import Path, PurePosixPath
 CONTROL_DATA_SIZE = 64
 MAC_FIELD_SIZE = 16
 IV_FIELD_SIZE = 16
-FIRMWARE_AT_ADDR = (0x08 * 0x100) - CONTROL_DATA_SIZE
+BOOT_SIZE = 0x08 * 0x100
+FIRMWARE_AT_ADDR = BOOT_SIZE - CONTROL_DATA_SIZE
+
+CRC_POLYNOMIAL = 0x1021
+CRC_INIT = 0xFFFF
+CRC_SIZE = 2
+
+OBJECT_FLASH_END = 0x800000
+OBJECT_MAX_SIZE = 0x40000
+
+SPARSE_GROUP = 64
 
 U32_S = 4
 M32 = 0xFFFFFFFF
 
 AES_IV_SIZE = 16
 
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = 0x7F + LZ_MIN_MATCH
+LZ_MAX_LITERALS = 0x80
+LZ_MAX_DISTANCE = 0xFFFF
+LZ_MAX_CANDIDATES = 64
+
 XTEA_BLOCK_SIZE = 8
 XTEA_BLOCK_SIZE_U32 = XTEA_BLOCK_SIZE // U32_S
 XTEA_IV_SIZE = XTEA_BLOCK_SIZE
@@ -34,6 +51,12 @@ IV_SIZE = XTEA_IV_SIZE
 KEY_SIZE = 16
 KEY_SIZE_U32 = KEY_SIZE // U32_S
 
+CHASKEY_BLOCK_SIZE = 16
+CHASKEY_BLOCK_SIZE_U32 = CHASKEY_BLOCK_SIZE // U32_S
+CHASKEY_ROUNDS = 12
+
+SPECK_ROUNDS = 27
+
 @dataclass
 class XteaCtx:
     key:            list    = field(default_factory = lambda: [None] * KEY_SIZE)
@@ -42,6 +65,7 @@ class XteaCtx:
     data:           list    = field(default_factory = lambda: [None] * XTEA_BLOCK_SIZE)
     dataLength:     int     = 0
     rounds:         int     = 32
+    cipher:         str     = 'XTEA'                                # block cipher of the CFB mode: XTEA or SPECK
 
 @dataclass
 class FirmwareCtx:
@@ -58,6 +82,7 @@ class FirmwareCtx:
                                                                                                 # -------------
                                                                                                 # 64 bytes
     firmware:       list    = field(default_factory = list)
+    payload:        list    = None                                                              # firmware with interleaved page tags
 
     def setEncryption(self, cipher: str):
         self.mode &= 0xFC
@@ -66,6 +91,8 @@ class FirmwareCtx:
                 pass
             case 'XTEA':
                 self.mode |= 0x01
+            case 'SPECK':
+                self.mode |= 0x03
             case 'AES':
                 raise SystemExit("ERROR: This mode is currently not allowed!!!")
                 self.mode |= 0x02
@@ -85,6 +112,8 @@ class FirmwareCtx:
         match cipher:
             case 'XTEA':
                 self.mode |= 0x04
+            case 'SPECK':
+                self.mode |= 0x0C
             case 'AES':
                 raise SystemExit("ERROR: This mode is currently not allowed!!!")
                 self.mode |= 0x08
@@ -129,7 +158,7 @@ class FirmwareCtx:
             raise SystemExit("ERROR: Firmware description should be %s bytes in size, and there are: %s bytes." % (CONTROL_DATA_SIZE, str(len(_firmware))))
         if self.firmwareSize != len(self.firmware):
             raise SystemExit("ERROR: Firmware size does not match!")
-        _firmware += self.firmware
+        _firmware += self.firmware if self.payload is None else self.payload
         return _firmware
 
 # // mode
@@ -139,8 +168,10 @@ class FirmwareCtx:
 # //   7 ... 6      MAC type
 # //                    00 - CFB-MAC [XTEA]
 # //                    01 - CFB-MAC [AES-128]
-# //                    10 - HMAC
-# //                    11 - RFU (Reserved for Future Use)
+# //                    10 - Chaskey [macRounds - permutation rounds, 12-255], MAC covers descriptor and payload
+# //                    11 - page chained CFB-MAC [XTEA]: MAC covers descriptor and tag of the first page,
+# //                         payload is T1 | P1 | T2 | P2 | ... | Tn | Pn, Ti = CFB-MAC(Pi | Ti+1), Tn = CFB-MAC(Pn),
+# //                         rfu[0] holds the page size in XTEA blocks
 # //   5 ... 4      MAC size
 # //                    00 - 8
 # //                    01 - 12
@@ -150,12 +181,24 @@ class FirmwareCtx:
 # //                    00 - no new key
 # //                    01 - XTEA
 # //                    10 - AES-128
-# //                    11 - RFU
+# //                    11 - Speck64/128 (new key and firmware are one CFB chain, XTEA and Speck are not mixed)
 # //   1 ... 0      firmware cipher type
 # //                    00 - none
 # //                    01 - XTEA
 # //                    10 - AES-128
-# //                    11 - RFU
+# //                    11 - Speck64/128 [cipherRounds = 27]
+# //   ---------------------------------------------------------
+
+# // rfu
+# //   ---------------------------------------------------------
+# //   Byte         Contents
+# //   ----------   --------------------------------------------
+# //   0            page size in XTEA blocks (page chained CFB-MAC)
+# //   1            payload format: 0xFF - plain, 0x01 - LZ compressed,
+# //                0x02 - sparse: groups of 64 pages, each an 8-byte page mask (bit 0 of the first byte - first page)
+# //                followed by the pages with data only, rfu[0] holds the page size in XTEA blocks
+# //   2 ... 3      CRC-16-CCITT of the application as programmed (big-endian, 0xFFFF - none), checked by
+# //                the bootloader (CRC=1), which then stores the checksum of the whole Flash at its end for CRCSCAN
 # //   ---------------------------------------------------------
 
 # // timeStamp
@@ -181,6 +224,9 @@ def mLs(a: int, b: int):
 def mRs(a: int, b: int):
     return m32(a >> b)
 
+def mRotl(a: int, b: int):
+    return m32((a << b) | (a >> (32 - b)))
+
 def int32ToInt8(n: int, endianness: str):
     _mask = (1 << 8) - 1
     _range = range(0, 32, 8) if (sys.byteorder == endianness) else reversed(range(0, 32, 8))
@@ -207,16 +253,38 @@ def xteaEcbEncrypt(key: list, data: list, rounds: int):
         _v1 = mAdd(_v1, mAdd(_v10, _v0) ^ _v11)
     return int32ToInt8(_v0, 'big') + int32ToInt8(_v1, 'big')
 
+def speckEcbEncrypt(key: list, data: list):
+    # words are little-endian, as the bootloader reads them on AVR
+    _k, _l0, _l1, _l2 = struct.unpack('<4I', bytes(key))
+    _l = [_l0, _l1, _l2]
+    _y, _x = struct.unpack('<2I', bytes(data[:XTEA_BLOCK_SIZE]))
+    for idx in range(SPECK_ROUNDS):
+        _x = mAdd(mRotl(_x, 24), _y) ^ _k
+        _y = mRotl(_y, 3) ^ _x
+        _l[idx % 3] = mAdd(_k, mRotl(_l[idx % 3], 24)) ^ idx
+        _k = mRotl(_k, 3) ^ _l[idx % 3]
+    return list(struct.pack('<2I', _y, _x))
+
+def speckSelfTest():
+    # reference vector of Speck64/128
+    _key = list(struct.pack('<4I', 0x03020100, 0x0B0A0908, 0x13121110, 0x1B1A1918))
+    if speckEcbEncrypt(_key, list(struct.pack('<2I', 0x7475432D, 0x3B726574))) != list(struct.pack('<2I', 0x454E028B, 0x8C6FA548)):
+        raise SystemExit("ERROR: Speck self-test failed!!!")
+
 def xteaCfbEncryptBlock(ctx: XteaCtx):
-    _iv = xteaEcbEncrypt(ctx.key, ctx.iv, ctx.rounds)
+    if ctx.cipher == 'SPECK':
+        _iv = speckEcbEncrypt(ctx.key, ctx.iv)
+    else:
+        _iv = xteaEcbEncrypt(ctx.key, ctx.iv, ctx.rounds)
     ctx.data = [(ctx.data[idx] ^ _iv[idx]) for idx in range(XTEA_BLOCK_SIZE)]
     ctx.iv = ctx.data.copy()
     return ctx
 
-def xteaCfbInit(ctx: XteaCtx, key: list, iv: list, rounds: int = 32):
+def xteaCfbInit(ctx: XteaCtx, key: list, iv: list, rounds: int = 32, cipher: str = 'XTEA'):
     ctx.key = key.copy()
     ctx.iv = iv.copy()
     ctx.rounds = rounds
+    ctx.cipher = cipher
     ctx.dataLength = 0x00
     return ctx
 
@@ -238,6 +306,7 @@ def xteaCfbEncrypt(ctx: XteaCtx, data: list):
 
 def xteaCfbMacInit(ctx: XteaCtx, key: list, rounds: int = 32):
     ctx.rounds = rounds
+    ctx.cipher = 'XTEA'
     ctx.dataLength = 0x00
     ctx.key = [(key[idx] ^ 0x36) for idx in range(KEY_SIZE)]        # ipad
     ctx.secondKey = [(key[idx] ^ 0x5C) for idx in range(KEY_SIZE)]  # opad
@@ -268,6 +337,212 @@ def xteaCfbMacFinish(ctx: XteaCtx):
 def xteaCfbMacGet(ctx: XteaCtx):
     return ctx.iv.copy()
 
+def xteaCfbMac(key: list, rounds: int, data: list):
+    ctx = XteaCtx()
+    ctx = xteaCfbMacInit(ctx, key, rounds)
+    ctx = xteaCfbMacUpdate(ctx, data)
+    ctx = xteaCfbMacFinish(ctx)
+    return xteaCfbMacGet(ctx)
+
+def chainPages(key: list, rounds: int, data: list, pageSize: int):
+    _payload: list = []
+    _tag: list = []
+    for _start in reversed(range(0, len(data), pageSize)):
+        _page = data[_start:(_start + pageSize)]
+        _tag = xteaCfbMac(key, rounds, _page + _tag)
+        _payload = _tag + _page + _payload
+    return _payload
+
+def chaskeyPermute(v: list, rounds: int):
+    _v0, _v1, _v2, _v3 = v
+    for idx in range(rounds):
+        _v0 = mAdd(_v0, _v1); _v1 = mRotl(_v1, 5);  _v1 ^= _v0; _v0 = mRotl(_v0, 16)
+        _v2 = mAdd(_v2, _v3); _v3 = mRotl(_v3, 8);  _v3 ^= _v2
+        _v0 = mAdd(_v0, _v3); _v3 = mRotl(_v3, 13); _v3 ^= _v0
+        _v2 = mAdd(_v2, _v1); _v1 = mRotl(_v1, 7);  _v1 ^= _v2; _v2 = mRotl(_v2, 16)
+    return [_v0, _v1, _v2, _v3]
+
+def chaskeyTimesTwo(k: list):
+    _carry = 0x87 if (k[3] & 0x80000000) else 0x00
+    return [m32(k[0] << 1) ^ _carry, mLs(k[1], 1) | (k[0] >> 31), mLs(k[2], 1) | (k[1] >> 31), mLs(k[3], 1) | (k[2] >> 31)]
+
+def chaskeyMac(key: list, rounds: int, data: list):
+    # words are little-endian, as the bootloader reads them on AVR
+    _key = list(struct.unpack('<4I', bytes(key)))
+    _k1 = chaskeyTimesTwo(_key)
+    _v = _key.copy()
+    _pos = 0
+    while (len(data) - _pos) > CHASKEY_BLOCK_SIZE:
+        _m = struct.unpack('<4I', bytes(data[_pos:(_pos + CHASKEY_BLOCK_SIZE)]))
+        _v = chaskeyPermute([a ^ b for a, b in zip(_v, _m)], rounds)
+        _pos += CHASKEY_BLOCK_SIZE
+    _last = list(data[_pos:])
+    _subkey = _k1
+    if len(_last) < CHASKEY_BLOCK_SIZE:
+        _last += [0x01] + [0x00] * (CHASKEY_BLOCK_SIZE - len(_last) - 1)
+        _subkey = chaskeyTimesTwo(_k1)
+    _m = struct.unpack('<4I', bytes(_last))
+    _v = chaskeyPermute([a ^ b ^ c for a, b, c in zip(_v, _m, _subkey)], rounds)
+    _v = [a ^ b for a, b in zip(_v, _subkey)]
+    return list(struct.pack('<4I', *_v))
+
+def chaskeySelfTest():
+    # reference vectors of Chaskey (8 rounds) for messages 0, 1, 2, ... of length 0, 1 and 16
+    _key = list(struct.pack('<4I', 0x833D3433, 0x009F389F, 0x2398E64F, 0x417ACF39))
+    _vectors = [(0, [0x792E8FE5, 0x75CE87AA, 0x2D1450B5, 0x1191970B]),
+                (1, [0x13A9307B, 0x50E62C89, 0x4577BD88, 0xC0BBDC18]),
+                (16, [0x79271CA9, 0xD66A1C71, 0x81CA474E, 0x49831CAD])]
+    for _length, _mac in _vectors:
+        if chaskeyMac(_key, 8, list(range(_length))) != list(struct.pack('<4I', *_mac)):
+            raise SystemExit("ERROR: Chaskey self-test failed!!!")
+
+def crc16Ccitt(crc: int, data: list):
+    # CRC-16-CCITT of the CRCSCAN peripheral, MSB first, no final XOR
+    for _byte in data:
+        crc ^= _byte << 8
+        for _bit in range(8):
+            crc = ((crc << 1) ^ CRC_POLYNOMIAL) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+def appEnd(firmware: list, sparsePageSize):
+    # end of the application as programmed: the firmware, for the sparse payload
+    # the end of its last page with data (pages are programmed whole)
+    _end = len(firmware)
+    if sparsePageSize:
+        while _end and firmware[_end - 1] == 0xFF:
+            _end -= 1
+        _end = ((_end + sparsePageSize - 1) // sparsePageSize) * sparsePageSize
+    return _end
+
+def appChecksum(firmware: list, sparsePageSize):
+    # application as programmed, padded as erased Flash
+    _end = appEnd(firmware, sparsePageSize)
+    return crc16Ccitt(CRC_INIT, (firmware + [0xFF] * _end)[:_end])
+
+def sparsePayload(data: list, pageSize: int):
+    # pages with data only, format described in processSparseData() of the bootloader,
+    # must stay in sync with imageSparse() of the native packer
+    _out: list = []
+    _groups: int = 0
+    _maskAt: int = 0
+    for _page in range((len(data) + pageSize - 1) // pageSize):
+        _data = data[(_page * pageSize):((_page + 1) * pageSize)]
+        if all(_byte == 0xFF for _byte in _data):
+            continue
+        while _groups <= (_page // SPARSE_GROUP):
+            _maskAt = len(_out)
+            _out += [0x00] * XTEA_BLOCK_SIZE
+            _groups += 1
+        _out[_maskAt + ((_page % SPARSE_GROUP) // 8)] |= 1 << (_page % 8)
+        _out += _data + [0xFF] * (pageSize - len(_data))
+    return _out
+
+def objectPut(flat: bytearray, base: int, address: int, data: bytes):
+    # EEPROM, fuses and lock bits of the AVR toolchain are above OBJECT_FLASH_END
+    if address >= OBJECT_FLASH_END:
+        return
+    if (address < base) or ((address - base + len(data)) > OBJECT_MAX_SIZE):
+        raise SystemExit("ERROR: data at 0x%06X is outside Flash from 0x%04X" % (address, base))
+    flat[(address - base):(address - base + len(data))] = data
+    return address - base + len(data)
+
+def readIntelHex(path: str, flat: bytearray, base: int):
+    _size: int = 0
+    _offset: int = 0
+    for _line in open(path, "r"):
+        _line = _line.strip()
+        if not _line:
+            continue
+        try:
+            _record = bytes.fromhex(_line[1:])
+        except ValueError:
+            _record = b''
+        if (_line[0] != ':') or (len(_record) < 5) or ((_record[0] + 5) != len(_record)) or (sum(_record) & 0xFF):
+            raise SystemExit("ERROR: damaged Intel HEX record: %s" % _line)
+        match _record[3]:
+            case 0x00:
+                _size = max(_size, objectPut(flat, base, _offset + ((_record[1] << 8) | _record[2]), _record[4:-1]) or 0)
+            case 0x01:
+                break
+            case 0x02:
+                _offset = ((_record[4] << 8) | _record[5]) << 4
+            case 0x04:
+                _offset = ((_record[4] << 8) | _record[5]) << 16
+    return _size
+
+def readElf(path: str, flat: bytearray, base: int):
+    # PT_LOAD segments at their physical (load) addresses, initial values of .data follow the code
+    _size: int = 0
+    _elf = open(path, "rb").read()
+    if (_elf[0:4] != b'\x7fELF') or (_elf[4] != 1) or (_elf[5] != 1):
+        raise SystemExit("ERROR: not a 32-bit little-endian ELF file: %s" % path)
+    _phOffset = struct.unpack_from('<I', _elf, 28)[0]
+    _phSize, _phCount = struct.unpack_from('<HH', _elf, 42)
+    for _idx in range(_phCount):
+        _type, _offset, _vaddr, _paddr, _fileSize = struct.unpack_from('<IIIII', _elf, _phOffset + (_idx * _phSize))
+        if (_type == 1) and _fileSize:
+            _size = max(_size, objectPut(flat, base, _paddr, _elf[_offset:(_offset + _fileSize)]) or 0)
+    return _size
+
+def loadFirmware(path: str, base: int):
+    # flat binary, or Intel HEX / ELF file linked at 'base' with gaps between sections erased
+    try:
+        if path.lower().endswith('.bin'):
+            return list(open(path, "rb").read())
+        _flat = bytearray([0xFF] * OBJECT_MAX_SIZE)
+        _size = readIntelHex(path, _flat, base) if path.lower().endswith('.hex') else readElf(path, _flat, base)
+        return list(_flat[:_size])
+    except (OSError, struct.error) as err:
+        raise SystemExit("ERROR: %s while trying to read from file: %s" % (repr(err), path))
+
+def lzCompress(data: list):
+    # greedy LZ, format described in processCompressedData() of the bootloader,
+    # must stay in sync with imageLzCompress() of the native packer
+    _out: list = []
+    _literals: list = []
+    _table: dict = {}
+    _idx: int = 0
+    _size: int = len(data)
+    def _flush():
+        if len(_literals) != 0:
+            _out.append(len(_literals) - 1)
+            _out.extend(_literals)
+            _literals.clear()
+    def _insert(pos: int):
+        if (pos + LZ_MIN_MATCH) <= _size:
+            _table.setdefault(tuple(data[pos:(pos + LZ_MIN_MATCH)]), []).append(pos)
+    while _idx < _size:
+        _bestLen: int = 0
+        _bestDist: int = 0
+        if (_idx + LZ_MIN_MATCH) <= _size:
+            _maxLen = min(LZ_MAX_MATCH, _size - _idx)
+            for _pos in reversed(_table.get(tuple(data[_idx:(_idx + LZ_MIN_MATCH)]), [])[-LZ_MAX_CANDIDATES:]):
+                if (_idx - _pos) > LZ_MAX_DISTANCE:
+                    break
+                _len = 0
+                while (_len < _maxLen) and (data[_pos + _len] == data[_idx + _len]):
+                    _len += 1
+                if _len > _bestLen:
+                    _bestLen = _len
+                    _bestDist = _idx - _pos
+                    if _len == _maxLen:
+                        break
+        if _bestLen > LZ_MIN_MATCH:
+            _flush()
+            _out += [0x80 | (_bestLen - LZ_MIN_MATCH), _bestDist & 0xFF, _bestDist >> 8]
+            for _pos in range(_idx, _idx + _bestLen):
+                _insert(_pos)
+            _idx += _bestLen
+        else:
+            _literals.append(data[_idx])
+            if len(_literals) == LZ_MAX_LITERALS:
+                _flush()
+            _insert(_idx)
+            _idx += 1
+    _flush()
+    return _out
+
 def timeStamp():
     _date = datetime.now()
     _timestamp = mLs((_date.year & 0x00000FFF), 20)
@@ -285,6 +560,20 @@ def checkRoundsRange(value):
         raise SystemExit("ERROR: %s is outside the allowable range for the 'rounds' parameter 20-255" % value)
     return inValue
 
+def checkMacRoundsRange(value):
+    # XTEA needs at least 20 rounds, checked once the MAC type is known
+    inValue = int(value)
+    if not(CHASKEY_ROUNDS <= inValue <= 255):
+        raise SystemExit("ERROR: %s is outside the allowable range for the 'rounds' parameter %s-255" % (value, CHASKEY_ROUNDS))
+    return inValue
+
+def checkMacType(value):
+    inValue = str(value.upper())
+    allowedValues = ['XTEA', 'CHASKEY']
+    if not(inValue in allowedValues):
+        raise SystemExit("ERROR: %s is unsupported MAC type!!!" % inValue)
+    return inValue
+
 def checkKeyValue(value):
     if not(all(char in string.hexdigits for char in value)):
         raise SystemExit("ERROR: key value is not a hexadecimal string")
@@ -292,9 +581,34 @@ def checkKeyValue(value):
         raise SystemExit("ERROR: Correct key length is 16 bytes, and there are: %s bytes." % str(len(value) / 2))
     return str(value)
 
+def checkIvValue(value):
+    if not(all(char in string.hexdigits for char in value)):
+        raise SystemExit("ERROR: IV value is not a hexadecimal string")
+    if len(value) != (2 * IV_SIZE):
+        raise SystemExit("ERROR: Correct IV length is %s bytes, and there are: %s bytes." % (IV_SIZE, str(len(value) / 2)))
+    return str(value)
+
+def checkTimeStampValue(value):
+    inValue = int(value, 16)
+    if not(0 <= inValue < M32):
+        raise SystemExit("ERROR: %s is outside the allowable range for the 'timeStamp' parameter" % value)
+    return inValue
+
+def checkPageSize(value):
+    inValue = int(value)
+    if not(inValue in [64, 128]):
+        raise SystemExit("ERROR: Flash page size should be 64 (tinyAVR) or 128 (megaAVR) bytes, and there are: %s" % value)
+    return inValue
+
+def checkFlashSize(value):
+    inValue = int(value, 0)
+    if not(inValue in [0x1000, 0x2000, 0x4000, 0x8000, 0xC000]):
+        raise SystemExit("ERROR: Flash size should be 4096, 8192, 16384, 32768 or 49152 bytes, and there are: %s" % value)
+    return inValue
+
 def checkCipherType(value):
     inValue = str(value.upper())
-    allowedValues = ['NONE', 'XTEA']
+    allowedValues = ['NONE', 'XTEA', 'SPECK']
     if not(inValue in allowedValues):
         raise SystemExit("ERROR: %s is unsupported encryption mode!!!" % inValue)
     return inValue
@@ -302,46 +616,90 @@ def checkCipherType(value):
 def checkFileType(value):
     inFile = Path(value)
     if inFile.is_file():
-        if not(str(inFile).endswith('.bin')):
-            raise SystemExit("ERROR: Specified file is NOT a '*.bin' type file: %s" % value)
+        if not(str(inFile).lower().endswith(('.bin', '.hex', '.elf'))):
+            raise SystemExit("ERROR: Specified file is NOT a '*.bin', '*.hex' or '*.elf' type file: %s" % value)
     else:
         raise SystemExit("ERROR: Specified file does not exist: %s" % value)
     return str(value)
 
 parser = argparse.ArgumentParser()
-parser.add_argument("--cipher", type = checkCipherType, required = False, nargs = '?', const = 1, default = 'NONE', help = "firmware encryption algorithm: [NONE, XTEA]")
-parser.add_argument("--newKey", type = checkKeyValue, required = False, help = "NEW [XTEA] cryptographic key to be included in the firmware image [32 hex characters -> 16 bytes]")
-parser.add_argument("--macRounds", type = checkRoundsRange, required = False, nargs = '?', const = 1, default = 32, help = "number of XTEA rounds for computing MAC code [20-255]")
-parser.add_argument("--cipherRounds", type = checkRoundsRange, required = False, nargs = '?', const = 1, default = 32, help = "number of XTEA rounds for encryption [20-255]")
+parser.add_argument("--cipher", type = checkCipherType, required = False, nargs = '?', const = 1, default = 'NONE', help = "firmware encryption algorithm: [NONE, XTEA, SPECK (Speck64/128)]")
+parser.add_argument("--newKey", type = checkKeyValue, required = False, help = "NEW [XTEA/SPECK] cryptographic key to be included in the firmware image [32 hex characters -> 16 bytes]")
+parser.add_argument("--mac", type = checkMacType, required = False, default = 'XTEA', help = "MAC algorithm: [XTEA (CFB-MAC), CHASKEY]")
+parser.add_argument("--macRounds", type = checkMacRoundsRange, required = False, help = "number of XTEA rounds for computing MAC code [20-255, default 32] or Chaskey permutation rounds [12-255, default 12]")
+parser.add_argument("--cipherRounds", type = checkRoundsRange, required = False, help = "number of XTEA rounds for encryption [20-255, default 32], Speck64/128 has always 27 rounds")
 parser.add_argument("--key", type = checkKeyValue, required = True, help = "current encryption/MAC key [32 hex characters -> 16 bytes]")
-parser.add_argument("--file", type = checkFileType, required = True, help = "firmware file to be processed")
+parser.add_argument("--iv", type = checkIvValue, required = False, help = "fixed IV instead of a random one, for reproducible images [16 hex characters -> 8 bytes]")
+parser.add_argument("--timeStamp", type = checkTimeStampValue, required = False, help = "fixed packed time stamp instead of the current time [hex]")
+parser.add_argument("--pageChain", type = checkPageSize, required = False, help = "emit page chained image (every Flash page authenticated separately) for given Flash page size [64, 128]")
+parser.add_argument("--compress", action = 'store_true', help = "LZ compress firmware before encryption")
+parser.add_argument("--sparse", type = checkPageSize, required = False, help = "emit only Flash pages with data (bootloader built with SPARSE=1) for given Flash page size [64, 128]")
+parser.add_argument("--crc", type = checkFlashSize, required = False, help = "embed the checksum of the application checked by bootloader built with CRC=1, for given Flash size [bytes]")
+parser.add_argument("--file", type = checkFileType, required = True, help = "firmware file to be processed [*.bin, or *.hex / *.elf linked for the application section]")
 args = parser.parse_args()
 
 cipherKey: list = list(bytearray.fromhex(args.key))
 fwCtx = FirmwareCtx()
-fwCtx.ivLoad(list(bytearray(os.urandom(IV_SIZE))))
+fwCtx.ivLoad(list(bytearray.fromhex(args.iv)) if args.iv else list(bytearray(os.urandom(IV_SIZE))))
+if args.timeStamp is not None:
+    fwCtx.timeStamp = int32ToInt8(args.timeStamp, 'little')
 fwCtx.setEncryption(args.cipher)
-fwCtx.cipherRounds = args.cipherRounds
-fwCtx.macRounds = args.macRounds
+if args.cipher == 'SPECK':
+    if (args.cipherRounds is not None) and (args.cipherRounds != SPECK_ROUNDS):
+        raise SystemExit("ERROR: Speck64/128 takes exactly %s rounds" % SPECK_ROUNDS)
+    speckSelfTest()
+    fwCtx.cipherRounds = SPECK_ROUNDS
+else:
+    fwCtx.cipherRounds = 32 if args.cipherRounds is None else args.cipherRounds
+
+if args.mac == 'CHASKEY':
+    if args.pageChain:
+        raise SystemExit("ERROR: Page chained firmware uses XTEA page tags, Chaskey MAC covers only whole image!!!")
+    chaskeySelfTest()
+    fwCtx.mode |= 0x80
+    fwCtx.macRounds = CHASKEY_ROUNDS if args.macRounds is None else args.macRounds
+else:
+    fwCtx.macRounds = 32 if args.macRounds is None else checkRoundsRange(args.macRounds)
+
+if args.pageChain:
+    fwCtx.mode |= 0xC0
+    fwCtx.rfu[0] = args.pageChain // XTEA_BLOCK_SIZE
 
 if args.newKey:
     _temp: list = list(bytearray.fromhex(args.newKey))
-    fwCtx.newKeyLoad(_temp, 'XTEA')
+    fwCtx.newKeyLoad(_temp, 'SPECK' if args.cipher == 'SPECK' else 'XTEA')
+
+fwCtx.firmware = loadFirmware(args.file, BOOT_SIZE)
+fwCtx.firmwareSize = len(fwCtx.firmware)
+
+if args.crc:
+    if appEnd(fwCtx.firmware, args.sparse) > args.crc - BOOT_SIZE - CRC_SIZE:
+        raise SystemExit("ERROR: Application reaches the last %s bytes of Flash, where the bootloader stores its checksum!!!" % CRC_SIZE)
+    _crc = appChecksum(fwCtx.firmware, args.sparse)
+    fwCtx.rfu[2] = _crc >> 8
+    fwCtx.rfu[3] = _crc & 0xFF
+
+if args.compress:
+    if args.pageChain:
+        raise SystemExit("ERROR: Compressed firmware cannot be page chained!!!")
+    fwCtx.firmware = lzCompress(fwCtx.firmware)
+    fwCtx.firmwareSize = len(fwCtx.firmware)
+    fwCtx.rfu[1] = 0x01
 
-try:
-    inFile = open(args.file, "rb")
-    fwCtx.firmware = list(inFile.read())
+if args.sparse:
+    if args.compress or args.pageChain:
+        raise SystemExit("ERROR: Sparse firmware cannot be compressed or page chained!!!")
+    fwCtx.firmware = sparsePayload(fwCtx.firmware, args.sparse)
     fwCtx.firmwareSize = len(fwCtx.firmware)
-    inFile.close()
-except Exception as err:
-    raise SystemExit("ERROR: %s while trying to read from file: %s" % (repr(err), args.file))
+    fwCtx.rfu[0] = args.sparse // XTEA_BLOCK_SIZE
+    fwCtx.rfu[1] = 0x02
 
 ctx = XteaCtx()
-ctx = xteaCfbInit(ctx, cipherKey, fwCtx.cipherIv, fwCtx.cipherRounds)
+ctx = xteaCfbInit(ctx, cipherKey, fwCtx.cipherIv, fwCtx.cipherRounds, 'SPECK' if args.cipher == 'SPECK' else 'XTEA')
 match ((fwCtx.mode >> 2) & 0x03):
     case 0x00:
         pass
-    case 0x01:
+    case 0x01 | 0x03:
         ctx, fwCtx.newKey = xteaCfbEncrypt(ctx, fwCtx.newKey)
     case _:
         raise SystemExit("ERROR: This mode is currently not allowed!!!")
@@ -349,17 +707,22 @@ if len(fwCtx.firmware) != 0:
     match (fwCtx.mode & 0x03):
         case 0x00:
             pass
-        case 0x01:
+        case 0x01 | 0x03:
             ctx, fwCtx.firmware = xteaCfbEncrypt(ctx, fwCtx.firmware)
         case _:
             raise SystemExit("ERROR: This mode is currently not allowed!!!")
-if not(fwCtx.mode & 0x40):
+if (fwCtx.mode & 0xC0) == 0x00:
     ctx = xteaCfbMacInit(ctx, cipherKey, fwCtx.macRounds)
     ctx = xteaCfbMacUpdate(ctx, fwCtx.getDescrData())
     if len(fwCtx.firmware) != 0:
         ctx = xteaCfbMacUpdate(ctx, fwCtx.firmware)
     ctx = xteaCfbMacFinish(ctx)
     fwCtx.firmwareMacLoad(xteaCfbMacGet(ctx))
+elif (fwCtx.mode & 0xC0) == 0x80:
+    fwCtx.firmwareMacLoad(chaskeyMac(cipherKey, fwCtx.macRounds, fwCtx.getDescrData() + fwCtx.firmware)[:8])
+elif (fwCtx.mode & 0xC0) == 0xC0:
+    fwCtx.payload = chainPages(cipherKey, fwCtx.macRounds, fwCtx.firmware, args.pageChain)
+    fwCtx.firmwareMacLoad(xteaCfbMac(cipherKey, fwCtx.macRounds, fwCtx.getDescrData() + fwCtx.payload[:XTEA_BLOCK_SIZE]))
 else:
     raise SystemExit("ERROR: This mode is currently not allowed!!!")
 
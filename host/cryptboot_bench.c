@@ -0,0 +1,407 @@
+/**
+ * \file    cryptboot_bench.c
+ * \brief   Host microbenchmarks of xtea.h primitives: ECB encryption, CFB decryption
+ *          and CFB-MAC, for round counts accepted by firmware_creator.py (20-255),
+ *          of the chaskey.h MAC for 8, 12 (default) and 16 permutation rounds and of Speck64/128
+ *          (speck.h, 27 rounds) ECB encryption and CFB decryption, on data sizes from one Flash page
+ *          to the whole application section.
+ *          Results are written as JSON; with --baseline the run fails if any case
+ *          is slower than the baseline by more than --threshold percent.
+ *
+ *          Throughput depends on the host, so cases are compared by 'score' - throughput
+ *          relative to a calibration loop of 32-bit add/shift/xor operations measured
+ *          just before - rather than by bytes per second.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES()      __rdtsc()
+#else
+#define BENCH_CYCLES()      0
+#endif
+
+#include "image.h"
+
+#define BENCH_PAGE_SIZE             64                                  // MAPPED_PROGMEM_PAGE_SIZE of the default target
+#define BENCH_APPLICATION_SIZE      (0x4000 - IMAGE_BOOT_SIZE)          // MAPPED_APPLICATION_SIZE of the default target
+#define BENCH_MIN_TIME_MS           20
+#define BENCH_REPEATS               5
+#define BENCH_THRESHOLD             20.0
+#define BENCH_MAX_CASES             128
+#define BENCH_NAME_SIZE             64
+
+typedef enum benchOp
+{
+    benchEcb,
+    benchCfbDecrypt,
+    benchCfbMac,
+    benchChaskeyMac,
+    benchSpeckEcb,
+    benchSpeckCfbDecrypt,
+} benchOp_t;
+
+/**
+ * \brief Result of a single benchmark case.
+ */
+typedef struct benchResult
+{
+    char                name[BENCH_NAME_SIZE];
+    const char        * op;
+    unsigned            rounds;
+    uint32_t            size;
+    double              bytesPerSec;
+    double              cyclesPerByte;
+    double              score;
+} benchResult_t;
+
+static const char * const   opNames[] = { "ecb", "cfb_decrypt", "cfb_mac", "chaskey_mac", "speck_ecb", "speck_cfb_decrypt" };
+static const unsigned       roundCounts[] = { 20, 32, 64, 128, 255 };
+static const unsigned       chaskeyRoundCounts[] = { 8, CHASKEY_ROUNDS, 16 };
+static const unsigned       speckRoundCounts[] = { SPECK_ROUNDS };
+static const uint32_t       sizes[] = { BENCH_PAGE_SIZE, 1024, 4096, BENCH_APPLICATION_SIZE };
+static const uint8_t        key[XTEA_KEY_SIZE] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                                   0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F };
+static uint8_t              data[BENCH_APPLICATION_SIZE];
+static volatile uint32_t    sink;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * \brief Single pass of the operation over 'size' bytes of data.
+ */
+static void runOnce(benchOp_t op, unsigned rounds, uint32_t size)
+{
+    xteaCtx_t   ctx;
+
+    switch (op)
+    {
+        case benchEcb:
+            xteaSetKey(&ctx.cipher.base, key);
+            ctx.cipher.base.rounds = rounds;
+            for (uint32_t offset = 0; offset < size; offset += XTEA_BLOCK_SIZE)
+            {
+                xteaEcbEncryptCtx(&ctx.cipher.base, data + offset, data + offset);
+            }
+            break;
+        case benchCfbDecrypt:
+            xteaSetKey(&ctx.cipher.base, key);
+            xteaSetIv(&ctx.cipher, key);
+            ctx.cipher.base.rounds = rounds;
+            ctx.cipher.base.operation = xteaDecrypt;
+            xteaCfbBuffer(&ctx.cipher, data, size);
+            break;
+        case benchCfbMac:
+            xteaCfbMacInit(&ctx, key, rounds);
+            xteaCfbMacUpdate(&ctx, data, size);
+            xteaCfbMacFinish(&ctx);
+            sink += ctx.data[0];
+            break;
+        case benchChaskeyMac:
+        {
+            chaskeyCtx_t    chaskey;
+
+            chaskeyMacInit(&chaskey, key, (uint_fast8_t)rounds);
+            chaskeyMacUpdate(&chaskey, data, size);
+            chaskeyMacFinish(&chaskey);
+            sink += chaskey.state.u8[0];
+            break;
+        }
+        case benchSpeckEcb:
+        case benchSpeckCfbDecrypt:
+        {
+            speckCtx_t      speck;
+            uint8_t         iv[SPECK_IV_SIZE];
+
+            speckSetKey(&speck, key);                               // number of rounds is fixed
+            if (op == benchSpeckEcb)
+            {
+                for (uint32_t offset = 0; offset < size; offset += SPECK_BLOCK_SIZE)
+                {
+                    speckEcbEncrypt(&speck, data + offset, data + offset);
+                }
+            } else
+            {
+                speck.operation = speckDecrypt;
+                memcpy(iv, key, SPECK_IV_SIZE);
+                speckCfbBuffer(&speck, iv, data, size);
+            }
+            break;
+        }
+    }
+    sink += data[0];
+}
+
+/**
+ * \brief   Calibration loop: 32-bit add/shift/xor chain similar in kind (not in content) to XTEA.
+ *
+ * \return calibration operations per second
+ */
+static double calibrate(uint64_t minNs)
+{
+    uint64_t    iterations = 0;
+    uint64_t    start = nowNs();
+    uint64_t    elapsed;
+    uint32_t    a = sink | 1;
+    uint32_t    b = 0x12345678;
+
+    do
+    {
+        for (unsigned idx = 0; idx < 4096; idx++)
+        {
+            a += ((b << 3) ^ (b >> 7)) + b + idx;
+            b += ((a << 5) ^ (a >> 2)) ^ 0x5A5A5A5A;
+        }
+        iterations += 4096;
+        elapsed = nowNs() - start;
+    } while (elapsed < minNs);
+    sink += a ^ b;
+
+    return (double)iterations * 1e9 / (double)elapsed;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    return (*(const double *)a > *(const double *)b) - (*(const double *)a < *(const double *)b);
+}
+
+/**
+ * \brief   Repeat the operation for at least 'minNs', BENCH_REPEATS runs.
+ *          Every run is preceded by a calibration run, so that the score is not affected
+ *          by changes of the host speed during the benchmark (frequency scaling, other load).
+ *
+ * \return best time of a single pass in ns, 'cycles' gets the TSC cycles of that pass
+ *         and 'score' the median ratio of throughput to calibration
+ */
+static double measure(benchOp_t op, unsigned rounds, uint32_t size, uint64_t minNs, double *cycles, double *score)
+{
+    double  best = 0;
+    double  scores[BENCH_REPEATS];
+
+    *cycles = 0;
+    for (unsigned repeat = 0; repeat < BENCH_REPEATS; repeat++)
+    {
+        double      calibration = calibrate(minNs / 2);
+        uint64_t    passes = 0;
+        uint64_t    start = nowNs();
+        uint64_t    startCycles = BENCH_CYCLES();
+        uint64_t    elapsed;
+
+        do
+        {
+            runOnce(op, rounds, size);
+            passes++;
+            elapsed = nowNs() - start;
+        } while (elapsed < minNs);
+
+        double  pass = (double)elapsed / (double)passes;
+
+        if ((repeat == 0) || (pass < best))
+        {
+            best = pass;
+            *cycles = (double)(BENCH_CYCLES() - startCycles) / (double)passes;
+        }
+        scores[repeat] = (double)size * 1e9 / pass / calibration;
+    }
+    qsort(scores, BENCH_REPEATS, sizeof(double), compareDouble);
+    *score = scores[BENCH_REPEATS / 2];
+
+    return best;
+}
+
+/**
+ * \brief   Read 'score' of every case from a JSON file written by this tool.
+ *
+ * \return score of the case, or a negative value if the case is not in the baseline
+ */
+static double baselineScore(FILE *file, const char *name)
+{
+    char    line[512];
+    char    pattern[BENCH_NAME_SIZE + 16];
+
+    snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+    rewind(file);
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        const char * score = strstr(line, "\"score\": ");
+
+        if ((strstr(line, pattern) != NULL) && (score != NULL))
+        {
+            return strtod(score + strlen("\"score\": "), NULL);
+        }
+    }
+
+    return -1.0;
+}
+
+static void writeJson(FILE *file, const benchResult_t *results, size_t count)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"tool\": \"cryptboot_bench\",\n");
+    fprintf(file, "  \"results\": [\n");
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        const benchResult_t * result = &results[idx];
+
+        fprintf(file, "    { \"name\": \"%s\", \"op\": \"%s\", \"rounds\": %u, \"size\": %u, "
+                      "\"bytesPerSec\": %.6e, \"cyclesPerByte\": %.3f, \"score\": %.6e }%s\n",
+                result->name, result->op, result->rounds, result->size,
+                result->bytesPerSec, result->cyclesPerByte, result->score, ((idx + 1) < count) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [--json FILE] [--baseline FILE] [--threshold PERCENT] [--min-time MS] [--filter TEXT]\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        { "json",           required_argument,  NULL, 'j' },
+        { "baseline",       required_argument,  NULL, 'b' },
+        { "threshold",      required_argument,  NULL, 't' },
+        { "min-time",       required_argument,  NULL, 'm' },
+        { "filter",         required_argument,  NULL, 'f' },
+        { NULL,             0,                  NULL, 0   }
+    };
+    static benchResult_t    results[BENCH_MAX_CASES];
+    const char            * jsonPath = NULL;
+    const char            * baselinePath = NULL;
+    const char            * filter = NULL;
+    double                  threshold = BENCH_THRESHOLD;
+    uint64_t                minNs = BENCH_MIN_TIME_MS * 1000000ULL;
+    size_t                  count = 0;
+    int                     result = EXIT_SUCCESS;
+    int                     opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'j': jsonPath = optarg;                                            break;
+            case 'b': baselinePath = optarg;                                        break;
+            case 't': threshold = strtod(optarg, NULL);                             break;
+            case 'm': minNs = strtoull(optarg, NULL, 0) * 1000000ULL;               break;
+            case 'f': filter = optarg;                                              break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    for (uint32_t idx = 0; idx < sizeof(data); idx++)
+    {
+        data[idx] = (uint8_t)((idx * 131) ^ (idx >> 8));
+    }
+
+    for (unsigned op = 0; op < (sizeof(opNames) / sizeof(opNames[0])); op++)
+    {
+        const unsigned    * rounds = roundCounts;
+        unsigned            roundsCount = sizeof(roundCounts) / sizeof(roundCounts[0]);
+
+        if (op == benchChaskeyMac)
+        {
+            rounds = chaskeyRoundCounts;
+            roundsCount = sizeof(chaskeyRoundCounts) / sizeof(chaskeyRoundCounts[0]);
+        } else if (op >= benchSpeckEcb)
+        {
+            rounds = speckRoundCounts;
+            roundsCount = sizeof(speckRoundCounts) / sizeof(speckRoundCounts[0]);
+        }
+
+        for (unsigned r = 0; r < roundsCount; r++)
+        {
+            for (unsigned s = 0; s < (sizeof(sizes) / sizeof(sizes[0])); s++)
+            {
+                benchResult_t * current = &results[count];
+                double          cycles;
+
+                snprintf(current->name, sizeof(current->name), "%s/r%u/s%u", opNames[op], rounds[r], sizes[s]);
+                if ((filter != NULL) && (strstr(current->name, filter) == NULL))
+                {
+                    continue;
+                }
+
+                double  ns = measure((benchOp_t)op, rounds[r], sizes[s], minNs, &cycles, &current->score);
+
+                current->op = opNames[op];
+                current->rounds = rounds[r];
+                current->size = sizes[s];
+                current->bytesPerSec = (double)sizes[s] * 1e9 / ns;
+                current->cyclesPerByte = cycles / (double)sizes[s];
+                fprintf(stderr, "%-28s %10.2f MB/s %8.2f cycles/B\n", current->name, current->bytesPerSec / 1e6, current->cyclesPerByte);
+                count++;
+            }
+        }
+    }
+
+    if (jsonPath != NULL)
+    {
+        FILE * file = fopen(jsonPath, "w");
+
+        if (file == NULL)
+        {
+            fprintf(stderr, "ERROR: %s while trying to write to file: %s\n", strerror(errno), jsonPath);
+            return EXIT_FAILURE;
+        }
+        writeJson(file, results, count);
+        fclose(file);
+    } else
+    {
+        writeJson(stdout, results, count);
+    }
+
+    if (baselinePath != NULL)
+    {
+        FILE      * file = fopen(baselinePath, "r");
+        unsigned    regressions = 0;
+
+        if (file == NULL)
+        {
+            fprintf(stderr, "ERROR: %s while trying to read from file: %s\n", strerror(errno), baselinePath);
+            return EXIT_FAILURE;
+        }
+        for (size_t idx = 0; idx < count; idx++)
+        {
+            double  baseline = baselineScore(file, results[idx].name);
+            double  change = (baseline > 0) ? (100.0 * ((results[idx].score / baseline) - 1.0)) : 0.0;
+
+            if ((baseline > 0) && (change < -threshold))
+            {
+                fprintf(stderr, "REGRESSION: %s is %.1f%% slower than baseline (threshold %.1f%%)\n", results[idx].name, -change, threshold);
+                regressions++;
+            }
+        }
+        fclose(file);
+        fprintf(stderr, "%zu cases, %u regressions against %s\n", count, regressions, baselinePath);
+        if (regressions)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+
+    return result;
+}
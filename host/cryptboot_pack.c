@@ -0,0 +1,740 @@
+/**
+ * \file    cryptboot_pack.c
+ * \brief   Native, multi-threaded counterpart of firmware_creator.py.
+ *          Produces byte-identical '*.crypted.bin' and '*.aligned.bin' files
+ *          (for the same IV and time stamp) and can build a whole batch
+ *          of per-device images described by a manifest file.
+ *
+ *          Manifest: one job per line, fields separated by white space,
+ *          '#' starts a comment:
+ *              <firmware.bin> <key> <newKey|-> <cipherRounds> <macRounds> [outputBase]
+ *          'outputBase' defaults to the firmware file stem in current directory.
+ *
+ *          Firmware may be given as Intel HEX or ELF file linked for the application section
+ *          (from BOOT_SIZE), gaps between its sections are erased Flash. With --sparse they are
+ *          left out of the image.
+ *
+ *          With --directory the tool lays out already built '*.crypted.bin' images
+ *          in one external memory file behind an image directory (bootloader built with SLOTS=N).
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+#define PACK_PATH_SIZE      4096
+
+/**
+ * \brief Single entry of the batch.
+ */
+typedef struct packJob
+{
+    imageJob_t          image;
+    char                file[PACK_PATH_SIZE];
+    char                outBase[PACK_PATH_SIZE];
+    int                 status;
+} packJob_t;
+
+/**
+ * \brief Shared state of the worker threads.
+ */
+typedef struct packQueue
+{
+    packJob_t         * jobs;
+    size_t              count;
+    size_t              next;
+} packQueue_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s --key KEY --file FIRMWARE.bin|.hex|.elf [--cipher NONE|XTEA|SPECK] [--newKey KEY] [--mac XTEA|CHASKEY]\n"
+        "          [--cipherRounds 20-255 (SPECK: 27)] [--macRounds 20-255 (CHASKEY: 12-255)] [--iv IV] [--timeStamp HEX]\n"
+        "          [--pageChain PAGE_SIZE | --compress | --sparse PAGE_SIZE] [--crc FLASH_SIZE]\n"
+        "       %s --manifest FILE [--cipher NONE|XTEA|SPECK] [--mac XTEA|CHASKEY] [--timeStamp HEX] [--pageChain PAGE_SIZE | --compress | --sparse PAGE_SIZE]\n"
+        "          [--jobs N] [--crc FLASH_SIZE]\n"
+        "       %s --directory MEMORY.bin [--mem-size BYTES] IMAGE.crypted.bin...\n",
+        name, name, name);
+}
+
+static bool parseRoundsFrom(const char *text, uint8_t *rounds, long minimum)
+{
+    char  * end;
+    long    value = strtol(text, &end, 0);
+
+    if ((*end != 0) || (value < minimum) || (value > 255))
+    {
+        fprintf(stderr, "ERROR: %s is outside the allowable range for the 'rounds' parameter %ld-255\n", text, minimum);
+        return false;
+    }
+    *rounds = (uint8_t)value;
+
+    return true;
+}
+
+static bool parseRounds(const char *text, uint8_t *rounds)
+{
+    return parseRoundsFrom(text, rounds, 20);
+}
+
+/**
+ * \brief Parse cipher rounds, Speck64/128 has a fixed number of them.
+ */
+static bool parseCipherRounds(const char *text, uint8_t mode, uint8_t *rounds)
+{
+    if ((mode & IMAGE_MODE_CIPHER_gm) == IMAGE_MODE_CIPHER_SPECK)
+    {
+        if (strtol(text, NULL, 0) != SPECK_ROUNDS)
+        {
+            fprintf(stderr, "ERROR: Speck64/128 takes exactly %d rounds, not %s\n", SPECK_ROUNDS, text);
+            return false;
+        }
+        *rounds = SPECK_ROUNDS;
+        return true;
+    }
+
+    return parseRounds(text, rounds);
+}
+
+/**
+ * \brief New key is encrypted in the CFB chain of the firmware cipher (XTEA if there is none).
+ */
+static uint8_t newKeyMode(uint8_t mode)
+{
+    uint8_t     newKey = ((mode & IMAGE_MODE_CIPHER_gm) == IMAGE_MODE_CIPHER_SPECK) ? IMAGE_MODE_NEWKEY_SPECK : IMAGE_MODE_NEWKEY_XTEA;
+
+    return (mode & ~IMAGE_MODE_NEWKEY_gm) | newKey;
+}
+
+/**
+ * \brief Parse MAC rounds, Chaskey counts permutation rounds and allows fewer of them than XTEA.
+ */
+static bool parseMacRounds(const char *text, uint8_t mode, uint8_t *rounds)
+{
+    bool    chaskey = ((mode & IMAGE_MODE_MAC_TYPE_gm) == IMAGE_MODE_MAC_CHASKEY);
+
+    return parseRoundsFrom(text, rounds, chaskey ? CHASKEY_ROUNDS : 20);
+}
+
+static bool parseKey(const char *text, uint8_t key[XTEA_KEY_SIZE])
+{
+    if (!imageParseHex(text, key, XTEA_KEY_SIZE))
+    {
+        fprintf(stderr, "ERROR: key value is not a %d-byte hexadecimal string: %s\n", XTEA_KEY_SIZE, text);
+        return false;
+    }
+
+    return true;
+}
+
+static int writeFile(const char *path, const uint8_t *prefix, size_t prefixSize, const uint8_t *data, size_t size)
+{
+    int     fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int     result = 0;
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: %s while trying to write to file: %s\n", strerror(errno), path);
+        return -1;
+    }
+
+    if (((prefixSize != 0) && (write(fd, prefix, prefixSize) != (ssize_t)prefixSize))
+        || (write(fd, data, size) != (ssize_t)size))
+    {
+        fprintf(stderr, "ERROR: %s while trying to write to file: %s\n", strerror(errno), path);
+        result = -1;
+    }
+    close(fd);
+
+    return result;
+}
+
+/**
+ * \brief Read a whole '*.crypted.bin' image.
+ *
+ * \return image allocated with malloc(), or NULL on error
+ */
+static uint8_t *readImage(const char *path, uint32_t *size)
+{
+    FILE      * file = fopen(path, "rb");
+    uint8_t   * image = NULL;
+    long        length = -1;
+
+    if ((file != NULL) && (fseek(file, 0, SEEK_END) == 0))
+    {
+        length = ftell(file);
+        rewind(file);
+    }
+    if ((length >= IMAGE_CONTROL_DATA_SIZE) && ((image = malloc((size_t)length)) != NULL)
+        && (fread(image, 1, (size_t)length, file) != (size_t)length))
+    {
+        free(image);
+        image = NULL;
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    if (image == NULL)
+    {
+        fprintf(stderr, "ERROR: cannot read image: %s\n", path);
+    }
+    *size = (uint32_t)length;
+
+    return image;
+}
+
+/**
+ * \brief   Build the content of external memory with an image directory: entry 'n' holds
+ *          the little-endian address of the descriptor of image 'n', other entries are unused.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int packDirectory(const char *path, uint32_t memorySize, char *const images[], int count)
+{
+    uint8_t   * memory;
+    uint8_t   * image;
+    uint32_t    size;
+    uint32_t    address;
+    uint32_t    freeAt = IMAGE_DIRECTORY_AT + (IMAGE_SLOTS_MAX * sizeof(uint32_t));
+    int         result = 0;
+
+    if ((count < 1) || (count > IMAGE_SLOTS_MAX))
+    {
+        fprintf(stderr, "ERROR: directory takes 1-%d images\n", IMAGE_SLOTS_MAX);
+        return -1;
+    }
+    if ((memory = malloc(memorySize)) == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return -1;
+    }
+    memset(memory, 0xFF, memorySize);
+
+    for (int idx = 0; (idx < count) && (result == 0); idx++)
+    {
+        if ((image = readImage(images[idx], &size)) == NULL)
+        {
+            result = -1;
+            break;
+        }
+        address = imageSlotAddress(freeAt, size, memorySize);
+        if (address != IMAGE_SLOT_UNUSED)
+        {
+            memcpy(memory + address, image, size);
+            imagePutU32(memory + IMAGE_DIRECTORY_AT + (idx * sizeof(uint32_t)), address);
+            printf("slot %d: 0x%05X %s\n", idx, address, images[idx]);
+            freeAt = address + size;
+        } else
+        {
+            fprintf(stderr, "ERROR: image does not fit in %u bytes of memory: %s\n", memorySize, images[idx]);
+            result = -1;
+        }
+        free(image);
+    }
+
+    if (result == 0)
+    {
+        result = writeFile(path, NULL, 0, memory, freeAt);
+    }
+    free(memory);
+
+    return result;
+}
+
+/**
+ * \brief   Map a flat firmware binary, or read an Intel HEX / ELF file into a flat image
+ *          of the application section.
+ *
+ * \param[out]  object  flat image to be freed, NULL for a mapped binary
+ *
+ * \return firmware, NULL for an empty binary or MAP_FAILED on error
+ */
+static const uint8_t *mapFirmware(const char *file, uint32_t *size, uint8_t **object)
+{
+    const uint8_t * firmware = NULL;
+    struct stat     st;
+    int             fd;
+
+    *size = 0;
+    *object = NULL;
+    if (imageIsObjectFile(file))
+    {
+        *object = imageLoadObject(file, IMAGE_BOOT_SIZE, size);
+        return (*object != NULL) ? *object : MAP_FAILED;
+    }
+
+    fd = open(file, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) != 0))
+    {
+        fprintf(stderr, "ERROR: %s while trying to read from file: %s\n", strerror(errno), file);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return MAP_FAILED;
+    }
+    if (st.st_size > 0)
+    {
+        firmware = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (firmware == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: %s while trying to read from file: %s\n", strerror(errno), file);
+    } else
+    {
+        *size = (uint32_t)st.st_size;
+    }
+
+    return firmware;
+}
+
+/**
+ * \brief Build both output files of a single job.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int packOne(packJob_t *job)
+{
+    static const uint8_t    padding[IMAGE_ALIGN_SIZE] = { [0 ... IMAGE_ALIGN_SIZE - 1] = 0xFF };
+    const uint8_t         * firmware;
+    uint8_t               * object;
+    uint8_t               * image = NULL;
+    uint32_t                size;
+    uint32_t                imageSize;
+    char                    path[PACK_PATH_SIZE + 16];
+    int                     result = -1;
+
+    firmware = mapFirmware(job->file, &size, &object);
+    if (firmware == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    if (job->image.crcFlashSize
+        && (imageAppEnd(&job->image, firmware, size) > job->image.crcFlashSize - IMAGE_BOOT_SIZE - IMAGE_CRC_SIZE))
+    {
+        fprintf(stderr, "ERROR: application reaches the last %d bytes of Flash, where the bootloader stores its checksum: %s\n",
+                IMAGE_CRC_SIZE, job->file);
+    } else if ((image = imagePack(&job->image, firmware, size, &imageSize)) != NULL)
+    {
+        snprintf(path, sizeof(path), "%s.crypted.bin", job->outBase);
+        if (writeFile(path, NULL, 0, image, imageSize) == 0)
+        {
+            snprintf(path, sizeof(path), "%s.aligned.bin", job->outBase);
+            result = writeFile(path, padding, sizeof(padding), image, imageSize);
+        }
+        free(image);
+    } else
+    {
+        fprintf(stderr, "ERROR: out of memory while processing file: %s\n", job->file);
+    }
+
+    if (object != NULL)
+    {
+        free(object);
+    } else if (firmware != NULL)
+    {
+        munmap((void *)firmware, size);
+    }
+
+    return result;
+}
+
+static void *packWorker(void *arg)
+{
+    packQueue_t   * queue = arg;
+    size_t          idx;
+
+    while ((idx = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count)
+    {
+        queue->jobs[idx].status = packOne(&queue->jobs[idx]);
+    }
+
+    return NULL;
+}
+
+static bool randomIv(uint8_t iv[XTEA_IV_SIZE])
+{
+    if (getrandom(iv, XTEA_IV_SIZE, 0) != XTEA_IV_SIZE)
+    {
+        fprintf(stderr, "ERROR: %s while trying to generate IV\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Read manifest file into the array of jobs, every job gets its own random IV.
+ *
+ * \return number of jobs, or -1 on error
+ */
+static long loadManifest(const char *path, const imageJob_t *defaults, packJob_t **jobs)
+{
+    FILE      * file = fopen(path, "r");
+    char        line[3 * PACK_PATH_SIZE];
+    size_t      capacity = 0;
+    long        count = 0;
+    unsigned    lineNo = 0;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "ERROR: %s while trying to read from file: %s\n", strerror(errno), path);
+        return -1;
+    }
+
+    *jobs = NULL;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char  * field[IMAGE_MANIFEST_FIELDS];
+        int     fields = imageManifestSplit(line, field);
+
+        lineNo++;
+        if (fields == 0)
+        {
+            continue;
+        }
+        if (fields < 0)
+        {
+            fprintf(stderr, "ERROR: %s:%u: expected '%s'\n", path, lineNo, IMAGE_MANIFEST_FORMAT);
+            goto error;
+        }
+
+        if ((size_t)count == capacity)
+        {
+            capacity = capacity ? (2 * capacity) : 64;
+            packJob_t * grown = realloc(*jobs, capacity * sizeof(packJob_t));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "ERROR: out of memory while reading: %s\n", path);
+                goto error;
+            }
+            *jobs = grown;
+        }
+
+        packJob_t * job = &(*jobs)[count];
+        job->image = *defaults;
+        job->status = 0;
+        snprintf(job->file, PACK_PATH_SIZE, "%s", field[0]);
+        if (!parseKey(field[1], job->image.key)
+            || !parseCipherRounds(field[3], job->image.mode, &job->image.cipherRounds)
+            || !parseMacRounds(field[4], job->image.mode, &job->image.macRounds)
+            || !randomIv(job->image.iv))
+        {
+            fprintf(stderr, "ERROR: %s:%u: invalid job\n", path, lineNo);
+            goto error;
+        }
+        if (strcmp(field[2], "-") != 0)
+        {
+            if (!parseKey(field[2], job->image.newKey))
+            {
+                fprintf(stderr, "ERROR: %s:%u: invalid job\n", path, lineNo);
+                goto error;
+            }
+            job->image.hasNewKey = true;
+            job->image.mode = newKeyMode(job->image.mode);
+        }
+        if (fields == IMAGE_MANIFEST_FIELDS)
+        {
+            snprintf(job->outBase, PACK_PATH_SIZE, "%s", field[5]);
+        } else
+        {
+            imageDefaultOutBase(job->file, job->outBase, PACK_PATH_SIZE);
+        }
+        count++;
+    }
+    fclose(file);
+
+    return count;
+
+error:
+    fclose(file);
+    free(*jobs);
+    *jobs = NULL;
+
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        { "cipher",         required_argument,  NULL, 'c' },
+        { "newKey",         required_argument,  NULL, 'n' },
+        { "mac",            required_argument,  NULL, 'a' },
+        { "macRounds",      required_argument,  NULL, 'm' },
+        { "cipherRounds",   required_argument,  NULL, 'r' },
+        { "key",            required_argument,  NULL, 'k' },
+        { "file",           required_argument,  NULL, 'f' },
+        { "iv",             required_argument,  NULL, 'i' },
+        { "timeStamp",      required_argument,  NULL, 't' },
+        { "manifest",       required_argument,  NULL, 'M' },
+        { "jobs",           required_argument,  NULL, 'j' },
+        { "pageChain",      required_argument,  NULL, 'p' },
+        { "compress",       no_argument,        NULL, 'z' },
+        { "sparse",         required_argument,  NULL, 'S' },
+        { "directory",      required_argument,  NULL, 'd' },
+        { "mem-size",       required_argument,  NULL, 's' },
+        { "crc",            required_argument,  NULL, 'C' },
+        { NULL,             0,                  NULL, 0   }
+    };
+    imageJob_t      defaults = { .mode = 0x00, .cipherRounds = 32, .macRounds = 32 };
+    packJob_t       single = { .status = 0 };
+    packJob_t     * jobs = &single;
+    const char    * manifest = NULL;
+    const char    * directory = NULL;
+    uint32_t        memorySize = IMAGE_MEM_BLOCK_SIZE;
+    const char    * macRounds = NULL;
+    const char    * cipherRounds = NULL;
+    bool            hasKey = false;
+    bool            hasIv = false;
+    long            count = 1;
+    long            threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int             opt;
+
+    defaults.timeStamp = imageTimeStamp();
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                if (strcasecmp(optarg, "XTEA") == 0)
+                {
+                    defaults.mode = (defaults.mode & ~IMAGE_MODE_CIPHER_gm) | IMAGE_MODE_CIPHER_XTEA;
+                } else if (strcasecmp(optarg, "SPECK") == 0)
+                {
+                    defaults.mode = (defaults.mode & ~IMAGE_MODE_CIPHER_gm) | IMAGE_MODE_CIPHER_SPECK;
+                } else if (strcasecmp(optarg, "NONE") == 0)
+                {
+                    defaults.mode &= ~IMAGE_MODE_CIPHER_gm;
+                } else
+                {
+                    fprintf(stderr, "ERROR: %s is unsupported encryption mode!!!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                if (!parseKey(optarg, defaults.newKey))
+                {
+                    return EXIT_FAILURE;
+                }
+                defaults.hasNewKey = true;
+                break;
+            case 'a':
+                if (strcasecmp(optarg, "CHASKEY") == 0)
+                {
+                    defaults.mode = (defaults.mode & ~IMAGE_MODE_MAC_TYPE_gm) | IMAGE_MODE_MAC_CHASKEY;
+                } else if (strcasecmp(optarg, "XTEA") == 0)
+                {
+                    defaults.mode &= ~IMAGE_MODE_MAC_TYPE_gm;
+                } else
+                {
+                    fprintf(stderr, "ERROR: %s is unsupported MAC type!!!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                macRounds = optarg;                                 // range depends on --mac
+                break;
+            case 'r':
+                cipherRounds = optarg;                              // range depends on --cipher
+                break;
+            case 'k':
+                if (!parseKey(optarg, defaults.key))
+                {
+                    return EXIT_FAILURE;
+                }
+                hasKey = true;
+                break;
+            case 'f':
+                snprintf(single.file, PACK_PATH_SIZE, "%s", optarg);
+                break;
+            case 'i':
+                if (!imageParseHex(optarg, defaults.iv, XTEA_IV_SIZE))
+                {
+                    fprintf(stderr, "ERROR: IV value is not a %d-byte hexadecimal string: %s\n", XTEA_IV_SIZE, optarg);
+                    return EXIT_FAILURE;
+                }
+                hasIv = true;
+                break;
+            case 't':
+                defaults.timeStamp = (uint32_t)strtoul(optarg, NULL, 16);
+                break;
+            case 'M':
+                manifest = optarg;
+                break;
+            case 'j':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'z':
+                defaults.compress = true;
+                break;
+            case 'd':
+                directory = optarg;
+                break;
+            case 's':
+                memorySize = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                defaults.sparsePageSize = (uint16_t)strtoul(optarg, NULL, 0);
+                if ((defaults.sparsePageSize != 64) && (defaults.sparsePageSize != 128))
+                {
+                    fprintf(stderr, "ERROR: Flash page size should be 64 (tinyAVR) or 128 (megaAVR) bytes\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'C':
+                defaults.crcFlashSize = (uint32_t)strtoul(optarg, NULL, 0);
+                if ((defaults.crcFlashSize != 0x1000) && (defaults.crcFlashSize != 0x2000) && (defaults.crcFlashSize != 0x4000)
+                    && (defaults.crcFlashSize != 0x8000) && (defaults.crcFlashSize != 0xC000))
+                {
+                    fprintf(stderr, "ERROR: Flash size should be 4096, 8192, 16384, 32768 or 49152 bytes\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                defaults.pageSize = (uint16_t)strtoul(optarg, NULL, 0);
+                if ((defaults.pageSize != 64) && (defaults.pageSize != 128))
+                {
+                    fprintf(stderr, "ERROR: Flash page size should be 64 (tinyAVR) or 128 (megaAVR) bytes\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (directory != NULL)
+    {
+        return (packDirectory(directory, memorySize, argv + optind, argc - optind) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if ((defaults.mode & IMAGE_MODE_MAC_TYPE_gm) == IMAGE_MODE_MAC_CHASKEY)
+    {
+        if (defaults.pageSize)
+        {
+            fprintf(stderr, "ERROR: Page chained firmware uses XTEA page tags, Chaskey MAC covers only whole image!!!\n");
+            return EXIT_FAILURE;
+        }
+        defaults.macRounds = CHASKEY_ROUNDS;
+    }
+    if ((macRounds != NULL) && !parseMacRounds(macRounds, defaults.mode, &defaults.macRounds))
+    {
+        return EXIT_FAILURE;
+    }
+    if ((defaults.mode & IMAGE_MODE_CIPHER_gm) == IMAGE_MODE_CIPHER_SPECK)
+    {
+        defaults.cipherRounds = SPECK_ROUNDS;
+    }
+    if ((cipherRounds != NULL) && !parseCipherRounds(cipherRounds, defaults.mode, &defaults.cipherRounds))
+    {
+        return EXIT_FAILURE;
+    }
+    if (defaults.hasNewKey)
+    {
+        defaults.mode = newKeyMode(defaults.mode);
+    }
+
+    if (defaults.compress && defaults.pageSize)
+    {
+        fprintf(stderr, "ERROR: Compressed firmware cannot be page chained!!!\n");
+        return EXIT_FAILURE;
+    }
+    if (defaults.sparsePageSize && (defaults.compress || defaults.pageSize))
+    {
+        fprintf(stderr, "ERROR: Sparse firmware cannot be compressed or page chained!!!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (manifest != NULL)
+    {
+        if (hasKey || hasIv || single.file[0])
+        {
+            fprintf(stderr, "ERROR: --key, --iv and --file are taken from the manifest in batch mode\n");
+            return EXIT_FAILURE;
+        }
+        count = loadManifest(manifest, &defaults, &jobs);
+        if (count < 0)
+        {
+            return EXIT_FAILURE;
+        }
+    } else
+    {
+        if (!hasKey || !single.file[0])
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (!hasIv && !randomIv(defaults.iv))
+        {
+            return EXIT_FAILURE;
+        }
+        single.image = defaults;
+        imageDefaultOutBase(single.file, single.outBase, PACK_PATH_SIZE);
+    }
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if (threads > count)
+    {
+        threads = (count > 0) ? count : 1;
+    }
+
+    packQueue_t     queue = { .jobs = jobs, .count = (size_t)count, .next = 0 };
+    pthread_t     * workers = calloc((size_t)threads, sizeof(pthread_t));
+    long            started = 0;
+    int             result = EXIT_SUCCESS;
+
+    if (workers != NULL)
+    {
+        while ((started < threads) && (pthread_create(&workers[started], NULL, packWorker, &queue) == 0))
+        {
+            started++;
+        }
+    }
+    if (started == 0)
+    {
+        packWorker(&queue);                                         // no threads available, do the work here
+    }
+    for (long idx = 0; idx < started; idx++)
+    {
+        pthread_join(workers[idx], NULL);
+    }
+    free(workers);
+
+    for (long idx = 0; idx < count; idx++)
+    {
+        if (jobs[idx].status != 0)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+    if (jobs != &single)
+    {
+        free(jobs);
+    }
+
+    return result;
+}
@@ -0,0 +1,517 @@
+/**
+ * \file    cryptboot_sim.c
+ * \brief   Host simulation harness: runs the unmodified bootloader code (boot(),
+ *          isFirmwareMacOk(), processFirmwareData(), ...) against a file-backed
+ *          24Cxx EEPROM (or W25Qxx SPI flash, built with -DSPI_STORAGE) and a simulated
+ *          NVM controller, counts bus transactions, bytes, START conditions and page
+ *          erase-writes, and estimates the wall time.
+ *          Built with -DCRYPTBOOT_SIM, see host/sim/.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdlib.h>
+
+#include "cryptboot_x.c"
+#include "image.h"
+#ifndef SPI_STORAGE
+#include "twi_stage.h"
+#endif
+
+#define SIM_DEFAULT_MEM_SIZE        0x10000
+#define SIM_DEFAULT_PAGE_US         4000            // Flash page erase-write time, worst case
+#define SIM_DEFAULT_ROUND_CYCLES    200             // AVR cycles per XTEA round (two Feistel rounds), -Os build
+#define SIM_DEFAULT_CHASKEY_CYCLES  120             // AVR cycles per Chaskey round: 4 additions, 4 XORs and
+                                                    // 6 rotations of 32-bit words (by 8 and 16 - byte moves)
+#define SIM_DEFAULT_SPECK_CYCLES    48              // AVR cycles per Speck round: rotation by 8 (byte moves),
+                                                    // addition, XOR with loaded round key, rotation by 3, XOR
+#define SIM_DEFAULT_MAX_BOOTS       4
+#define SIM_DEFAULT_WRITE_CYCLE_US  3000            // typical tWR of 24Cxx parts (5 ms maximum)
+#define SIM_DEFAULT_STAGE_CHUNK     32              // bytes per packet of the link of the application
+#define SIM_STAGE_LOOP_CYCLES       50              // main loop of the application around twiStagePoll()
+#ifndef SPI_STORAGE
+#define SIM_DEFAULT_BUS_CLOCK       F_SCL
+#else
+#define SIM_DEFAULT_BUS_CLOCK       F_SCK
+#endif
+
+/**
+ * \brief Parameters of the time estimation.
+ */
+typedef struct simTiming
+{
+    uint32_t            fScl;               // SCL, or SCK with SPI_STORAGE
+    uint32_t            pageUs;
+    uint32_t            roundCycles;
+    uint32_t            chaskeyCycles;
+    uint32_t            speckCycles;
+} simTiming_t;
+
+static size_t loadFile(const char *path, uint8_t *data, size_t size)
+{
+    FILE  * file = fopen(path, "rb");
+    size_t  length;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "ERROR: cannot open file: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    length = fread(data, 1, size, file);
+    if (fgetc(file) != EOF)
+    {
+        fprintf(stderr, "ERROR: file is larger than %zu bytes: %s\n", size, path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    return length;
+}
+
+static void printStats(const char *name, const simStats_t *stats, const simTiming_t *timing)
+{
+    double busUs    = (1e6 * stats->sclClocks) / timing->fScl;
+    double nvmUs    = (double)stats->pageEraseWrites * timing->pageUs;
+    double cpuUs    = (1e6 * (((double)stats->cipherRounds * timing->roundCycles)
+                              + ((double)stats->chaskeyRounds * timing->chaskeyCycles)
+                              + ((double)stats->speckRounds * timing->speckCycles))) / F_CPU;
+
+    printf("%s.transactions %u\n",      name, stats->transactions);
+    printf("%s.starts %u\n",            name, stats->starts);
+    printf("%s.stops %u\n",             name, stats->stops);
+    printf("%s.bytesWritten %u\n",      name, stats->bytesWritten);
+    printf("%s.bytesRead %u\n",         name, stats->bytesRead);
+    printf("%s.sclClocks %u\n",         name, stats->sclClocks);
+    printf("%s.pageEraseWrites %u\n",   name, stats->pageEraseWrites);
+    printf("%s.eepromWrites %u\n",      name, stats->eepromWrites);
+    printf("%s.crcScans %u\n",          name, stats->crcScans);
+    printf("%s.cipherRounds %llu\n",    name, (unsigned long long)stats->cipherRounds);
+    printf("%s.chaskeyRounds %llu\n",   name, (unsigned long long)stats->chaskeyRounds);
+    printf("%s.speckRounds %llu\n",     name, (unsigned long long)stats->speckRounds);
+    printf("%s.busUs %.0f\n",           name, busUs);
+    printf("%s.nvmUs %.0f\n",           name, nvmUs);
+    printf("%s.cpuUs %.0f\n",           name, cpuUs);
+    printf("%s.totalUs %.0f\n",         name, busUs + nvmUs + cpuUs);
+    printf("%s.elapsedUs %.0f\n",       name, (1e6 * (double)stats->elapsedCycles) / F_CPU);
+}
+
+#ifdef BOOT_SERVICES
+/**
+ * \brief   What an application does with BOOT_SERVICES to check a downloaded image before it triggers
+ *          a reboot: the CFB-MAC of the image at 'firmwareAt' is computed by the services of the bootloader,
+ *          with the key from internal EEPROM. Only images with a whole image XTEA CFB-MAC are checked.
+ *
+ * \return "ok" or "bad" MAC, or the reason why it was not checked
+ */
+static const char *simServicesMac(void)
+{
+    const bootServices_t  * services = BOOT_SERVICES_TABLE;
+    firmwareCfg_t           descriptor;
+    bootCfg_t               config;
+    xteaCtx_t               mac;
+    uint8_t                 data[MAPPED_PROGMEM_PAGE_SIZE];
+    uint32_t                offset;
+    uint8_t                 length;
+    bool                    ok;
+
+    if (!isBootServicesAvailable())
+    {
+        return "unavailable";
+    }
+    ok = services->memoryInit() && services->memoryRead(firmwareAt, (uint8_t *)&descriptor, sizeof(descriptor));
+    if (ok && (((descriptor.mode & FW_MODE_MAC_TYPE_gm) != FW_MODE_MAC_CFB_XTEA_gc)
+               || (descriptor.firmwareSize > MAPPED_APPLICATION_SIZE)))
+    {
+        services->memoryRelease();
+        return "unsupported";
+    }
+    eeprom_read_block(&config, (void *)(MAPPED_EEPROM_SIZE - sizeof(config)), sizeof(config));
+    services->macInit(&mac, config.key, descriptor.macRounds);
+    services->macUpdate(&mac, &descriptor.version, sizeof(descriptor) - sizeof(descriptor.firmwareMac));
+    for (offset = 0; ok && (offset < descriptor.firmwareSize); offset += length)
+    {
+        length = ((descriptor.firmwareSize - offset) < sizeof(data)) ? (uint8_t)(descriptor.firmwareSize - offset) : sizeof(data);
+        ok = services->memoryRead(firmwareAt + sizeof(descriptor) + offset, data, length);
+        services->macUpdate(&mac, data, length);
+    }
+    services->macFinish(&mac);
+    services->memoryRelease();
+
+    return !ok ? "failed" : (memcmp(mac.data, descriptor.firmwareMac, XTEA_BLOCK_SIZE) == 0) ? "ok" : "bad";
+}
+#endif
+
+#ifndef SPI_STORAGE
+/**
+ * \brief   What an application does with twi_stage.h to stage an image received over its link: bytes
+ *          of the image arrive in chunks, 'chunkCycles' apart (all at once if 0), and are passed to the
+ *          staging library from its main loop. 'length' bytes are staged, the staging is finished
+ *          (descriptor written) only if 'finish' is true.
+ *
+ * \return state of staging
+ */
+static twiStageStatus_t simStage(const uint8_t *image, uint32_t length, uint32_t chunk, uint64_t chunkCycles, bool finish)
+{
+    static twiStage_t   stage;
+    uint64_t            startAt = simStats.elapsedCycles;
+    uint32_t            available;
+    uint32_t            taken = 0;
+    twiStageStatus_t    status = TWI_STAGE_BUSY;
+
+    twiInit(TWI_BAUD(F_CPU, F_SCL, T_RISE));
+    twiStageBegin(&stage, TWI_CONTROL_DATA_AT);
+    while ((taken < length) && (status != TWI_STAGE_FAILED))
+    {
+        available = length;
+        if (chunkCycles && ((((simStats.elapsedCycles - startAt) / chunkCycles) + 1) * chunk < length))
+        {
+            available = (uint32_t)(((simStats.elapsedCycles - startAt) / chunkCycles) + 1) * chunk;
+        }
+        taken += twiStageWrite(&stage, image + taken, (uint16_t)(((available - taken) < UINT16_MAX) ? (available - taken) : UINT16_MAX));
+        status = twiStagePoll(&stage);
+        simStats.elapsedCycles += SIM_STAGE_LOOP_CYCLES;
+    }
+    if (finish)
+    {
+        twiStageFinish(&stage);
+    }
+    while ((status == TWI_STAGE_BUSY) || (finish && (status == TWI_STAGE_IDLE)))
+    {
+        status = twiStagePoll(&stage);
+        simStats.elapsedCycles += SIM_STAGE_LOOP_CYCLES;
+    }
+    twiRelease();
+
+    return status;
+}
+#endif
+
+/**
+ * \brief   Runs the bootloader until it jumps to the application, resets or loses power. setjmp() is kept
+ *          in this frame, so no local of main() lives across the longjmp() of the models.
+ *
+ * \return  SIM_EXIT_APP, SIM_EXIT_RESET or SIM_EXIT_POWER, 0 if boot() returned
+ */
+static int simBoot(void)
+{
+    int exitCode = setjmp(simExit);
+
+    if (exitCode == 0)
+    {
+        boot();
+        fprintf(stderr, "SIM: boot() returned\n");
+    }
+
+    return exitCode;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s --image FIRMWARE.aligned.bin --key KEY [--timeStamp HEX] [--app APP.bin]\n"
+        "          [--expect FIRMWARE.bin] [--fscl HZ] [--mem-size BYTES] [--page-us US]\n"
+        "          [--round-cycles CYCLES] [--chaskey-round-cycles CYCLES] [--speck-round-cycles CYCLES]\n"
+        "          [--reset-cause RSTFR] [--max-boots N]\n"
+#ifdef BOOT_SERVICES
+        "          [--services-mac]\n"
+#endif
+#ifndef SPI_STORAGE
+        "          [--stuck-after BYTES | --no-device] [--power-fail-after PAGES]\n"
+        "       %s [--image MEMORY.bin] --stage FIRMWARE.aligned.bin [--stage-chunk BYTES]\n"
+        "          [--stage-chunk-us US] [--stage-abort-after BYTES] [--write-cycle-us US]\n"
+        "          [--refuse-writes] --key KEY ...\n",
+        name,
+#else
+        "          [--no-device] [--power-fail-after PAGES]\n",
+#endif
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        { "image",          required_argument,  NULL, 'i' },
+        { "key",            required_argument,  NULL, 'k' },
+        { "timeStamp",      required_argument,  NULL, 't' },
+        { "app",            required_argument,  NULL, 'a' },
+        { "expect",         required_argument,  NULL, 'e' },
+        { "fscl",           required_argument,  NULL, 'f' },
+        { "mem-size",       required_argument,  NULL, 'm' },
+        { "page-us",        required_argument,  NULL, 'p' },
+        { "round-cycles",   required_argument,  NULL, 'r' },
+        { "chaskey-round-cycles", required_argument, NULL, 'C' },
+        { "speck-round-cycles", required_argument,  NULL, 'P' },
+        { "reset-cause",    required_argument,  NULL, 'c' },
+        { "max-boots",      required_argument,  NULL, 'b' },
+#ifndef SPI_STORAGE
+        { "stuck-after",    required_argument,  NULL, 's' },
+#endif
+        { "no-device",      no_argument,        NULL, 'n' },
+        { "power-fail-after", required_argument, NULL, 'w' },
+#ifndef SPI_STORAGE
+        { "stage",          required_argument,  NULL, 'g' },
+        { "stage-chunk",    required_argument,  NULL, 'u' },
+        { "stage-chunk-us", required_argument,  NULL, 'U' },
+        { "stage-abort-after", required_argument, NULL, 'x' },
+        { "write-cycle-us", required_argument,  NULL, 'y' },
+        { "refuse-writes",  no_argument,        NULL, 'R' },
+#endif
+#ifdef BOOT_SERVICES
+        { "services-mac",   no_argument,        NULL, 'S' },
+#endif
+        { NULL,             0,                  NULL, 0   }
+    };
+    simTiming_t         timing = { .fScl = SIM_DEFAULT_BUS_CLOCK, .pageUs = SIM_DEFAULT_PAGE_US, .roundCycles = SIM_DEFAULT_ROUND_CYCLES,
+                                   .chaskeyCycles = SIM_DEFAULT_CHASKEY_CYCLES, .speckCycles = SIM_DEFAULT_SPECK_CYCLES };
+    bootCfg_t           initial = { .timeStamp = 0xFFFFFFFF };
+    const char        * imagePath = NULL;
+    const char        * appPath = NULL;
+    const char        * expectPath = NULL;
+#ifndef SPI_STORAGE
+    const char        * stagePath = NULL;
+    uint32_t            stageChunk = SIM_DEFAULT_STAGE_CHUNK;
+    uint32_t            stageChunkUs = 0;
+    uint32_t            stageAbortAfter = UINT32_MAX;
+    uint32_t            writeCycleUs = SIM_DEFAULT_WRITE_CYCLE_US;
+#endif
+    uint32_t            memSize = SIM_DEFAULT_MEM_SIZE;
+    uint8_t             resetCause = RSTCTRL_PORF_bm;
+    unsigned            maxBoots = SIM_DEFAULT_MAX_BOOTS;
+    bool                hasKey = false;
+#ifdef BOOT_SERVICES
+    bool                servicesMac = false;
+#endif
+    int                 result = EXIT_SUCCESS;
+    int                 opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'i': imagePath = optarg;                                           break;
+            case 'k': hasKey = imageParseHex(optarg, initial.key, XTEA_KEY_SIZE);   break;
+            case 't': initial.timeStamp = (uint32_t)strtoul(optarg, NULL, 16);      break;
+            case 'a': appPath = optarg;                                             break;
+            case 'e': expectPath = optarg;                                          break;
+            case 'f': timing.fScl = (uint32_t)strtoul(optarg, NULL, 0);             break;
+            case 'm': memSize = (uint32_t)strtoul(optarg, NULL, 0);                 break;
+            case 'p': timing.pageUs = (uint32_t)strtoul(optarg, NULL, 0);           break;
+            case 'r': timing.roundCycles = (uint32_t)strtoul(optarg, NULL, 0);      break;
+            case 'C': timing.chaskeyCycles = (uint32_t)strtoul(optarg, NULL, 0);    break;
+            case 'P': timing.speckCycles = (uint32_t)strtoul(optarg, NULL, 0);      break;
+            case 'c': resetCause = (uint8_t)strtoul(optarg, NULL, 0);               break;
+            case 'b': maxBoots = (unsigned)strtoul(optarg, NULL, 0);                break;
+#ifndef SPI_STORAGE
+            case 's': simBus.stuckAfter = (uint32_t)strtoul(optarg, NULL, 0);       break;
+#endif
+            case 'n': simBus.absent = true;                                         break;
+            case 'w': simPowerFailAt = (uint32_t)strtoul(optarg, NULL, 0);          break;
+#ifndef SPI_STORAGE
+            case 'g': stagePath = optarg;                                           break;
+            case 'u': stageChunk = (uint32_t)strtoul(optarg, NULL, 0);              break;
+            case 'U': stageChunkUs = (uint32_t)strtoul(optarg, NULL, 0);            break;
+            case 'x': stageAbortAfter = (uint32_t)strtoul(optarg, NULL, 0);         break;
+            case 'y': writeCycleUs = (uint32_t)strtoul(optarg, NULL, 0);            break;
+            case 'R': simBus.refuseWrites = true;                                   break;
+#endif
+#ifdef BOOT_SERVICES
+            case 'S': servicesMac = true;                                           break;
+#endif
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+#ifndef SPI_STORAGE
+    if ((stagePath != NULL) && (stageChunk == 0))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((imagePath == NULL) && (stagePath == NULL))
+#else
+    if (imagePath == NULL)
+#endif
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!hasKey || (timing.fScl == 0) || (memSize == 0) || (memSize & (memSize - 1)))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    simClock.sclCycles = (uint32_t)(F_CPU / timing.fScl);
+    simClock.roundCycles = timing.roundCycles;
+    simClock.chaskeyCycles = timing.chaskeyCycles;
+    simClock.speckCycles = timing.speckCycles;
+    simClock.pageCycles = (uint32_t)((F_CPU / 1000000) * timing.pageUs);
+
+    simBus.memory = malloc(memSize);
+    simBus.memorySize = memSize;
+    if (simBus.memory == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(simBus.memory, 0xFF, memSize);
+    if (imagePath != NULL)
+    {
+        loadFile(imagePath, simBus.memory, memSize);
+    }
+
+    memset(simFlash, 0xFF, sizeof(simFlash));
+    if (appPath != NULL)
+    {
+        loadFile(appPath, simFlash + BOOT_SIZE, MAPPED_APPLICATION_SIZE);
+    }
+    memcpy(simFlashCommitted, simFlash, sizeof(simFlash));
+    memset(simEeprom, 0xFF, sizeof(simEeprom));
+    memcpy(simEeprom + MAPPED_EEPROM_SIZE - sizeof(bootCfg_t), &initial, sizeof(bootCfg_t));
+
+#ifndef SPI_STORAGE
+    if (stagePath != NULL)                                          // the application stages the image
+    {                                                               // received over its link, then reboots
+        uint8_t           * staged = malloc(memSize);
+        uint32_t            length;
+        twiStageStatus_t    status;
+
+        if (staged == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory\n");
+            return EXIT_FAILURE;
+        }
+        length = (uint32_t)loadFile(stagePath, staged, memSize);
+        length = (length > TWI_CONTROL_DATA_AT) ? (length - (TWI_CONTROL_DATA_AT)) : 0;
+        simBus.writeCycles = (uint32_t)((F_CPU / 1000000) * writeCycleUs);
+        status = simStage(staged + TWI_CONTROL_DATA_AT, (length < stageAbortAfter) ? length : stageAbortAfter,
+                          stageChunk, (uint64_t)(F_CPU / 1000000) * stageChunkUs, length <= stageAbortAfter);
+        printf("stage.status %s\n", (status == TWI_STAGE_DONE) ? "done" : (status == TWI_STAGE_IDLE) ? "aborted" : "failed");
+        printf("stage.bytes %u\n", (length < stageAbortAfter) ? length : stageAbortAfter);
+        printf("stage.pageWrites %u\n", simBus.pageWrites);
+        printf("stage.probesNacked %u\n", simBus.probesNacked);
+        printf("stage.busUs %.0f\n", (1e6 * simStats.sclClocks) / timing.fScl);
+        printf("stage.elapsedUs %.0f\n", (1e6 * (double)simStats.elapsedCycles) / F_CPU);
+        if (stageChunkUs)
+        {
+            printf("stage.linkUs %.0f\n", (double)((length + stageChunk - 1) / stageChunk) * stageChunkUs);
+        }
+        free(staged);
+        if (status == TWI_STAGE_FAILED)
+        {
+            result = EXIT_FAILURE;
+        }
+        simStats = (simStats_t){ .errors = simStats.errors };      // boots are counted from here,
+        simBus.busyUntil = 0;                                       // the memory is ready at reboot
+    }
+#endif
+
+    simStats_t  before;
+    unsigned    boots = 0;
+    int         exitCode = 0;
+
+    while ((boots < maxBoots) && (exitCode != SIM_EXIT_APP))
+    {
+        char name[16];
+
+        RSTCTRL.RSTFR = !boots ? resetCause : (exitCode == SIM_EXIT_POWER) ? RSTCTRL_PORF_bm : RSTCTRL_SWRF_bm;
+        memset(&simRtcRegs, 0, sizeof(simRtcRegs));
+        before = simStats;
+        exitCode = simBoot();
+        if (exitCode == 0)
+        {
+            return EXIT_FAILURE;
+        }
+
+        simStats_t delta =
+        {
+            .transactions       = simStats.transactions     - before.transactions,
+            .starts             = simStats.starts           - before.starts,
+            .stops              = simStats.stops            - before.stops,
+            .bytesWritten       = simStats.bytesWritten     - before.bytesWritten,
+            .bytesRead          = simStats.bytesRead        - before.bytesRead,
+            .sclClocks          = simStats.sclClocks        - before.sclClocks,
+            .pageEraseWrites    = simStats.pageEraseWrites  - before.pageEraseWrites,
+            .eepromWrites       = simStats.eepromWrites     - before.eepromWrites,
+            .crcScans           = simStats.crcScans         - before.crcScans,
+            .cipherRounds       = simStats.cipherRounds     - before.cipherRounds,
+            .chaskeyRounds      = simStats.chaskeyRounds    - before.chaskeyRounds,
+            .speckRounds        = simStats.speckRounds      - before.speckRounds,
+            .elapsedCycles      = simStats.elapsedCycles    - before.elapsedCycles,
+        };
+        snprintf(name, sizeof(name), "boot%u", boots);
+        printf("%s.exit %s\n", name, (exitCode == SIM_EXIT_APP) ? "app" : (exitCode == SIM_EXIT_POWER) ? "power" : "reset");
+        if (exitCode == SIM_EXIT_POWER)
+        {                                                           // NVM page buffer is lost with the power
+            memcpy(simFlash, simFlashCommitted, sizeof(simFlash));
+        }
+        printStats(name, &delta, &timing);
+        boots++;
+    }
+    printStats("total", &simStats, &timing);
+
+#ifdef BOOT_METRICS
+    uint16_t        reported;
+    bootMetrics_t   metrics;
+    double          tickUs = (1e6 * (1 << ((BOOT_METRICS_PRESCALER >> RTC_PRESCALER_gp) & 0x0F))) / SIM_RTC_HZ;
+
+    eeprom_read_block(&reported, (void *)BOOT_PAGES_WRITTEN_AT, sizeof(reported));
+    printf("eeprom.pagesWritten %u\n", reported);
+    eeprom_read_block(&metrics, (void *)BOOT_METRICS_AT, sizeof(metrics));
+    printf("eeprom.metrics.probeUs %.0f\n",    metrics.probe * tickUs);
+    printf("eeprom.metrics.headerUs %.0f\n",   metrics.header * tickUs);
+    printf("eeprom.metrics.macUs %.0f\n",      metrics.mac * tickUs);
+    printf("eeprom.metrics.programUs %.0f\n",  metrics.program * tickUs);
+    printf("eeprom.metrics.nvmUs %.0f\n",      metrics.nvm * tickUs);
+#endif
+
+    if (exitCode != SIM_EXIT_APP)
+    {
+        fprintf(stderr, "ERROR: application not started after %u boots\n", boots);
+        result = EXIT_FAILURE;
+    }
+    if (simBus.owner || simBus.enabled)
+    {
+        fprintf(stderr, "ERROR: bus left %s before starting the application\n", simBus.owner ? "owned" : "enabled");
+        result = EXIT_FAILURE;
+    }
+    if (simFlashUncommitted() || simStats.errors)
+    {
+        fprintf(stderr, "ERROR: %u uncommitted Flash pages, %u model errors\n", simFlashUncommitted(), simStats.errors);
+        result = EXIT_FAILURE;
+    }
+    if (expectPath != NULL)
+    {
+        static uint8_t  expected[MAPPED_APPLICATION_SIZE];
+        size_t          length = loadFile(expectPath, expected, sizeof(expected));
+
+        if (memcmp(simFlashCommitted + BOOT_SIZE, expected, length) != 0)
+        {
+            fprintf(stderr, "ERROR: programmed application differs from: %s\n", expectPath);
+            result = EXIT_FAILURE;
+        } else
+        {
+            printf("expect ok\n");
+        }
+    }
+
+#ifdef BOOT_SERVICES
+    simBootServices = &bootServices;
+    if (servicesMac && (exitCode == SIM_EXIT_APP))                  // the application checks the staged image
+    {
+        printf("services.mac %s\n", simServicesMac());
+    }
+#endif
+
+    free(simBus.memory);
+
+    return result;
+}
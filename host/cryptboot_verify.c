@@ -0,0 +1,824 @@
+/**
+ * \file    cryptboot_verify.c
+ * \brief   Offline verifier of '*.crypted.bin' images: checks the CFB-MAC of every image
+ *          (and of every page in the page chained format) or its Chaskey MAC, decrypts the firmware (XTEA or Speck)
+ *          and compares it with the source '*.bin' (or Intel HEX / ELF) file.
+ *          MACs of independent images are computed in parallel SIMD lanes, CFB decryption
+ *          of one image runs its blocks in parallel lanes (see xtea_lanes.h).
+ *
+ *          Images are given by a manifest in the format of cryptboot_pack
+ *          (the image is '<outputBase>.crypted.bin', rounds are taken from the image)
+ *          or by a single --key/--file [--image] triple.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "xtea_lanes.h"
+
+#define VERIFY_PATH_SIZE    4096
+
+/**
+ * \brief Single image to be verified.
+ */
+typedef struct verifyImage
+{
+    char                file[VERIFY_PATH_SIZE];     // source firmware
+    char                image[VERIFY_PATH_SIZE + 16];
+    uint8_t             key[XTEA_KEY_SIZE];
+    uint8_t             newKey[XTEA_KEY_SIZE];
+    bool                hasNewKey;
+    const uint8_t     * data;                       // mapped image
+    size_t              size;
+    const uint8_t     * firmware;                   // mapped source firmware
+    size_t              firmwareSize;
+    bool                firmwareObject;             // read from Intel HEX or ELF file, not mapped
+    const char        * error;                      // NULL if image is correct
+} verifyImage_t;
+
+/**
+ * \brief Single CFB-MAC computation: MAC(data[0 .. length)) must be equal to 'expected'.
+ */
+typedef struct verifyMac
+{
+    verifyImage_t     * image;
+    const uint8_t     * data;
+    uint32_t            length;
+    const uint8_t     * expected;
+    uint8_t             rounds;
+} verifyMac_t;
+
+/**
+ * \brief State of a lane of the MAC engine.
+ */
+typedef struct verifyLane
+{
+    verifyMac_t       * mac;                        // NULL - lane is idle
+    uint32_t            offset;
+    bool                outer;                      // computing the final block with the opad key
+    uint8_t             block[XTEA_BLOCK_SIZE];     // last ciphertext block
+} verifyLane_t;
+
+static xteaLanesKernel_t    kernel;
+static xteaLanesSchedule_t  schedule;
+static xteaLanesState_t     state;
+static uint64_t             blocksProcessed;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s --key KEY --file FIRMWARE.bin [--image FIRMWARE.crypted.bin] [--newKey KEY] [--engine ENGINE]\n"
+        "       %s --manifest FILE [--engine ENGINE]\n"
+        "       %s --self-test [--engine ENGINE]\n"
+        "       ENGINE: auto (default), avx2, sse2, scalar\n",
+        name, name, name);
+}
+
+static const uint8_t *mapFile(const char *path, size_t *size)
+{
+    const uint8_t * data = NULL;
+    struct stat     st;
+    int             fd = open(path, O_RDONLY);
+
+    if ((fd < 0) || (fstat(fd, &st) != 0))
+    {
+        fprintf(stderr, "ERROR: %s while trying to read from file: %s\n", strerror(errno), path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    data = (st.st_size > 0) ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : (const uint8_t *)"";
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: %s while trying to read from file: %s\n", strerror(errno), path);
+        return NULL;
+    }
+
+    return data;
+}
+
+/**
+ * \return true if the longer of two buffers differs from the shorter one only by erased (0xFF) bytes past its end
+ */
+static bool isErasedTail(const uint8_t *a, size_t aSize, const uint8_t *b, size_t bSize)
+{
+    const uint8_t * tail = (aSize > bSize) ? a : b;
+    size_t          common = (aSize > bSize) ? bSize : aSize;
+    size_t          end = (aSize > bSize) ? aSize : bSize;
+
+    if (memcmp(a, b, common) != 0)
+    {
+        return false;
+    }
+    for (size_t idx = common; idx < end; idx++)
+    {
+        if (tail[idx] != 0xFF)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int compareRounds(const void *a, const void *b)
+{
+    return (int)((const verifyMac_t *)a)->rounds - (int)((const verifyMac_t *)b)->rounds;
+}
+
+/**
+ * \brief Put the next MAC computation of the queue into an idle lane.
+ */
+static void startLane(verifyLane_t *lane, unsigned idx, verifyMac_t *mac)
+{
+    lane->mac = mac;
+    lane->offset = 0;
+    lane->outer = false;
+    if (mac != NULL)
+    {
+        xteaLanesSetKey(&schedule, idx, mac->image->key, 0x36, mac->rounds);   // ipad, see xteaCfbMacInit()
+        state.v0[idx] = 0;
+        state.v1[idx] = 0;
+    }
+}
+
+/**
+ * \brief   Compute all MACs, XTEA_LANES of them at a time. Every lane runs its own
+ *          CFB-MAC chain; a lane that has finished takes the next MAC from the queue,
+ *          so lanes stay busy regardless of data length. Lanes of one batch share
+ *          the number of rounds, so MACs are grouped by rounds first.
+ */
+static void verifyMacs(verifyMac_t *macs, size_t count)
+{
+    verifyLane_t    lanes[XTEA_LANES];
+    size_t          next = 0;
+
+    qsort(macs, count, sizeof(verifyMac_t), compareRounds);
+
+    while (next < count)
+    {
+        uint8_t     rounds = macs[next].rounds;
+        unsigned    active = 0;
+
+        for (unsigned idx = 0; idx < XTEA_LANES; idx++)
+        {
+            bool    take = (next < count) && (macs[next].rounds == rounds);
+
+            startLane(&lanes[idx], idx, take ? &macs[next++] : NULL);
+            active += take;
+        }
+
+        while (active)
+        {
+            kernel(&schedule, &state, rounds);                      // E(iv) of all lanes at once
+            blocksProcessed += active;
+
+            for (unsigned idx = 0; idx < XTEA_LANES; idx++)
+            {
+                verifyLane_t  * lane = &lanes[idx];
+                verifyMac_t   * mac = lane->mac;
+                uint8_t         stream[XTEA_BLOCK_SIZE];
+                uint8_t         block[XTEA_BLOCK_SIZE];
+
+                if (mac == NULL)
+                {
+                    continue;
+                }
+                xteaLanesStore(&state, idx, stream);
+
+                if (lane->outer)
+                {                                                   // MAC = c ^ E'(c), see xteaCfbMacFinish()
+                    for (unsigned pos = 0; pos < XTEA_BLOCK_SIZE; pos++)
+                    {
+                        block[pos] = lane->block[pos] ^ stream[pos];
+                    }
+                    if ((memcmp(block, mac->expected, IMAGE_MAC_SIZE) != 0) && (mac->image->error == NULL))
+                    {
+                        mac->image->error = "MAC mismatch";
+                    }
+                    bool take = (next < count) && (macs[next].rounds == rounds);
+                    startLane(lane, idx, take ? &macs[next++] : NULL);
+                    active -= !take;
+                    continue;
+                }
+
+                uint32_t    remaining = mac->length - lane->offset;
+
+                if (remaining >= XTEA_BLOCK_SIZE)
+                {
+                    memcpy(block, mac->data + lane->offset, XTEA_BLOCK_SIZE);
+                    lane->offset += XTEA_BLOCK_SIZE;
+                } else
+                {                                                   // padding block, then switch to opad key
+                    memset(block, 0x00, sizeof(block));
+                    memcpy(block, mac->data + lane->offset, remaining);
+                    block[remaining] = 0x80;
+                    lane->outer = true;
+                    xteaLanesSetKey(&schedule, idx, mac->image->key, 0x5C, rounds);
+                }
+                for (unsigned pos = 0; pos < XTEA_BLOCK_SIZE; pos++)
+                {
+                    lane->block[pos] = block[pos] ^ stream[pos];
+                }
+                xteaLanesLoad(&state, idx, lane->block);
+            }
+        }
+    }
+}
+
+/**
+ * \brief   Decrypt CFB ciphertext: P[i] = C[i] ^ E(C[i - 1]), C[-1] = IV.
+ *          All E() inputs are known in advance, so XTEA_LANES blocks are computed at once.
+ */
+static void cfbDecrypt(const uint8_t key[XTEA_KEY_SIZE], uint8_t rounds, const uint8_t iv[XTEA_IV_SIZE],
+                       const uint8_t *cipherText, uint8_t *plainText, uint32_t length)
+{
+    uint32_t    blocks = (length + XTEA_BLOCK_SIZE - 1) / XTEA_BLOCK_SIZE;
+
+    for (unsigned idx = 0; idx < XTEA_LANES; idx++)
+    {
+        xteaLanesSetKey(&schedule, idx, key, 0x00, rounds);
+    }
+
+    for (uint32_t first = 0; first < blocks; first += XTEA_LANES)
+    {
+        unsigned    lanes = ((blocks - first) < XTEA_LANES) ? (blocks - first) : XTEA_LANES;
+
+        for (unsigned idx = 0; idx < lanes; idx++)
+        {
+            uint32_t    block = first + idx;
+
+            xteaLanesLoad(&state, idx, (block == 0) ? iv : (cipherText + ((block - 1) * XTEA_BLOCK_SIZE)));
+        }
+        kernel(&schedule, &state, rounds);
+        blocksProcessed += lanes;
+
+        for (unsigned idx = 0; idx < lanes; idx++)
+        {
+            uint32_t    offset = (first + idx) * XTEA_BLOCK_SIZE;
+            uint32_t    size = ((length - offset) < XTEA_BLOCK_SIZE) ? (length - offset) : XTEA_BLOCK_SIZE;
+            uint8_t     stream[XTEA_BLOCK_SIZE];
+
+            xteaLanesStore(&state, idx, stream);
+            for (uint32_t pos = 0; pos < size; pos++)
+            {
+                plainText[offset + pos] = cipherText[offset + pos] ^ stream[pos];
+            }
+        }
+    }
+}
+
+/**
+ * \brief Check the control data and queue MAC computations of an image.
+ *
+ * \return number of MACs added to 'macs'
+ */
+static size_t queueMacs(verifyImage_t *image, verifyMac_t *macs)
+{
+    const uint8_t * data = image->data;
+    uint8_t         mode = data[IMAGE_OFS_MODE];
+    uint32_t        size = imageGetU32(data + IMAGE_OFS_FIRMWARE_SIZE);
+    uint32_t        pageSize = (uint32_t)data[IMAGE_OFS_RFU] * XTEA_BLOCK_SIZE;
+    size_t          count = 0;
+
+    if ((mode & IMAGE_MODE_MAC_TYPE_gm) != IMAGE_MODE_MAC_PAGE_CHAIN)
+    {
+        if ((IMAGE_CONTROL_DATA_SIZE + (size_t)size) != image->size)
+        {
+            image->error = "wrong image size";
+            return 0;
+        }
+        if ((mode & IMAGE_MODE_MAC_TYPE_gm) == IMAGE_MODE_MAC_CHASKEY)
+        {                                                           // cheap enough to be computed right here
+            chaskeyCtx_t    ctx;
+
+            chaskeyMacInit(&ctx, image->key, data[IMAGE_OFS_MAC_ROUNDS]);
+            chaskeyMacUpdate(&ctx, data + IMAGE_MAC_FIELD_SIZE, IMAGE_DESCR_SIZE + size);
+            chaskeyMacFinish(&ctx);
+            if (!chaskeyMacCmp(&ctx, data + IMAGE_OFS_MAC, IMAGE_MAC_SIZE))
+            {
+                image->error = "MAC mismatch";
+            }
+            return 0;
+        }
+        macs[0] = (verifyMac_t){ image, data + IMAGE_MAC_FIELD_SIZE, IMAGE_DESCR_SIZE + size, data + IMAGE_OFS_MAC, data[IMAGE_OFS_MAC_ROUNDS] };
+        return 1;
+    }
+
+    uint32_t    pages = (pageSize == 0) ? 0 : ((size + pageSize - 1) / pageSize);
+
+    if ((pageSize == 0) || ((IMAGE_CONTROL_DATA_SIZE + (size_t)size + (pages * XTEA_BLOCK_SIZE)) != image->size))
+    {
+        image->error = "wrong image size";
+        return 0;
+    }
+                                                                    // descriptor and the first tag
+    macs[count++] = (verifyMac_t){ image, data + IMAGE_MAC_FIELD_SIZE, IMAGE_DESCR_SIZE + ((size != 0) ? XTEA_BLOCK_SIZE : 0),
+                                   data + IMAGE_OFS_MAC, data[IMAGE_OFS_MAC_ROUNDS] };
+    for (uint32_t page = 0; page < pages; page++)
+    {                                                               // Ti = MAC(Pi | Ti+1), Tn = MAC(Pn)
+        const uint8_t * tag = data + IMAGE_CONTROL_DATA_SIZE + (page * (pageSize + XTEA_BLOCK_SIZE));
+        uint32_t        length = ((size - (page * pageSize)) < pageSize) ? (size - (page * pageSize)) : pageSize;
+
+        macs[count++] = (verifyMac_t){ image, tag + XTEA_BLOCK_SIZE, length + ((page + 1 < pages) ? XTEA_BLOCK_SIZE : 0),
+                                       tag, data[IMAGE_OFS_MAC_ROUNDS] };
+    }
+
+    return count;
+}
+
+/**
+ * \brief Decrypt [and decompress] the firmware of an image with correct MACs and compare it with the source.
+ */
+static void verifyContent(verifyImage_t *image)
+{
+    const uint8_t * data = image->data;
+    uint8_t         mode = data[IMAGE_OFS_MODE];
+    uint32_t        size = imageGetU32(data + IMAGE_OFS_FIRMWARE_SIZE);
+    uint32_t        pageSize = (uint32_t)data[IMAGE_OFS_RFU] * XTEA_BLOCK_SIZE;
+    bool            newKey = (mode & IMAGE_MODE_NEWKEY_gm) != 0;
+    bool            cipher = (mode & IMAGE_MODE_CIPHER_gm) != 0;
+    bool            speck = ((mode & IMAGE_MODE_CIPHER_gm) == IMAGE_MODE_CIPHER_SPECK)
+                            || ((mode & IMAGE_MODE_NEWKEY_gm) == IMAGE_MODE_NEWKEY_SPECK);
+    uint32_t        offset = newKey ? XTEA_KEY_SIZE : 0;
+    uint8_t       * cipherText = malloc(offset + size + 1);
+    uint8_t       * plainText = malloc(offset + size + 1);
+
+    if ((cipherText == NULL) || (plainText == NULL))
+    {
+        image->error = "out of memory";
+        goto done;
+    }
+
+    memcpy(cipherText, data + IMAGE_OFS_NEW_KEY, offset);            // the CFB chain starts with the new key
+    if ((mode & IMAGE_MODE_MAC_TYPE_gm) == IMAGE_MODE_MAC_PAGE_CHAIN)
+    {
+        for (uint32_t pos = 0; pos < size; pos += pageSize)
+        {
+            uint32_t    length = ((size - pos) < pageSize) ? (size - pos) : pageSize;
+
+            memcpy(cipherText + offset + pos, data + IMAGE_CONTROL_DATA_SIZE + pos + (((pos / pageSize) + 1) * XTEA_BLOCK_SIZE), length);
+        }
+    } else
+    {
+        memcpy(cipherText + offset, data + IMAGE_CONTROL_DATA_SIZE, size);
+    }
+
+    if (speck)
+    {                                                               // no lanes for Speck, it is fast enough as it is
+        speckCtx_t  ctx;
+        uint8_t     iv[SPECK_IV_SIZE];
+
+        speckSetKey(&ctx, image->key);
+        ctx.operation = speckDecrypt;
+        memcpy(iv, data + IMAGE_OFS_CIPHER_IV, SPECK_IV_SIZE);
+        memcpy(plainText, cipherText, cipher ? (offset + size) : offset);
+        speckCfbBuffer(&ctx, iv, plainText, cipher ? (offset + size) : offset);
+    } else
+    {
+        cfbDecrypt(image->key, data[IMAGE_OFS_CIPHER_ROUNDS], data + IMAGE_OFS_CIPHER_IV, cipherText, plainText,
+                   cipher ? (offset + size) : offset);
+    }
+    if (!cipher)
+    {
+        memcpy(plainText + offset, cipherText + offset, size);
+    }
+
+    if (image->hasNewKey && (!newKey || (memcmp(plainText, image->newKey, XTEA_KEY_SIZE) != 0)))
+    {
+        image->error = "new key mismatch";
+        goto done;
+    }
+
+    const uint8_t * firmware = plainText + offset;
+    int64_t         firmwareSize = size;
+    uint8_t       * expanded = NULL;
+
+    if (data[IMAGE_OFS_RFU + 1] == IMAGE_PAYLOAD_LZ)
+    {
+        expanded = malloc(image->firmwareSize + 1);
+        firmwareSize = (expanded == NULL) ? -1 : imageLzExpand(firmware, size, expanded, (uint32_t)image->firmwareSize);
+        firmware = expanded;
+    } else if (data[IMAGE_OFS_RFU + 1] == IMAGE_PAYLOAD_SPARSE)
+    {                                                               // whole pages up to the last one with data,
+        uint32_t    pageSize = (uint32_t)data[IMAGE_OFS_RFU] * XTEA_BLOCK_SIZE; // so sizes differ by erased bytes
+        uint32_t    capacity = (uint32_t)image->firmwareSize + pageSize;
+
+        expanded = malloc(capacity);
+        firmwareSize = (expanded == NULL) ? -1 : imageSparseExpand(firmware, size, pageSize, expanded, capacity);
+        firmware = expanded;
+        if ((firmwareSize >= 0) && isErasedTail(firmware, (size_t)firmwareSize, image->firmware, image->firmwareSize))
+        {
+            firmwareSize = (int64_t)image->firmwareSize;
+        }
+    }
+    if ((firmwareSize != (int64_t)image->firmwareSize) || (memcmp(firmware, image->firmware, image->firmwareSize) != 0))
+    {
+        image->error = "firmware mismatch";
+    }
+    free(expanded);
+
+done:
+    free(cipherText);
+    free(plainText);
+}
+
+static bool addImage(verifyImage_t **images, size_t *count, size_t *capacity)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? (2 * *capacity) : 64;
+        verifyImage_t * grown = realloc(*images, *capacity * sizeof(verifyImage_t));
+        if (grown == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory\n");
+            return false;
+        }
+        *images = grown;
+    }
+    memset(&(*images)[*count], 0, sizeof(verifyImage_t));
+    (*count)++;
+
+    return true;
+}
+
+/**
+ * \brief Read manifest file (IMAGE_MANIFEST_FORMAT) into the array of images.
+ *
+ * \return true on success
+ */
+static bool loadManifest(const char *path, verifyImage_t **images, size_t *count)
+{
+    FILE      * file = fopen(path, "r");
+    char        line[3 * VERIFY_PATH_SIZE];
+    size_t      capacity = 0;
+    unsigned    lineNo = 0;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "ERROR: %s while trying to read from file: %s\n", strerror(errno), path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char  * field[IMAGE_MANIFEST_FIELDS];
+        int     fields = imageManifestSplit(line, field);
+        char    outBase[VERIFY_PATH_SIZE];
+
+        lineNo++;
+        if (fields == 0)
+        {
+            continue;
+        }
+        if ((fields < 0) || !addImage(images, count, &capacity))
+        {
+            fprintf(stderr, "ERROR: %s:%u: expected '%s'\n", path, lineNo, IMAGE_MANIFEST_FORMAT);
+            fclose(file);
+            return false;
+        }
+
+        verifyImage_t * image = &(*images)[*count - 1];
+
+        snprintf(image->file, sizeof(image->file), "%s", field[0]);
+        if (fields == IMAGE_MANIFEST_FIELDS)
+        {
+            snprintf(outBase, sizeof(outBase), "%s", field[5]);
+        } else
+        {
+            imageDefaultOutBase(image->file, outBase, sizeof(outBase));
+        }
+        snprintf(image->image, sizeof(image->image), "%s.crypted.bin", outBase);
+        image->hasNewKey = (strcmp(field[2], "-") != 0);
+        if (!imageParseHex(field[1], image->key, XTEA_KEY_SIZE)
+            || (image->hasNewKey && !imageParseHex(field[2], image->newKey, XTEA_KEY_SIZE)))
+        {
+            fprintf(stderr, "ERROR: %s:%u: invalid key\n", path, lineNo);
+            fclose(file);
+            return false;
+        }
+    }
+    fclose(file);
+
+    return true;
+}
+
+/**
+ * \brief Check chaskey.h against the reference vectors of Chaskey (8 rounds): key 833D3433 009F389F 2398E64F 417ACF39,
+ *        message of bytes 0, 1, 2, ... of length 0, 1, 2, 16 and 17.
+ */
+static int selfTestChaskey(void)
+{
+    static const uint32_t   key[4] = { 0x833D3433, 0x009F389F, 0x2398E64F, 0x417ACF39 };
+    static const struct
+    {
+        uint8_t             length;
+        uint32_t            mac[4];
+    } vectors[] =
+    {
+        {  0, { 0x792E8FE5, 0x75CE87AA, 0x2D1450B5, 0x1191970B } },
+        {  1, { 0x13A9307B, 0x50E62C89, 0x4577BD88, 0xC0BBDC18 } },
+        {  2, { 0x55DF8922, 0x2C7FF577, 0x73809EF4, 0x4E5084C0 } },
+        { 16, { 0x79271CA9, 0xD66A1C71, 0x81CA474E, 0x49831CAD } },
+        { 17, { 0x048DA968, 0x4E25D096, 0x2D6CF897, 0xBC3959CA } },
+    };
+    uint8_t                 keyBytes[CHASKEY_KEY_SIZE];
+    uint8_t                 message[32];
+    unsigned                errors = 0;
+
+    for (unsigned idx = 0; idx < sizeof(keyBytes); idx++)
+    {
+        keyBytes[idx] = (uint8_t)(key[idx / 4] >> (8 * (idx % 4)));
+    }
+    for (unsigned idx = 0; idx < sizeof(message); idx++)
+    {
+        message[idx] = (uint8_t)idx;
+    }
+    for (unsigned vector = 0; vector < (sizeof(vectors) / sizeof(vectors[0])); vector++)
+    {
+        chaskeyCtx_t    ctx;
+        uint8_t         expected[CHASKEY_BLOCK_SIZE];
+
+        for (unsigned idx = 0; idx < sizeof(expected); idx++)
+        {
+            expected[idx] = (uint8_t)(vectors[vector].mac[idx / 4] >> (8 * (idx % 4)));
+        }
+        chaskeyMacInit(&ctx, keyBytes, 8);
+        chaskeyMacUpdate(&ctx, message, vectors[vector].length);
+        chaskeyMacFinish(&ctx);
+        errors += !chaskeyMacCmp(&ctx, expected, CHASKEY_BLOCK_SIZE);
+    }
+    printf("chaskey: %s\n", errors ? "FAILED" : "ok");
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * \brief Check speck.h against the reference vector of Speck64/128: key 1B1A1918 13121110 0B0A0908 03020100,
+ *        plaintext 3B726574 7475432D, ciphertext 8C6FA548 454E028B.
+ */
+static int selfTestSpeck(void)
+{
+    static const uint8_t    key[SPECK_KEY_SIZE] = { 0x00, 0x01, 0x02, 0x03, 0x08, 0x09, 0x0A, 0x0B,
+                                                    0x10, 0x11, 0x12, 0x13, 0x18, 0x19, 0x1A, 0x1B };
+    static const uint8_t    plainText[SPECK_BLOCK_SIZE] = { 0x2D, 0x43, 0x75, 0x74, 0x74, 0x65, 0x72, 0x3B };
+    static const uint8_t    expected[SPECK_BLOCK_SIZE] = { 0x8B, 0x02, 0x4E, 0x45, 0x48, 0xA5, 0x6F, 0x8C };
+    speckCtx_t              ctx;
+    uint8_t                 block[SPECK_BLOCK_SIZE];
+    bool                    failed;
+
+    speckSetKey(&ctx, key);
+    speckEcbEncrypt(&ctx, plainText, block);
+    failed = (memcmp(block, expected, SPECK_BLOCK_SIZE) != 0);
+    printf("speck: %s\n", failed ? "FAILED" : "ok");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * \brief Compare every kernel with xteaEcbEncrypt() on random keys, blocks and rounds, then check Chaskey and Speck.
+ */
+static int selfTest(void)
+{
+    static const char * const   names[] = { "scalar", "sse2", "avx2" };
+    uint8_t                     keys[XTEA_LANES][XTEA_KEY_SIZE];
+    uint8_t                     blocks[XTEA_LANES][XTEA_BLOCK_SIZE];
+    int                         result = EXIT_SUCCESS;
+
+    for (unsigned kernelIdx = 0; kernelIdx < (sizeof(names) / sizeof(names[0])); kernelIdx++)
+    {
+        const char        * selected;
+        xteaLanesKernel_t   test = xteaLanesKernel(names[kernelIdx], &selected);
+        unsigned            errors = 0;
+
+        if (test == NULL)
+        {
+            printf("%s: not supported\n", names[kernelIdx]);
+            continue;
+        }
+        for (unsigned iteration = 0; iteration < 1000; iteration++)
+        {
+            unsigned rounds = 1 + (iteration % XTEA_LANES_MAX_ROUNDS);
+
+            if ((getrandom(keys, sizeof(keys), 0) != sizeof(keys)) || (getrandom(blocks, sizeof(blocks), 0) != sizeof(blocks)))
+            {
+                fprintf(stderr, "ERROR: %s while trying to generate test data\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+            for (unsigned lane = 0; lane < XTEA_LANES; lane++)
+            {
+                xteaLanesSetKey(&schedule, lane, keys[lane], 0x00, rounds);
+                xteaLanesLoad(&state, lane, blocks[lane]);
+            }
+            test(&schedule, &state, rounds);
+            for (unsigned lane = 0; lane < XTEA_LANES; lane++)
+            {
+                xteaEcbCtx_t    ctx;
+                uint8_t         expected[XTEA_BLOCK_SIZE];
+                uint8_t         actual[XTEA_BLOCK_SIZE];
+
+                xteaSetKey(&ctx, keys[lane]);
+                xteaEcbEncrypt(ctx.key, blocks[lane], expected, rounds);
+                xteaLanesStore(&state, lane, actual);
+                errors += (memcmp(expected, actual, XTEA_BLOCK_SIZE) != 0);
+            }
+        }
+        printf("%s: %s\n", names[kernelIdx], errors ? "FAILED" : "ok");
+        if (errors)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+    if (selfTestChaskey() != EXIT_SUCCESS)
+    {
+        result = EXIT_FAILURE;
+    }
+    if (selfTestSpeck() != EXIT_SUCCESS)
+    {
+        result = EXIT_FAILURE;
+    }
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        { "key",            required_argument,  NULL, 'k' },
+        { "newKey",         required_argument,  NULL, 'n' },
+        { "file",           required_argument,  NULL, 'f' },
+        { "image",          required_argument,  NULL, 'i' },
+        { "manifest",       required_argument,  NULL, 'M' },
+        { "engine",         required_argument,  NULL, 'e' },
+        { "self-test",      no_argument,        NULL, 's' },
+        { NULL,             0,                  NULL, 0   }
+    };
+    verifyImage_t     * images = NULL;
+    size_t              count = 0;
+    size_t              capacity = 0;
+    const char        * manifest = NULL;
+    const char        * engine = "auto";
+    const char        * selected = NULL;
+    verifyImage_t       single = { .file = "" };
+    bool                hasKey = false;
+    bool                test = false;
+    int                 opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'k': hasKey = imageParseHex(optarg, single.key, XTEA_KEY_SIZE);                     break;
+            case 'n': single.hasNewKey = imageParseHex(optarg, single.newKey, XTEA_KEY_SIZE);        break;
+            case 'f': snprintf(single.file, sizeof(single.file), "%s", optarg);                     break;
+            case 'i': snprintf(single.image, sizeof(single.image), "%s", optarg);                   break;
+            case 'M': manifest = optarg;                                                            break;
+            case 'e': engine = optarg;                                                              break;
+            case 's': test = true;                                                                  break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    kernel = xteaLanesKernel(engine, &selected);
+    if (kernel == NULL)
+    {
+        fprintf(stderr, "ERROR: engine not supported on this CPU: %s\n", engine);
+        return EXIT_FAILURE;
+    }
+    if (test)
+    {
+        return selfTest();
+    }
+
+    if (manifest != NULL)
+    {
+        if (!loadManifest(manifest, &images, &count))
+        {
+            free(images);
+            return EXIT_FAILURE;
+        }
+    } else
+    {
+        if (!hasKey || !single.file[0] || !addImage(&images, &count, &capacity))
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (!single.image[0])
+        {
+            char outBase[VERIFY_PATH_SIZE];
+
+            imageDefaultOutBase(single.file, outBase, sizeof(outBase));
+            snprintf(single.image, sizeof(single.image), "%s.crypted.bin", outBase);
+        }
+        images[0] = single;
+    }
+
+    size_t  macCount = 0;
+
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        verifyImage_t * image = &images[idx];
+
+        image->data = mapFile(image->image, &image->size);
+        if (imageIsObjectFile(image->file))
+        {
+            uint32_t    objectSize;
+
+            image->firmware = imageLoadObject(image->file, IMAGE_BOOT_SIZE, &objectSize);
+            image->firmwareSize = objectSize;
+            image->firmwareObject = true;
+        } else
+        {
+            image->firmware = mapFile(image->file, &image->firmwareSize);
+        }
+        if ((image->data == NULL) || (image->firmware == NULL))
+        {
+            image->error = "cannot read file";
+        } else if (image->size < IMAGE_CONTROL_DATA_SIZE)
+        {
+            image->error = "wrong image size";
+        } else
+        {
+            macCount += 1 + ((image->size - IMAGE_CONTROL_DATA_SIZE) / XTEA_BLOCK_SIZE);   // upper bound of page MACs
+        }
+    }
+
+    verifyMac_t       * macs = malloc((macCount + 1) * sizeof(verifyMac_t));
+    size_t              queued = 0;
+    struct timespec     start;
+    struct timespec     stop;
+
+    if (macs == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        if (images[idx].error == NULL)
+        {
+            queued += queueMacs(&images[idx], macs + queued);
+        }
+    }
+    verifyMacs(macs, queued);
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        if (images[idx].error == NULL)
+        {
+            verifyContent(&images[idx]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    size_t  failed = 0;
+    double  seconds = (double)(stop.tv_sec - start.tv_sec) + ((double)(stop.tv_nsec - start.tv_nsec) / 1e9);
+
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        printf("%s: %s\n", images[idx].image, (images[idx].error == NULL) ? "OK" : images[idx].error);
+        failed += (images[idx].error != NULL);
+        if ((images[idx].data != NULL) && (images[idx].size > 0))
+        {
+            munmap((void *)images[idx].data, images[idx].size);
+        }
+        if (images[idx].firmwareObject)
+        {
+            free((void *)images[idx].firmware);
+        } else if ((images[idx].firmware != NULL) && (images[idx].firmwareSize > 0))
+        {
+            munmap((void *)images[idx].firmware, images[idx].firmwareSize);
+        }
+    }
+    fprintf(stderr, "%zu images, %zu failed, engine %s, %llu blocks in %.3f s (%.1f Mblocks/s)\n",
+            count, failed, selected, (unsigned long long)blocksProcessed, seconds,
+            (seconds > 0) ? ((double)blocksProcessed / seconds / 1e6) : 0.0);
+
+    free(macs);
+    free(images);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
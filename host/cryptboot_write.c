@@ -0,0 +1,492 @@
+/**
+ * \file    cryptboot_write.c
+ * \brief   Writer of external 24Cxx EEPROM content ('*.aligned.bin' of firmware_creator.py / cryptboot_pack,
+ *          or the memory file of 'cryptboot_pack --directory') through Linux i2c-dev, or into a file
+ *          emulating the memory.
+ *
+ *          The memory is read and compared before writing, so only pages that differ from the file are written.
+ *          Pages of the file that are all 0xFF (the padding in front of the firmware descriptor
+ *          of '*.aligned.bin') are not read nor written, unless --write-erased is given.
+ *          Every write is one aligned memory page, the end of its write cycle is found by ACK polling
+ *          instead of a worst-case delay. Written pages are read back and checked.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "image.h"
+
+#define WRITE_MEM_ADDR          0xA0                                // TWI_MEM_ADDR of the bootloader (8-bit format)
+#define WRITE_BLOCK_SELECT_bp   3                                   // TWI_BLOCK_SELECT_bp of the bootloader
+#define WRITE_READ_CHUNK        4096                                // bytes per read transfer, below the i2c-dev limit
+#define WRITE_CYCLE_MS          10                                  // ACK polling gives up after this time
+#define WRITE_EMULATED_CYCLE_US 3000                                // typical tWR of 24Cxx parts (5 ms maximum)
+
+/**
+ * \brief   Access to the memory. A page write starts the write cycle of the memory, the memory
+ *          does not acknowledge its address until the cycle is over (see writeWaitReady()).
+ */
+typedef struct writeDevice
+{
+    bool             (* read)(struct writeDevice *device, uint32_t address, uint8_t *data, uint32_t length);
+    bool             (* write)(struct writeDevice *device, uint32_t address, const uint8_t *data, uint32_t length);
+    bool             (* ready)(struct writeDevice *device);
+    int                 fd;
+    uint8_t             deviceAddr;                 // 8-bit format, R/W bit cleared
+    uint8_t             blockSelect;                // bit of the device address of address bit 16
+    uint8_t           * memory;                     // emulated memory
+    uint32_t            memorySize;
+    uint64_t            busyUntil;                  // end of the emulated write cycle, in ns
+} writeDevice_t;
+
+/**
+ * \brief Work done by the writer.
+ */
+typedef struct writeStats
+{
+    uint32_t            pagesErased;                // skipped, all 0xFF in the file
+    uint32_t            pagesUnchanged;
+    uint32_t            pagesWritten;
+    uint32_t            bytesRead;
+    uint32_t            bytesWritten;
+    uint64_t            pollNs;                     // time of ACK polling, write cycles of the memory
+} writeStats_t;
+
+static uint64_t nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * \return 7-bit bus address of the memory block holding the given address
+ */
+static uint16_t i2cAddress(const writeDevice_t *device, uint32_t address)
+{
+    return (uint16_t)((device->deviceAddr | ((address >> 16) << device->blockSelect)) >> 1);
+}
+
+static bool i2cRead(writeDevice_t *device, uint32_t address, uint8_t *data, uint32_t length)
+{
+    uint8_t                     word[2] = { (uint8_t)(address >> 8), (uint8_t)address };
+    struct i2c_msg              msgs[2] =
+    {
+        { .addr = i2cAddress(device, address), .flags = 0,          .len = sizeof(word),      .buf = word },
+        { .addr = i2cAddress(device, address), .flags = I2C_M_RD,   .len = (uint16_t)length,  .buf = data }
+    };
+    struct i2c_rdwr_ioctl_data  transfer = { .msgs = msgs, .nmsgs = 2 };
+
+    return ioctl(device->fd, I2C_RDWR, &transfer) == 2;
+}
+
+static bool i2cWrite(writeDevice_t *device, uint32_t address, const uint8_t *data, uint32_t length)
+{
+    uint8_t                     buffer[2 + 256];
+    struct i2c_msg              msg = { .addr = i2cAddress(device, address), .flags = 0, .len = (uint16_t)(2 + length), .buf = buffer };
+    struct i2c_rdwr_ioctl_data  transfer = { .msgs = &msg, .nmsgs = 1 };
+
+    buffer[0] = (uint8_t)(address >> 8);
+    buffer[1] = (uint8_t)address;
+    memcpy(buffer + 2, data, length);
+
+    return ioctl(device->fd, I2C_RDWR, &transfer) == 1;
+}
+
+/**
+ * \brief   The memory acknowledges its address when the write cycle is over. The word address
+ *          is sent too, adapters that cannot send an address alone (no I2C_FUNC_SMBUS_QUICK) are common.
+ */
+static bool i2cReady(writeDevice_t *device)
+{
+    uint8_t                     word[2] = { 0, 0 };
+    struct i2c_msg              msg = { .addr = i2cAddress(device, 0), .flags = 0, .len = sizeof(word), .buf = word };
+    struct i2c_rdwr_ioctl_data  transfer = { .msgs = &msg, .nmsgs = 1 };
+
+    return ioctl(device->fd, I2C_RDWR, &transfer) == 1;
+}
+
+/**
+ * \brief   The emulated memory does not answer during the write cycle, a sequential read wraps
+ *          within the 64 KB block and a page write within the page, as on 24Cxx parts.
+ */
+static bool emulatedRead(writeDevice_t *device, uint32_t address, uint8_t *data, uint32_t length)
+{
+    uint32_t    block = address & ~(IMAGE_MEM_BLOCK_SIZE - 1) & (device->memorySize - 1);
+    uint32_t    offset;
+
+    if (nowNs() < device->busyUntil)
+    {
+        return false;
+    }
+    for (offset = 0; offset < length; offset++)
+    {
+        data[offset] = device->memory[block | ((address + offset) & (IMAGE_MEM_BLOCK_SIZE - 1) & (device->memorySize - 1))];
+    }
+
+    return true;
+}
+
+static bool emulatedWrite(writeDevice_t *device, uint32_t address, const uint8_t *data, uint32_t length)
+{
+    uint32_t    page = address & ~(IMAGE_MEM_PAGE_SIZE - 1) & (device->memorySize - 1);
+    uint32_t    offset;
+
+    if (nowNs() < device->busyUntil)
+    {
+        return false;
+    }
+    for (offset = 0; offset < length; offset++)
+    {
+        device->memory[page | ((address + offset) & (IMAGE_MEM_PAGE_SIZE - 1))] = data[offset];
+    }
+    device->busyUntil = nowNs() + (WRITE_EMULATED_CYCLE_US * 1000ULL);
+
+    return true;
+}
+
+static bool emulatedReady(writeDevice_t *device)
+{
+    return nowNs() >= device->busyUntil;
+}
+
+/**
+ * \brief Open the i2c-dev adapter.
+ *
+ * \return true on success, false otherwise
+ */
+static bool openI2c(writeDevice_t *device, const char *path)
+{
+    unsigned long   functions = 0;
+    bool            result = false;
+
+    device->fd = open(path, O_RDWR);
+    if (device->fd < 0)
+    {
+        fprintf(stderr, "ERROR: %s while trying to open I2C adapter: %s\n", strerror(errno), path);
+    } else if ((ioctl(device->fd, I2C_FUNCS, &functions) < 0) || !(functions & I2C_FUNC_I2C))
+    {
+        fprintf(stderr, "ERROR: I2C adapter does not support plain I2C transfers: %s\n", path);
+    } else
+    {
+        device->read = i2cRead;
+        device->write = i2cWrite;
+        device->ready = i2cReady;
+        result = true;
+    }
+
+    return result;
+}
+
+/**
+ * \brief   Open the file emulating the memory, a new file is created as an erased memory
+ *          of 'memorySize' bytes (the size of an existing file is taken as the memory size).
+ *
+ * \return true on success, false otherwise
+ */
+static bool openEmulated(writeDevice_t *device, const char *path, uint32_t memorySize)
+{
+    struct stat     info;
+    bool            result = false;
+
+    device->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if ((device->fd < 0) || (fstat(device->fd, &info) != 0))
+    {
+        fprintf(stderr, "ERROR: %s while trying to open file: %s\n", strerror(errno), path);
+        return false;
+    }
+    if (info.st_size != 0)
+    {
+        memorySize = (uint32_t)info.st_size;
+    } else if (ftruncate(device->fd, memorySize) != 0)
+    {
+        fprintf(stderr, "ERROR: %s while trying to write to file: %s\n", strerror(errno), path);
+        return false;
+    }
+    if ((memorySize & (memorySize - 1)) || (memorySize < IMAGE_MEM_PAGE_SIZE))
+    {
+        fprintf(stderr, "ERROR: memory size is not a power of two: %s\n", path);
+    } else if ((device->memory = mmap(NULL, memorySize, PROT_READ | PROT_WRITE, MAP_SHARED, device->fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: %s while trying to map file: %s\n", strerror(errno), path);
+    } else
+    {
+        if (info.st_size == 0)
+        {
+            memset(device->memory, 0xFF, memorySize);
+        }
+        device->memorySize = memorySize;
+        device->read = emulatedRead;
+        device->write = emulatedWrite;
+        device->ready = emulatedReady;
+        result = true;
+    }
+
+    return result;
+}
+
+/**
+ * \brief Poll the memory until its write cycle is over.
+ *
+ * \return true if the memory is ready, false if it has not answered within WRITE_CYCLE_MS
+ */
+static bool writeWaitReady(writeDevice_t *device, writeStats_t *stats)
+{
+    uint64_t    started = nowNs();
+    bool        result;
+
+    while (!(result = device->ready(device)) && (nowNs() - started < WRITE_CYCLE_MS * 1000000ULL))
+    {
+    }
+    stats->pollNs += nowNs() - started;
+
+    return result;
+}
+
+/**
+ * \return true if all bytes are 0xFF
+ */
+static bool isErased(const uint8_t *data, uint32_t length)
+{
+    while (length && (*data == 0xFF))
+    {
+        data++;
+        length--;
+    }
+
+    return length == 0;
+}
+
+/**
+ * \brief   Read the memory from 'address' in transfers that do not cross a 64 KB block (a sequential read
+ *          of the memory wraps within the block).
+ *
+ * \return true on success, false otherwise
+ */
+static bool readMemory(writeDevice_t *device, writeStats_t *stats, uint32_t address, uint8_t *data, uint32_t length)
+{
+    uint32_t    chunk;
+    bool        result = true;
+
+    while (length && result)
+    {
+        chunk = IMAGE_MEM_BLOCK_SIZE - (address & (IMAGE_MEM_BLOCK_SIZE - 1));
+        chunk = (chunk < WRITE_READ_CHUNK) ? chunk : WRITE_READ_CHUNK;
+        chunk = (chunk < length) ? chunk : length;
+        result = device->read(device, address, data, chunk);
+        stats->bytesRead += chunk;
+        address += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+
+    return result;
+}
+
+/**
+ * \return number of bytes of 'data' from 'position' up to the end of the memory page or of 'data'
+ */
+static uint32_t pageLength(uint32_t address, uint32_t position, uint32_t size)
+{
+    uint32_t length = IMAGE_MEM_PAGE_SIZE - ((address + position) & (IMAGE_MEM_PAGE_SIZE - 1));
+
+    return (length < size - position) ? length : size - position;
+}
+
+/**
+ * \brief   Bring the memory from 'address' up to date with 'data': runs of pages that are not erased
+ *          in 'data' are read at once, pages that differ are written and read back.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int writeImage(writeDevice_t *device, writeStats_t *stats, uint32_t address, const uint8_t *data, uint32_t size, bool writeErased)
+{
+    uint8_t   * current = malloc(size);
+    uint8_t     check[IMAGE_MEM_PAGE_SIZE];
+    uint32_t    start = 0;
+    uint32_t    end;
+    uint32_t    page;
+    uint32_t    length;
+    int         result = (current != NULL) ? 0 : -1;
+
+    while ((start < size) && (result == 0))
+    {
+        end = start;
+        while ((end < size) && (writeErased || !isErased(data + end, pageLength(address, end, size))))
+        {
+            end += pageLength(address, end, size);
+        }
+        if (end == start)
+        {
+            stats->pagesErased++;
+            start += pageLength(address, start, size);
+            continue;
+        }
+        if (!readMemory(device, stats, address + start, current + start, end - start))
+        {
+            fprintf(stderr, "ERROR: memory does not answer at 0x%05X\n", address + start);
+            result = -1;
+        }
+        for (page = start; (page < end) && (result == 0); page += length)
+        {
+            length = pageLength(address, page, end);
+            if (memcmp(current + page, data + page, length) == 0)
+            {
+                stats->pagesUnchanged++;
+            } else if (!device->write(device, address + page, data + page, length) || !writeWaitReady(device, stats)
+                       || !readMemory(device, stats, address + page, check, length))
+            {
+                fprintf(stderr, "ERROR: page write at 0x%05X is not acknowledged\n", address + page);
+                result = -1;
+            } else if (memcmp(check, data + page, length) != 0)
+            {
+                fprintf(stderr, "ERROR: page at 0x%05X reads back different data\n", address + page);
+                result = -1;
+            } else
+            {
+                stats->pagesWritten++;
+                stats->bytesWritten += length;
+            }
+        }
+        start = end;
+    }
+    free(current);
+
+    return result;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s --image MEMORY.bin (--device /dev/i2c-N | --emulate FILE.bin) [--offset ADDRESS]\n"
+        "          [--address 0xA0] [--block-select-bit 3] [--mem-size BYTES] [--write-erased]\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        { "image",              required_argument,  NULL, 'i' },
+        { "device",             required_argument,  NULL, 'd' },
+        { "emulate",            required_argument,  NULL, 'e' },
+        { "offset",             required_argument,  NULL, 'o' },
+        { "address",            required_argument,  NULL, 'a' },
+        { "block-select-bit",   required_argument,  NULL, 'b' },
+        { "mem-size",           required_argument,  NULL, 's' },
+        { "write-erased",       no_argument,        NULL, 'w' },
+        { NULL,                 0,                  NULL, 0   }
+    };
+    writeDevice_t   device = { .fd = -1, .deviceAddr = WRITE_MEM_ADDR, .blockSelect = WRITE_BLOCK_SELECT_bp };
+    writeStats_t    stats = { 0 };
+    const char    * image = NULL;
+    const char    * i2c = NULL;
+    const char    * emulated = NULL;
+    uint32_t        offset = 0;
+    uint32_t        memorySize = IMAGE_MEM_BLOCK_SIZE;
+    bool            writeErased = false;
+    uint8_t       * data;
+    uint32_t        size;
+    struct stat     info;
+    uint64_t        started;
+    int             fd;
+    int             opt;
+    int             result = -1;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                image = optarg;
+                break;
+            case 'd':
+                i2c = optarg;
+                break;
+            case 'e':
+                emulated = optarg;
+                break;
+            case 'o':
+                offset = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                device.deviceAddr = (uint8_t)strtoul(optarg, NULL, 0) & 0xFE;
+                break;
+            case 'b':
+                device.blockSelect = (uint8_t)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                memorySize = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                writeErased = true;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ((image == NULL) || ((i2c == NULL) == (emulated == NULL)))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (((fd = open(image, O_RDONLY)) < 0) || (fstat(fd, &info) != 0) || (info.st_size == 0)
+        || ((data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+    {
+        fprintf(stderr, "ERROR: cannot read file: %s\n", image);
+        return EXIT_FAILURE;
+    }
+    size = (uint32_t)info.st_size;
+
+    if ((i2c != NULL) ? openI2c(&device, i2c) : openEmulated(&device, emulated, memorySize))
+    {
+        memorySize = (emulated != NULL) ? device.memorySize : memorySize;
+        if (((uint64_t)offset + size) > memorySize)
+        {
+            fprintf(stderr, "ERROR: %u bytes at 0x%05X do not fit in %u bytes of memory\n", size, offset, memorySize);
+        } else
+        {
+            started = nowNs();
+            result = writeImage(&device, &stats, offset, data, size, writeErased);
+            printf("pagesErased %u\n",      stats.pagesErased);
+            printf("pagesUnchanged %u\n",   stats.pagesUnchanged);
+            printf("pagesWritten %u\n",     stats.pagesWritten);
+            printf("bytesRead %u\n",        stats.bytesRead);
+            printf("bytesWritten %u\n",     stats.bytesWritten);
+            printf("pollMs %.1f\n",         (double)stats.pollNs / 1e6);
+            printf("elapsedMs %.1f\n",      (double)(nowNs() - started) / 1e6);
+        }
+    }
+    if (device.memory != NULL)
+    {
+        munmap(device.memory, device.memorySize);
+    }
+    if (device.fd >= 0)
+    {
+        close(device.fd);
+    }
+    munmap(data, size);
+    close(fd);
+
+    return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
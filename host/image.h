@@ -0,0 +1,923 @@
+/**
+ * \file    image.h
+ * \brief   Host-side helpers for building and parsing CryptBoot firmware images.
+ *          Layout and algorithms mirror firmware_creator.py byte for byte.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "xtea.h"
+#include "chaskey.h"
+#include "speck.h"
+
+#define IMAGE_BOOT_SIZE             (0x08 * 0x100)
+#define IMAGE_CONTROL_DATA_SIZE     64
+#define IMAGE_MAC_FIELD_SIZE        16
+#define IMAGE_IV_FIELD_SIZE         16
+#define IMAGE_DESCR_SIZE            (IMAGE_CONTROL_DATA_SIZE - IMAGE_MAC_FIELD_SIZE)
+#define IMAGE_ALIGN_SIZE            (IMAGE_BOOT_SIZE - IMAGE_CONTROL_DATA_SIZE)
+#define IMAGE_VERSION               0x10
+#define IMAGE_MAC_SIZE              8
+
+// offsets of firmwareCfg_t fields inside the serialized control data
+#define IMAGE_OFS_MAC               0
+#define IMAGE_OFS_VERSION           16
+#define IMAGE_OFS_MODE              17
+#define IMAGE_OFS_CIPHER_ROUNDS     18
+#define IMAGE_OFS_MAC_ROUNDS        19
+#define IMAGE_OFS_TIMESTAMP         20
+#define IMAGE_OFS_FIRMWARE_SIZE     24
+#define IMAGE_OFS_CIPHER_IV         28
+#define IMAGE_OFS_RFU               44
+#define IMAGE_OFS_NEW_KEY           48
+
+#define IMAGE_MODE_CIPHER_gm        0x03
+#define IMAGE_MODE_CIPHER_XTEA      0x01
+#define IMAGE_MODE_CIPHER_SPECK     0x03            // cipherRounds - SPECK_ROUNDS
+#define IMAGE_MODE_NEWKEY_gm        0x0C
+#define IMAGE_MODE_NEWKEY_XTEA      0x04
+#define IMAGE_MODE_NEWKEY_SPECK     0x0C            // same cipher as the firmware, one CFB chain
+#define IMAGE_MODE_MAC_TYPE_gm      0xC0
+#define IMAGE_MODE_MAC_CHASKEY      0x80            // whole image MAC only, macRounds - permutation rounds
+#define IMAGE_MODE_MAC_PAGE_CHAIN   0xC0
+#define IMAGE_PAYLOAD_LZ            0x01            // rfu[1]
+#define IMAGE_PAYLOAD_SPARSE        0x02            // rfu[1], rfu[0] - page size in XTEA blocks
+#define IMAGE_SPARSE_GROUP          (8 * XTEA_BLOCK_SIZE)   // pages per mask of the sparse payload
+#define IMAGE_CRC_POLYNOMIAL        0x1021          // rfu[2..3], CRC-16-CCITT of CRCSCAN
+#define IMAGE_CRC_INIT              0xFFFF
+#define IMAGE_CRC_SIZE              2               // at the end of Flash, stored by the bootloader
+
+// ELF and Intel HEX input: Flash addresses of the AVR toolchain, EEPROM, fuses and lock bits are above
+#define IMAGE_OBJECT_FLASH_END      0x800000
+#define IMAGE_OBJECT_MAX_SIZE       0x40000         // largest Flash of supported parts is 48 KB
+
+#define IMAGE_LZ_MIN_MATCH          3
+#define IMAGE_LZ_MAX_MATCH          (0x7F + IMAGE_LZ_MIN_MATCH)
+#define IMAGE_LZ_MAX_LITERALS       0x80
+#define IMAGE_LZ_MAX_DISTANCE       0xFFFF
+#define IMAGE_LZ_MAX_CANDIDATES     64
+#define IMAGE_LZ_HASH_SIZE          0x1000
+
+// image directory of external memory (bootloader built with SLOTS=N), see cryptboot_x.h
+#define IMAGE_DIRECTORY_AT          0x0000
+#define IMAGE_SLOT_UNUSED           0xFFFFFFFF
+#define IMAGE_SLOTS_MAX             16
+#define IMAGE_MEM_PAGE_SIZE         0x40
+#define IMAGE_MEM_BLOCK_SIZE        0x10000         // sequential read does not cross it (24LC1025)
+
+// batch manifest shared by the host tools, one image per line
+#define IMAGE_MANIFEST_FORMAT       "<firmware> <key> <newKey|-> <cipherRounds> <macRounds> [outputBase]"
+#define IMAGE_MANIFEST_FIELDS       6
+
+/**
+ * \brief Parameters of a single image to be built.
+ */
+typedef struct imageJob
+{
+    uint8_t             key[XTEA_KEY_SIZE];
+    uint8_t             newKey[XTEA_KEY_SIZE];
+    uint8_t             iv[XTEA_IV_SIZE];
+    uint8_t             mode;
+    uint8_t             cipherRounds;
+    uint8_t             macRounds;
+    bool                hasNewKey;
+    uint16_t            pageSize;           // Flash page size for the page chained format, 0 - whole image MAC
+    bool                compress;           // LZ compress firmware before encryption
+    uint16_t            sparsePageSize;     // Flash page size for the sparse payload, 0 - every byte of firmware
+    uint32_t            timeStamp;
+    uint32_t            crcFlashSize;       // Flash size for CRC-16-CCITT of the programmed application (CRC=1), 0 - none
+} imageJob_t;
+
+/**
+ * \brief Store 32-bit value in little-endian byte order.
+ */
+static inline void imagePutU32(uint8_t *dst, uint32_t value)
+{
+    dst[0] = (uint8_t)(value);
+    dst[1] = (uint8_t)(value >> 8);
+    dst[2] = (uint8_t)(value >> 16);
+    dst[3] = (uint8_t)(value >> 24);
+}
+
+/**
+ * \brief Load 32-bit value stored in little-endian byte order.
+ */
+static inline uint32_t imageGetU32(const uint8_t *src)
+{
+    return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+/**
+ * \brief Parse a hexadecimal string of exactly 'length' bytes.
+ *
+ * \return true on success, false if string has wrong length or characters.
+ */
+static bool imageParseHex(const char *text, uint8_t *out, size_t length)
+{
+    if (strlen(text) != (2 * length))
+    {
+        return false;
+    }
+
+    for (size_t idx = 0; idx < length; idx++)
+    {
+        char hex[3] = { text[2 * idx], text[(2 * idx) + 1], 0 };
+
+        if (!isxdigit((unsigned char)hex[0]) || !isxdigit((unsigned char)hex[1]))
+        {
+            return false;
+        }
+        out[idx] = (uint8_t)strtoul(hex, NULL, 16);
+    }
+
+    return true;
+}
+
+/**
+ * \brief   Split a manifest line (IMAGE_MANIFEST_FORMAT) into fields in place,
+ *          '#' starts a comment.
+ *
+ * \return number of fields, 0 for an empty line, -1 for a wrong number of fields
+ */
+static int imageManifestSplit(char *line, char *field[IMAGE_MANIFEST_FIELDS])
+{
+    char  * save = NULL;
+    char  * comment = strchr(line, '#');
+    int     fields = 0;
+
+    if (comment != NULL)
+    {
+        *comment = 0;
+    }
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (fields == IMAGE_MANIFEST_FIELDS)
+        {
+            return -1;
+        }
+        field[fields++] = tok;
+    }
+
+    return ((fields == 0) || (fields >= (IMAGE_MANIFEST_FIELDS - 1))) ? fields : -1;
+}
+
+/**
+ * \brief Default output base - file stem in the current directory, like firmware_creator.py.
+ */
+static void imageDefaultOutBase(const char *file, char *outBase, size_t size)
+{
+    const char * base = strrchr(file, '/');
+    const char * dot;
+
+    base = (base == NULL) ? file : base + 1;
+    dot = strrchr(base, '.');
+    snprintf(outBase, size, "%.*s", (int)((dot == NULL) ? strlen(base) : (size_t)(dot - base)), base);
+}
+
+/**
+ * \brief Packed time stamp of the current local time (same layout as firmware_creator.py).
+ */
+static uint32_t imageTimeStamp(void)
+{
+    time_t      now = time(NULL);
+    struct tm   date;
+
+    localtime_r(&now, &date);
+
+    return (((uint32_t)(date.tm_year + 1900) & 0x0FFF) << 20)
+         | (((uint32_t)(date.tm_mon + 1) & 0x0F) << 16)
+         | (((uint32_t)date.tm_mday & 0x1F) << 11)
+         | (((uint32_t)date.tm_hour & 0x1F) << 6)
+         | ((uint32_t)date.tm_min & 0x3F);
+}
+
+/**
+ * \return number of pages of the page chained format
+ */
+static inline uint32_t imagePageCount(const imageJob_t *job, uint32_t size)
+{
+    return (job->pageSize == 0) ? 0 : ((size + job->pageSize - 1) / job->pageSize);
+}
+
+/**
+ * \return size of the image data following the control data
+ */
+static inline uint32_t imagePayloadSize(const imageJob_t *job, uint32_t size)
+{
+    return size + (imagePageCount(job, size) * XTEA_BLOCK_SIZE);
+}
+
+/**
+ * \brief   CRC-16-CCITT (MSB first, no final XOR) as computed by the CRCSCAN peripheral.
+ *
+ * \param[in]   crc     CRC of preceding data, IMAGE_CRC_INIT at start.
+ * \param[in]   data    data, NULL for 'length' erased (0xFF) bytes.
+ * \param[in]   length  size of data in bytes.
+ *
+ * \return CRC updated with data
+ */
+static uint16_t imageCrc16(uint16_t crc, const uint8_t *data, uint32_t length)
+{
+    for (uint32_t idx = 0; idx < length; idx++)
+    {
+        crc ^= (uint16_t)((data != NULL) ? data[idx] : 0xFF) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ IMAGE_CRC_POLYNOMIAL) : (uint16_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * \brief   End of the application as the bootloader programs it: the firmware, for the sparse payload
+ *          the end of its last page with data (pages are programmed whole).
+ *
+ * \return size of the programmed application in bytes
+ */
+static uint32_t imageAppEnd(const imageJob_t *job, const uint8_t *firmware, uint32_t size)
+{
+    uint32_t    end = size;
+
+    if (job->sparsePageSize)
+    {
+        while (end && (firmware[end - 1] == 0xFF))
+        {
+            end--;
+        }
+        end = ((end + job->sparsePageSize - 1) / job->sparsePageSize) * job->sparsePageSize;
+    }
+
+    return end;
+}
+
+/**
+ * \brief   Checksum of the application as the bootloader programs it, padded as erased Flash.
+ *
+ * \return checksum
+ */
+static uint16_t imageAppChecksum(const imageJob_t *job, const uint8_t *firmware, uint32_t size)
+{
+    uint32_t    end = imageAppEnd(job, firmware, size);
+
+    if (end > size)
+    {
+        return imageCrc16(imageCrc16(IMAGE_CRC_INIT, firmware, size), NULL, end - size);
+    }
+
+    return imageCrc16(IMAGE_CRC_INIT, firmware, end);
+}
+
+/**
+ * \brief Compute a standalone MAC (CFB-MAC or Chaskey, as selected by the job mode) over one or two buffers.
+ */
+static void imageMac(const imageJob_t *job, const uint8_t *data, uint32_t length,
+                     const uint8_t *tail, uint32_t tailLength, uint8_t mac[IMAGE_MAC_SIZE])
+{
+    xteaCtx_t   ctx;
+
+    if ((job->mode & IMAGE_MODE_MAC_TYPE_gm) == IMAGE_MODE_MAC_CHASKEY)
+    {
+        chaskeyCtx_t    chaskey;
+
+        chaskeyMacInit(&chaskey, job->key, job->macRounds);
+        chaskeyMacUpdate(&chaskey, data, length);
+        chaskeyMacUpdate(&chaskey, tail, tailLength);
+        chaskeyMacFinish(&chaskey);
+        memcpy(mac, chaskey.state.u8, IMAGE_MAC_SIZE);
+        return;
+    }
+    xteaCfbMacInit(&ctx, job->key, job->macRounds);
+    xteaCfbMacUpdate(&ctx, data, length);
+    xteaCfbMacUpdate(&ctx, tail, tailLength);
+    xteaCfbMacFinish(&ctx);
+    memcpy(mac, ctx.data, IMAGE_MAC_SIZE);
+}
+
+/**
+ * \brief   Interleave page tags into the ciphertext (page chained format):
+ *          T1 | P1 | T2 | P2 | ... | Tn | Pn, where Ti = MAC(Pi | Ti+1) and Tn = MAC(Pn).
+ */
+static void imageChainPages(const imageJob_t *job, const uint8_t *cipherText, uint32_t size, uint8_t *payload)
+{
+    uint32_t        pages = imagePageCount(job, size);
+    const uint8_t * next = NULL;
+
+    while (pages--)
+    {
+        uint32_t    start = pages * job->pageSize;
+        uint32_t    length = ((size - start) < job->pageSize) ? (size - start) : job->pageSize;
+        uint8_t   * tag = payload + start + (pages * XTEA_BLOCK_SIZE);
+
+        memcpy(tag + XTEA_BLOCK_SIZE, cipherText + start, length);
+        imageMac(job, cipherText + start, length, next, (next == NULL) ? 0 : XTEA_BLOCK_SIZE, tag);
+        next = tag;
+    }
+}
+
+/**
+ * \brief   LZ compression of firmware (format of processCompressedData() in the bootloader).
+ *          Greedy parse, candidates are the newest LZ_MAX_CANDIDATES positions with the same
+ *          3-byte prefix - must stay in sync with lzCompress() of firmware_creator.py.
+ *
+ * \param[in]   data    plain firmware.
+ * \param[in]   size    firmware size in bytes.
+ * \param[out]  out     buffer of imageLzBound(size) bytes.
+ *
+ * \return compressed size, or 0 if out of memory
+ */
+static uint32_t imageLzCompress(const uint8_t *data, uint32_t size, uint8_t *out)
+{
+    int32_t   * head = malloc(IMAGE_LZ_HASH_SIZE * sizeof(int32_t));
+    int32_t   * prev = malloc((size ? size : 1) * sizeof(int32_t));
+    uint32_t    outLength = 0;
+    uint32_t    literals = 0;
+    uint32_t    idx = 0;
+
+    if ((head == NULL) || (prev == NULL))
+    {
+        free(head);
+        free(prev);
+        return 0;
+    }
+    memset(head, 0xFF, IMAGE_LZ_HASH_SIZE * sizeof(int32_t));
+
+    #define IMAGE_LZ_HASH(pos)  ((((uint32_t)data[pos] << 8) ^ ((uint32_t)data[(pos) + 1] << 4) ^ data[(pos) + 2]) & (IMAGE_LZ_HASH_SIZE - 1))
+    #define IMAGE_LZ_INSERT(pos)                                                    \
+        if (((pos) + IMAGE_LZ_MIN_MATCH) <= size)                                   \
+        {                                                                           \
+            prev[pos] = head[IMAGE_LZ_HASH(pos)];                                   \
+            head[IMAGE_LZ_HASH(pos)] = (int32_t)(pos);                              \
+        }
+    #define IMAGE_LZ_FLUSH()                                                        \
+        if (literals)                                                               \
+        {                                                                           \
+            out[outLength] = (uint8_t)(literals - 1);                               \
+            memcpy(out + outLength + 1, data + idx - literals, literals);           \
+            outLength += literals + 1;                                              \
+            literals = 0;                                                           \
+        }
+
+    while (idx < size)
+    {
+        uint32_t    bestLen = 0;
+        uint32_t    bestDist = 0;
+
+        if ((idx + IMAGE_LZ_MIN_MATCH) <= size)
+        {
+            uint32_t    maxLen = ((size - idx) < IMAGE_LZ_MAX_MATCH) ? (size - idx) : IMAGE_LZ_MAX_MATCH;
+            uint32_t    candidates = 0;
+
+            for (int32_t pos = head[IMAGE_LZ_HASH(idx)]; (pos >= 0) && (candidates < IMAGE_LZ_MAX_CANDIDATES); pos = prev[pos])
+            {
+                uint32_t    length = 0;
+
+                if (memcmp(data + pos, data + idx, IMAGE_LZ_MIN_MATCH) != 0)
+                {
+                    continue;                                       // hash collision, not a candidate
+                }
+                candidates++;
+                if ((idx - (uint32_t)pos) > IMAGE_LZ_MAX_DISTANCE)
+                {
+                    break;
+                }
+                while ((length < maxLen) && (data[(uint32_t)pos + length] == data[idx + length]))
+                {
+                    length++;
+                }
+                if (length > bestLen)
+                {
+                    bestLen = length;
+                    bestDist = idx - (uint32_t)pos;
+                    if (length == maxLen)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (bestLen > IMAGE_LZ_MIN_MATCH)
+        {
+            IMAGE_LZ_FLUSH();
+            out[outLength++] = (uint8_t)(0x80 | (bestLen - IMAGE_LZ_MIN_MATCH));
+            out[outLength++] = (uint8_t)bestDist;
+            out[outLength++] = (uint8_t)(bestDist >> 8);
+            for (uint32_t pos = idx; pos < (idx + bestLen); pos++)
+            {
+                IMAGE_LZ_INSERT(pos);
+            }
+            idx += bestLen;
+        } else
+        {
+            IMAGE_LZ_INSERT(idx);
+            idx++;
+            literals++;
+            if (literals == IMAGE_LZ_MAX_LITERALS)
+            {
+                IMAGE_LZ_FLUSH();
+            }
+        }
+    }
+    IMAGE_LZ_FLUSH();
+
+    #undef IMAGE_LZ_HASH
+    #undef IMAGE_LZ_INSERT
+    #undef IMAGE_LZ_FLUSH
+
+    free(head);
+    free(prev);
+
+    return outLength;
+}
+
+/**
+ * \brief   LZ decompression, the counterpart of imageLzCompress() and of processCompressedData()
+ *          in the bootloader.
+ *
+ * \param[in]   data        compressed firmware.
+ * \param[in]   size        compressed size in bytes.
+ * \param[out]  out         buffer for decompressed firmware.
+ * \param[in]   capacity    size of 'out' in bytes.
+ *
+ * \return decompressed size, or -1 if the stream is damaged or does not fit in 'out'
+ */
+static int64_t imageLzExpand(const uint8_t *data, uint32_t size, uint8_t *out, uint32_t capacity)
+{
+    uint32_t    outLength = 0;
+    uint32_t    idx = 0;
+
+    while (idx < size)
+    {
+        uint32_t    token = data[idx++];
+
+        if (token & 0x80)
+        {
+            uint32_t    length = (token & 0x7F) + IMAGE_LZ_MIN_MATCH;
+            uint32_t    distance;
+
+            if (((idx + 2) > size) || ((outLength + length) > capacity))
+            {
+                return -1;
+            }
+            distance = data[idx] | ((uint32_t)data[idx + 1] << 8);
+            idx += 2;
+            if ((distance == 0) || (distance > outLength))
+            {
+                return -1;
+            }
+            for (uint32_t pos = 0; pos < length; pos++, outLength++)
+            {
+                out[outLength] = out[outLength - distance];
+            }
+        } else
+        {
+            uint32_t    length = token + 1;
+
+            if (((idx + length) > size) || ((outLength + length) > capacity))
+            {
+                return -1;
+            }
+            memcpy(out + outLength, data + idx, length);
+            idx += length;
+            outLength += length;
+        }
+    }
+
+    return outLength;
+}
+
+/**
+ * \brief   Sparse payload of firmware (format of processSparseData() in the bootloader): groups
+ *          of IMAGE_SPARSE_GROUP pages, each an XTEA block of page mask (bit 0 of the first byte -
+ *          first page of the group) followed by the pages with data, padded with 0xFF to the page size.
+ *          Erased pages are left out, the payload ends with the last page with data.
+ *
+ * \param[in]   firmware    plain firmware.
+ * \param[in]   size        firmware size in bytes.
+ * \param[in]   pageSize    Flash page size.
+ * \param[out]  out         buffer for the payload, NULL to get its upper bound.
+ *
+ * \return payload size
+ */
+static uint32_t imageSparse(const uint8_t *firmware, uint32_t size, uint32_t pageSize, uint8_t *out)
+{
+    uint32_t    pages = (size + pageSize - 1) / pageSize;
+    uint32_t    outLength = 0;
+    uint32_t    groups = 0;                                         // groups with mask in 'out'
+    uint32_t    maskAt = 0;
+
+    if (out == NULL)
+    {
+        return (pages * pageSize) + (((pages + IMAGE_SPARSE_GROUP - 1) / IMAGE_SPARSE_GROUP) * XTEA_BLOCK_SIZE);
+    }
+
+    for (uint32_t page = 0; page < pages; page++)
+    {
+        uint32_t    start = page * pageSize;
+        uint32_t    length = ((size - start) < pageSize) ? (size - start) : pageSize;
+        bool        blank = true;
+
+        for (uint32_t idx = 0; (idx < length) && blank; idx++)
+        {
+            blank = (firmware[start + idx] == 0xFF);
+        }
+        if (blank)
+        {
+            continue;
+        }
+        while (groups <= (page / IMAGE_SPARSE_GROUP))
+        {                                                           // groups without data get empty masks
+            maskAt = outLength;
+            memset(out + outLength, 0x00, XTEA_BLOCK_SIZE);
+            outLength += XTEA_BLOCK_SIZE;
+            groups++;
+        }
+        out[maskAt + ((page % IMAGE_SPARSE_GROUP) / 8)] |= (uint8_t)(1 << (page % 8));
+        memcpy(out + outLength, firmware + start, length);
+        memset(out + outLength + length, 0xFF, pageSize - length);
+        outLength += pageSize;
+    }
+
+    return outLength;
+}
+
+/**
+ * \brief   Expansion of the sparse payload, the counterpart of imageSparse() and of processSparseData()
+ *          in the bootloader.
+ *
+ * \param[in]   data        sparse payload.
+ * \param[in]   size        payload size in bytes.
+ * \param[in]   pageSize    Flash page size.
+ * \param[out]  out         buffer for firmware, pages left out are erased (0xFF).
+ * \param[in]   capacity    size of 'out'.
+ *
+ * \return firmware size (whole pages), or -1 if the payload is damaged or does not fit in 'out'
+ */
+static int64_t imageSparseExpand(const uint8_t *data, uint32_t size, uint32_t pageSize, uint8_t *out, uint32_t capacity)
+{
+    uint32_t    idx = 0;
+    uint32_t    outLength = 0;
+
+    while (idx < size)
+    {
+        const uint8_t * mask = data + idx;
+
+        if ((pageSize == 0) || ((idx + XTEA_BLOCK_SIZE) > size))
+        {
+            return -1;
+        }
+        idx += XTEA_BLOCK_SIZE;
+        for (uint32_t page = 0; (page < IMAGE_SPARSE_GROUP) && (idx < size); page++)
+        {
+            if ((outLength + pageSize) > capacity)
+            {
+                return -1;
+            }
+            if (mask[page / 8] & (1 << (page % 8)))
+            {
+                if ((idx + pageSize) > size)
+                {
+                    return -1;
+                }
+                memcpy(out + outLength, data + idx, pageSize);
+                idx += pageSize;
+            } else
+            {
+                memset(out + outLength, 0xFF, pageSize);
+            }
+            outLength += pageSize;
+        }
+    }
+
+    return outLength;
+}
+
+/**
+ * \brief   Place firmware data at 'address' of Flash into the flat firmware image starting at 'base'.
+ *
+ * \return false if the data is below 'base' or above IMAGE_OBJECT_MAX_SIZE
+ */
+static bool imageObjectPut(uint8_t *flat, uint32_t *size, uint32_t base, uint64_t address, const uint8_t *data, uint32_t length)
+{
+    if (address >= IMAGE_OBJECT_FLASH_END)
+    {
+        return true;                                                // EEPROM, fuses, lock bits, signature
+    }
+    if ((address < base) || ((address - base + length) > IMAGE_OBJECT_MAX_SIZE))
+    {
+        fprintf(stderr, "ERROR: data at 0x%06llX is outside Flash from 0x%04X\n", (unsigned long long)address, (unsigned)base);
+        return false;
+    }
+    memcpy(flat + (address - base), data, length);
+    if ((uint32_t)(address - base + length) > *size)
+    {
+        *size = (uint32_t)(address - base + length);
+    }
+
+    return true;
+}
+
+/**
+ * \brief   Flash content of an Intel HEX file (record types 00, 01, 02 and 04; 03 and 05 are ignored).
+ */
+static bool imageReadIntelHex(FILE *file, uint8_t *flat, uint32_t *size, uint32_t base)
+{
+    char        line[600];
+    uint8_t     record[256 + 5];
+    uint32_t    offset = 0;
+    bool        result = true;
+    bool        end = false;
+
+    while (result && !end && (fgets(line, sizeof(line), file) != NULL))
+    {
+        size_t  length = strcspn(line, "\r\n");
+        uint8_t sum = 0;
+
+        line[length] = 0;
+        if (length == 0)
+        {
+            continue;
+        }
+        result = (line[0] == ':') && (length >= 11) && (length % 2) && (((length - 1) / 2) <= sizeof(record))
+                 && imageParseHex(line + 1, record, (length - 1) / 2)
+                 && ((size_t)record[0] + 5 == (length - 1) / 2);
+        for (size_t idx = 0; result && (idx < (length - 1) / 2); idx++)
+        {
+            sum += record[idx];
+        }
+        if (!result || (sum != 0))
+        {
+            fprintf(stderr, "ERROR: damaged Intel HEX record: %s\n", line);
+            return false;
+        }
+        switch (record[3])
+        {
+            case 0x00:
+                result = imageObjectPut(flat, size, base, (uint64_t)offset + (((uint32_t)record[1] << 8) | record[2]), record + 4, record[0]);
+                break;
+            case 0x01:
+                end = true;
+                break;
+            case 0x02:
+                offset = (((uint32_t)record[4] << 8) | record[5]) << 4;
+                break;
+            case 0x04:
+                offset = (((uint32_t)record[4] << 8) | record[5]) << 16;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * \brief   Flash content of an ELF file: PT_LOAD program segments at their physical (load) addresses,
+ *          so initial values of .data are placed after the code, as the linker intends.
+ */
+static bool imageReadElf(FILE *file, uint8_t *flat, uint32_t *size, uint32_t base)
+{
+    uint8_t     header[52];
+    uint8_t     segment[32];
+    uint8_t   * data = NULL;
+    bool        result;
+
+    result = (fread(header, 1, sizeof(header), file) == sizeof(header)) && !memcmp(header, "\177ELF", 4)
+             && (header[4] == 1) && (header[5] == 1);               // ELFCLASS32, ELFDATA2LSB (avr-gcc)
+    if (!result)
+    {
+        fprintf(stderr, "ERROR: not a 32-bit little-endian ELF file\n");
+        return false;
+    }
+
+    uint32_t    phOffset = imageGetU32(header + 28);
+    uint32_t    phSize = (uint32_t)header[42] | ((uint32_t)header[43] << 8);
+    uint32_t    phCount = (uint32_t)header[44] | ((uint32_t)header[45] << 8);
+
+    for (uint32_t idx = 0; result && (idx < phCount); idx++)
+    {
+        result = (phSize >= sizeof(segment)) && (fseek(file, (long)(phOffset + (idx * phSize)), SEEK_SET) == 0)
+                 && (fread(segment, 1, sizeof(segment), file) == sizeof(segment));
+
+        uint32_t    offset = imageGetU32(segment + 4);
+        uint32_t    address = imageGetU32(segment + 12);            // p_paddr
+        uint32_t    fileSize = imageGetU32(segment + 16);
+
+        if (result && (imageGetU32(segment) == 1) && (fileSize != 0))   // PT_LOAD
+        {
+            data = realloc(data, fileSize);
+            result = (data != NULL) && (fseek(file, (long)offset, SEEK_SET) == 0)
+                     && (fread(data, 1, fileSize, file) == fileSize)
+                     && imageObjectPut(flat, size, base, address, data, fileSize);
+        }
+    }
+    free(data);
+
+    return result;
+}
+
+/**
+ * \return true if the file is an Intel HEX or ELF file (by its extension), not a flat binary
+ */
+static bool imageIsObjectFile(const char *path)
+{
+    const char * dot = strrchr(path, '.');
+
+    return (dot != NULL) && ((strcasecmp(dot, ".hex") == 0) || (strcasecmp(dot, ".elf") == 0));
+}
+
+/**
+ * \brief   Read an Intel HEX or ELF file into a flat image of Flash from address 'base' (BOOT_SIZE
+ *          for application, 0 for bootloader), gaps between sections are filled with 0xFF.
+ *
+ * \return flat image allocated with malloc(), or NULL on error
+ */
+static uint8_t *imageLoadObject(const char *path, uint32_t base, uint32_t *size)
+{
+    FILE      * file = fopen(path, "rb");
+    uint8_t   * flat = malloc(IMAGE_OBJECT_MAX_SIZE);
+    const char  * dot = strrchr(path, '.');
+    bool        result = false;
+
+    *size = 0;
+    if ((file != NULL) && (flat != NULL))
+    {
+        memset(flat, 0xFF, IMAGE_OBJECT_MAX_SIZE);
+        result = (strcasecmp(dot, ".hex") == 0) ? imageReadIntelHex(file, flat, size, base) : imageReadElf(file, flat, size, base);
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    if (!result)
+    {
+        fprintf(stderr, "ERROR: cannot read firmware from file: %s\n", path);
+        free(flat);
+        flat = NULL;
+    }
+
+    return flat;
+}
+
+/**
+ * \brief   Place the next image of the image directory in external memory: on a memory page boundary
+ *          at or above 'freeAt', moved to the start of the next 64 KB block rather than crossing it.
+ *          The first image (freeAt = 0) takes the place of a single image, so its layout matches
+ *          an '*.aligned.bin' file.
+ *
+ * \param[in]   freeAt      first free address of external memory.
+ * \param[in]   size        image size (control data and firmware).
+ * \param[in]   memorySize  size of external memory.
+ *
+ * \return address of the descriptor, or IMAGE_SLOT_UNUSED if the image does not fit
+ */
+static uint32_t imageSlotAddress(uint32_t freeAt, uint32_t size, uint32_t memorySize)
+{
+    uint32_t    address = (freeAt < IMAGE_ALIGN_SIZE) ? IMAGE_ALIGN_SIZE
+                        : ((freeAt + IMAGE_MEM_PAGE_SIZE - 1) & ~(uint32_t)(IMAGE_MEM_PAGE_SIZE - 1));
+
+    if ((address / IMAGE_MEM_BLOCK_SIZE) != ((address + size - 1) / IMAGE_MEM_BLOCK_SIZE))
+    {
+        address = (address + IMAGE_MEM_BLOCK_SIZE) & ~(uint32_t)(IMAGE_MEM_BLOCK_SIZE - 1);
+    }
+    if ((size > IMAGE_MEM_BLOCK_SIZE) || ((uint64_t)address + size > memorySize))
+    {
+        return IMAGE_SLOT_UNUSED;
+    }
+
+    return address;
+}
+
+/**
+ * \brief   Build a complete image (64-byte control data followed by firmware).
+ *
+ * \param[in]   job         image parameters.
+ * \param[in]   firmware    plain firmware.
+ * \param[in]   size        firmware size in bytes.
+ * \param[out]  imageSize   size of the returned image.
+ *
+ * \return image allocated with malloc(), or NULL if out of memory
+ */
+static uint8_t *imagePack(const imageJob_t *job, const uint8_t *firmware, uint32_t size, uint32_t *imageSize)
+{
+    xteaCtx_t   ctx;
+    speckCtx_t  speck;                                              // chaining value is in 'ctx.cipher.iv'
+    uint8_t   * out;
+    uint8_t   * payload;
+    uint16_t    checksum = job->crcFlashSize ? imageAppChecksum(job, firmware, size) : IMAGE_CRC_INIT;
+    uint8_t   * cipherText = malloc((job->sparsePageSize ? imageSparse(firmware, size, job->sparsePageSize, NULL)
+                                                 : (size + (size / IMAGE_LZ_MAX_LITERALS))) + 1);
+
+    if (cipherText == NULL)
+    {
+        return NULL;
+    }
+    if (job->compress && (size != 0))
+    {
+        size = imageLzCompress(firmware, size, cipherText);
+        if (size == 0)
+        {
+            free(cipherText);
+            return NULL;
+        }
+    } else if (job->sparsePageSize)
+    {
+        size = imageSparse(firmware, size, job->sparsePageSize, cipherText);
+    } else
+    {
+        memcpy(cipherText, firmware, size);
+    }
+
+    *imageSize = IMAGE_CONTROL_DATA_SIZE + imagePayloadSize(job, size);
+    out = malloc(*imageSize);
+    if (out == NULL)
+    {
+        free(cipherText);
+        return NULL;
+    }
+    payload = out + IMAGE_CONTROL_DATA_SIZE;
+
+    memset(out, 0xFF, IMAGE_CONTROL_DATA_SIZE);
+    out[IMAGE_OFS_VERSION]          = IMAGE_VERSION;
+    out[IMAGE_OFS_MODE]             = job->mode;
+    out[IMAGE_OFS_CIPHER_ROUNDS]    = job->cipherRounds;
+    out[IMAGE_OFS_MAC_ROUNDS]       = job->macRounds;
+    imagePutU32(out + IMAGE_OFS_TIMESTAMP, job->timeStamp);
+    imagePutU32(out + IMAGE_OFS_FIRMWARE_SIZE, size);
+    memcpy(out + IMAGE_OFS_CIPHER_IV, job->iv, XTEA_IV_SIZE);
+    if (job->hasNewKey)
+    {
+        memcpy(out + IMAGE_OFS_NEW_KEY, job->newKey, XTEA_KEY_SIZE);
+    }
+    if (job->pageSize)
+    {
+        out[IMAGE_OFS_MODE] = (job->mode & ~IMAGE_MODE_MAC_TYPE_gm) | IMAGE_MODE_MAC_PAGE_CHAIN;
+        out[IMAGE_OFS_RFU] = (uint8_t)(job->pageSize / XTEA_BLOCK_SIZE);
+    }
+    if (job->compress)
+    {
+        out[IMAGE_OFS_RFU + 1] = IMAGE_PAYLOAD_LZ;
+    }
+    if (job->sparsePageSize)
+    {
+        out[IMAGE_OFS_RFU] = (uint8_t)(job->sparsePageSize / XTEA_BLOCK_SIZE);
+        out[IMAGE_OFS_RFU + 1] = IMAGE_PAYLOAD_SPARSE;
+    }
+    out[IMAGE_OFS_RFU + 2] = (uint8_t)(checksum >> 8);
+    out[IMAGE_OFS_RFU + 3] = (uint8_t)checksum;
+
+    xteaSetKey(&ctx.cipher.base, job->key);
+    xteaSetIv(&ctx.cipher, job->iv);
+    ctx.cipher.base.rounds = job->cipherRounds;
+    ctx.cipher.base.operation = xteaEncrypt;
+    speckSetKey(&speck, job->key);
+    speck.operation = speckEncrypt;
+
+    if ((job->mode & IMAGE_MODE_NEWKEY_gm) == IMAGE_MODE_NEWKEY_XTEA)
+    {
+        xteaCfbBuffer(&ctx.cipher, out + IMAGE_OFS_NEW_KEY, XTEA_KEY_SIZE);
+    } else if ((job->mode & IMAGE_MODE_NEWKEY_gm) == IMAGE_MODE_NEWKEY_SPECK)
+    {
+        speckCfbBuffer(&speck, ctx.cipher.iv, out + IMAGE_OFS_NEW_KEY, XTEA_KEY_SIZE);
+    }
+    if ((job->mode & IMAGE_MODE_CIPHER_gm) == IMAGE_MODE_CIPHER_XTEA)
+    {
+        xteaCfbBuffer(&ctx.cipher, cipherText, size);
+    } else if ((job->mode & IMAGE_MODE_CIPHER_gm) == IMAGE_MODE_CIPHER_SPECK)
+    {
+        speckCfbBuffer(&speck, ctx.cipher.iv, cipherText, size);
+    }
+
+    if (job->pageSize)
+    {                                                               // descriptor MAC covers only the first page tag
+        imageChainPages(job, cipherText, size, payload);
+        imageMac(job, out + IMAGE_MAC_FIELD_SIZE, IMAGE_DESCR_SIZE, payload, (size != 0) ? XTEA_BLOCK_SIZE : 0, out + IMAGE_OFS_MAC);
+    } else
+    {
+        memcpy(payload, cipherText, size);
+        imageMac(job, out + IMAGE_MAC_FIELD_SIZE, IMAGE_DESCR_SIZE, payload, size, out + IMAGE_OFS_MAC);
+    }
+    free(cipherText);
+
+    return out;
+}
+
+#endif // IMAGE_H_
@@ -0,0 +1,365 @@
+/**
+ * \file    avr_sim.h
+ * \brief   Host simulation of the tinyAVR/megaAVR resources used by CryptBoot:
+ *          reset controller, NVM controller with memory-mapped Flash,
+ *          CRC scanner, internal EEPROM and the boot entry/exit points.
+ *          Included by cryptboot_x.h instead of <avr/io.h> when CRYPTBOOT_SIM is defined.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef AVR_SIM_H_
+#define AVR_SIM_H_
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// default memory layout is the one of ATtiny1604 (the default Makefile target)
+#ifndef SIM_PROGMEM_SIZE
+#define SIM_PROGMEM_SIZE                0x4000
+#endif
+#ifndef SIM_PROGMEM_PAGE_SIZE
+#define SIM_PROGMEM_PAGE_SIZE           64
+#endif
+#ifndef SIM_EEPROM_SIZE
+#define SIM_EEPROM_SIZE                 256
+#endif
+#ifndef SIM_RAM_SIZE
+#define SIM_RAM_SIZE                    1024
+#endif
+
+#define MAPPED_PROGMEM_START            ((uintptr_t)simFlash)
+#define MAPPED_PROGMEM_SIZE             SIM_PROGMEM_SIZE
+#define MAPPED_PROGMEM_PAGE_SIZE        SIM_PROGMEM_PAGE_SIZE
+#define MAPPED_EEPROM_SIZE              SIM_EEPROM_SIZE
+#define RAMEND                          ((uintptr_t)simRam + SIM_RAM_SIZE - 1)
+
+// services for the application (BOOT_SERVICES): host pointers in the shared state, table at a host address
+#define BOOT_SERVICES_RAM_SIZE          32
+#define BOOT_SERVICES_TABLE             ((const bootServices_t *)simBootServices)
+#define BOOT_SERVICES_APP_STACK         (RAMEND - BOOT_SERVICES_RAM_SIZE)
+#define BOOT_SERVICES_SECTION
+
+#define RSTCTRL_PORF_bm                 0x01
+#define RSTCTRL_BORF_bm                 0x02
+#define RSTCTRL_EXTRF_bm                0x04
+#define RSTCTRL_WDRF_bm                 0x08
+#define RSTCTRL_SWRF_bm                 0x10
+#define RSTCTRL_UPDIRF_bm               0x20
+#define RSTCTRL_SWRE_bm                 0x01
+#define CCP_IOREG_gc                    0xD8
+#define CLKCTRL_PEN_bm                  0x01
+#define NVMCTRL_FBUSY_bm                0x01
+#define NVMCTRL_EEBUSY_bm               0x02
+#define NVMCTRL_BOOTLOCK_bm             0x02
+#define NVMCTRL_CMD_PAGEERASEWRITE_gc   0x03
+#define NVMCTRL_CMD_PAGEBUFCLR_gc       0x04
+#define CRCSCAN_ENABLE_bm               0x01
+#define CRCSCAN_NMIEN_bm                0x02
+#define CRCSCAN_RESET_bm                0x80
+#define CRCSCAN_SRC_FLASH_gc            0x00
+#define CRCSCAN_MODE_PRIORITY_gc        0x00
+#define CRCSCAN_BUSY_bm                 0x01
+#define CRCSCAN_OK_bm                   0x02
+#define RTC_CLKSEL_INT32K_gc            0x00
+#define RTC_RTCEN_bm                    0x01
+#define RTC_PRESCALER_gp                3
+#define RTC_PRESCALER_DIV1_gc           0x00
+#define RTC_PRESCALER_DIV32_gc          0x28
+#define RTC_CTRLABUSY_bm                0x01
+#define RTC_CNTBUSY_bm                  0x02
+#define SIM_RTC_HZ                      32768
+
+// CPU clock cycles per 16-bit word of a CRC scan in priority mode (estimate, not specified in the datasheet)
+#ifndef SIM_CRCSCAN_WORD_CYCLES
+#define SIM_CRCSCAN_WORD_CYCLES         3
+#endif
+
+#define FREQSEL_20MHZ_gc                0x02
+#define CRCSRC_NOCRC_gc                 0xC0
+#define RSTPINCFG_UPDI_gc               0x04
+#define SUT_8MS_gc                      0x06
+#define LB_RWLOCK_gc                    0x3A
+
+#define FUSES                           static const struct { uint8_t OSCCFG, SYSCFG0, SYSCFG1, APPEND, BOOTEND; } \
+                                        __attribute__((unused)) simFuses
+#define LOCKBITS                        static const uint8_t __attribute__((unused)) simLockBits
+
+#define BOOT_ENTRY
+#define BOOT_NOINLINE
+#define BOOT_CPU_INIT()
+#define BOOT_APP_START()                longjmp(simExit, SIM_EXIT_APP)
+
+#define _PROTECTED_WRITE(reg, value)        simProtectedWrite(&(reg), (value))
+#define _PROTECTED_WRITE_SPM(reg, value)    simSpmWrite(&(reg), (value))
+
+#define SIM_EXIT_APP                    1
+#define SIM_EXIT_RESET                  2
+#define SIM_EXIT_POWER                  3
+
+/**
+ * \brief Counters collected while the bootloader runs.
+ */
+typedef struct simStats
+{
+    uint32_t            transactions;       // START conditions issued on an idle bus (SPI: chip selects)
+    uint32_t            starts;             // all START conditions, including repeated ones
+    uint32_t            stops;
+    uint32_t            bytesWritten;       // address and data bytes sent by the master (device address excluded)
+    uint32_t            bytesRead;
+    uint32_t            sclClocks;          // SCL (SPI: SCK) clocks spent on the bus
+    uint32_t            pageEraseWrites;
+    uint32_t            eepromWrites;       // internal EEPROM bytes actually changed
+    uint32_t            crcScans;           // CRC scans of the whole Flash
+    uint64_t            cipherRounds;       // XTEA rounds computed by the CPU
+    uint64_t            chaskeyRounds;      // Chaskey permutation rounds computed by the CPU
+    uint64_t            speckRounds;        // Speck rounds computed by the CPU
+    uint32_t            errors;             // protocol or NVM misuse detected by the models
+    uint64_t            elapsedCycles;      // CPU clock cycles on the timeline, see simClock_t
+} simStats_t;
+
+/**
+ * \brief   Timeline of the simulation in CPU clock cycles (F_CPU). The CPU advances it
+ *          by XTEA rounds, waiting for the bus and page erase-writes (the CPU is stalled
+ *          while the Flash it executes from is programmed); the TWI master clocks bytes
+ *          in on its own, so bus time can overlap XTEA computation.
+ */
+typedef struct simClock
+{
+    uint32_t            sclCycles;          // CPU cycles per SCL (SPI: SCK) clock
+    uint32_t            roundCycles;        // CPU cycles per XTEA round (two Feistel rounds)
+    uint32_t            chaskeyCycles;      // CPU cycles per Chaskey permutation round
+    uint32_t            speckCycles;        // CPU cycles per Speck round
+    uint32_t            pageCycles;         // CPU cycles per page erase-write
+} simClock_t;
+
+static struct { uint8_t RSTFR; uint8_t SWRR; }                  RSTCTRL;
+static struct { uint8_t MCLKCTRLB; }                            CLKCTRL;
+static struct { uint8_t CTRLA; uint8_t CTRLB; uint8_t STATUS; } NVMCTRL;
+static struct { uint8_t CTRLA; uint8_t CTRLB; uint8_t STATUS; } simCrcScanRegs;
+static struct { uint8_t CTRLA; uint8_t STATUS; uint8_t CLKSEL; uint16_t CNT; } simRtcRegs;
+static uint8_t      CPU_CCP;
+static uint8_t      GPIOR0;
+
+static uint8_t      simFlash[SIM_PROGMEM_SIZE] __attribute__((aligned(SIM_PROGMEM_PAGE_SIZE)));
+static uint8_t      simFlashCommitted[SIM_PROGMEM_SIZE];
+static uint8_t      simEeprom[SIM_EEPROM_SIZE];
+static uint8_t      simRam[SIM_RAM_SIZE] __attribute__((unused));   // only the part shared by BOOT_SERVICES is used
+static const void * simBootServices __attribute__((unused));    // table of services as seen by the application
+static simStats_t   simStats;
+static simClock_t   simClock;
+static jmp_buf      simExit;
+static uint32_t     simPowerFailAt = UINT32_MAX;    // power is lost after this many page erase-writes
+
+#define CRCSCAN                         (*simCrcScan())
+#define RTC                             (*simRtc())
+
+#define XTEA_BLOCK_HOOK(rounds)         (simStats.cipherRounds += (rounds))
+#define CHASKEY_BLOCK_HOOK(rounds)      (simStats.chaskeyRounds += (rounds))
+#define SPECK_BLOCK_HOOK(rounds)        (simStats.speckRounds += (rounds))
+#ifdef MEM_READ_AHEAD
+#define XTEA_ROUND_HOOK()               (simStats.elapsedCycles += simClock.roundCycles, memReadPoll())
+#define CHASKEY_ROUND_HOOK()            (simStats.elapsedCycles += simClock.chaskeyCycles, memReadPoll())
+#define SPECK_ROUND_HOOK()              (simStats.elapsedCycles += simClock.speckCycles, memReadPoll())
+#else
+#define XTEA_ROUND_HOOK()               (simStats.elapsedCycles += simClock.roundCycles)
+#define CHASKEY_ROUND_HOOK()            (simStats.elapsedCycles += simClock.chaskeyCycles)
+#define SPECK_ROUND_HOOK()              (simStats.elapsedCycles += simClock.speckCycles)
+#endif
+
+/**
+ * \brief   Protected I/O write - only the software reset is of interest.
+ */
+static void simProtectedWrite(volatile uint8_t *reg, uint8_t value)
+{
+    *reg = value;
+    if ((reg == &RSTCTRL.SWRR) && (value & RSTCTRL_SWRE_bm))
+    {
+        longjmp(simExit, SIM_EXIT_RESET);
+    }
+}
+
+/**
+ * \brief   NVM command execution. The bootloader writes the page buffer through
+ *          the memory-mapped Flash, which in the model lands in 'simFlash' directly;
+ *          the page erase-write command commits the modified page to 'simFlashCommitted',
+ *          the page buffer clear command drops it (restores 'simFlash').
+ *          Any page left modified without a commit is reported by simFlashUncommitted().
+ */
+static void simSpmWrite(volatile uint8_t *reg, uint8_t value)
+{
+    uint32_t    dirty = 0;
+
+    *reg = value;
+    if ((reg == &NVMCTRL.CTRLA) && (value == NVMCTRL_CMD_PAGEBUFCLR_gc))
+    {
+        memcpy(simFlash, simFlashCommitted, SIM_PROGMEM_SIZE);
+        return;
+    }
+    if ((reg != &NVMCTRL.CTRLA) || (value != NVMCTRL_CMD_PAGEERASEWRITE_gc))
+    {
+        return;
+    }
+
+    simStats.pageEraseWrites++;
+    simStats.elapsedCycles += simClock.pageCycles;
+    for (uint32_t page = 0; page < SIM_PROGMEM_SIZE; page += SIM_PROGMEM_PAGE_SIZE)
+    {
+        if (memcmp(simFlash + page, simFlashCommitted + page, SIM_PROGMEM_PAGE_SIZE))
+        {
+            memcpy(simFlashCommitted + page, simFlash + page, SIM_PROGMEM_PAGE_SIZE);
+            dirty++;
+        }
+    }
+    if (dirty > 1)
+    {
+        fprintf(stderr, "SIM: page buffer spans %u pages at page erase-write\n", (unsigned)dirty);
+        simStats.errors++;
+    }
+    if (simStats.pageEraseWrites == simPowerFailAt)
+    {
+        longjmp(simExit, SIM_EXIT_POWER);
+    }
+}
+
+/**
+ * \return number of Flash pages written through the page buffer but never committed
+ */
+static uint32_t simFlashUncommitted(void)
+{
+    uint32_t    dirty = 0;
+
+    for (uint32_t page = 0; page < SIM_PROGMEM_SIZE; page += SIM_PROGMEM_PAGE_SIZE)
+    {
+        dirty += (memcmp(simFlash + page, simFlashCommitted + page, SIM_PROGMEM_PAGE_SIZE) != 0);
+    }
+
+    return dirty;
+}
+
+/**
+ * \brief   CRC scanner, evaluated on every register access. A scan of the whole committed Flash
+ *          (CRC-16-CCITT, initial value 0xFFFF, MSB first) is done at the first access after it is enabled,
+ *          the CPU is halted for its duration (priority mode), so it is never seen busy;
+ *          RESET returns the peripheral to its reset state at the next access.
+ */
+static typeof(simCrcScanRegs) *simCrcScan(void)
+{
+    static bool scanned;
+    uint16_t    crc = 0xFFFF;
+
+    if (simCrcScanRegs.CTRLA & CRCSCAN_RESET_bm)
+    {
+        memset(&simCrcScanRegs, 0, sizeof(simCrcScanRegs));
+        scanned = false;
+    } else if ((simCrcScanRegs.CTRLA & CRCSCAN_ENABLE_bm) && !scanned)
+    {
+        if (simFlashUncommitted())
+        {
+            fprintf(stderr, "SIM: CRC scan with a loaded page buffer\n");
+            simStats.errors++;
+        }
+        for (uint32_t idx = 0; idx < SIM_PROGMEM_SIZE; idx++)
+        {
+            crc ^= (uint16_t)simFlashCommitted[idx] << 8;
+            for (uint8_t bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+            }
+        }
+        simCrcScanRegs.STATUS = (crc == 0) ? CRCSCAN_OK_bm : 0;
+        simStats.crcScans++;
+        simStats.elapsedCycles += (SIM_PROGMEM_SIZE / 2) * SIM_CRCSCAN_WORD_CYCLES;
+        scanned = true;
+    }
+
+    return &simCrcScanRegs;
+}
+
+/**
+ * \brief   RTC clocked by the internal 32.768 kHz oscillator, evaluated on every register access:
+ *          while it is enabled CNT counts the time since the previous access (a register write
+ *          follows the access it is made through). Writes take effect at once, so it is never seen busy.
+ */
+static typeof(simRtcRegs) *simRtc(void)
+{
+    static uint64_t accessedAt;
+    static uint64_t fraction;                   // part of a tick counted so far, in cycles * SIM_RTC_HZ
+    uint64_t        divider = (uint64_t)F_CPU << ((simRtcRegs.CTRLA >> RTC_PRESCALER_gp) & 0x0F);
+
+    if (simRtcRegs.CTRLA & RTC_RTCEN_bm)
+    {
+        fraction += (simStats.elapsedCycles - accessedAt) * SIM_RTC_HZ;
+        simRtcRegs.CNT += (uint16_t)(fraction / divider);
+        fraction %= divider;
+    } else
+    {
+        fraction = 0;
+    }
+    accessedAt = simStats.elapsedCycles;
+
+    return &simRtcRegs;
+}
+
+// ----------------------------------------------------------------
+// |                internal EEPROM (avr/eeprom.h)                |
+// ----------------------------------------------------------------
+
+static void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, simEeprom + (uintptr_t)src, n);
+}
+
+static uint32_t eeprom_read_dword(const uint32_t *src)
+{
+    uint32_t    value;
+
+    eeprom_read_block(&value, src, sizeof(value));
+
+    return value;
+}
+
+static uint8_t eeprom_read_byte(const uint8_t *src)
+{
+    return simEeprom[(uintptr_t)src];
+}
+
+static void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    const uint8_t * data = src;
+
+    for (size_t idx = 0; idx < n; idx++)
+    {
+        if (simEeprom[(uintptr_t)dst + idx] != data[idx])
+        {
+            simEeprom[(uintptr_t)dst + idx] = data[idx];
+            simStats.eepromWrites++;
+        }
+    }
+}
+
+static void eeprom_update_dword(uint32_t *dst, uint32_t value)
+{
+    eeprom_update_block(&value, dst, sizeof(value));
+}
+
+static void eeprom_update_byte(uint8_t *dst, uint8_t value)
+{
+    eeprom_update_block(&value, dst, sizeof(value));
+}
+
+static void eeprom_update_word(uint16_t *dst, uint16_t value)
+{
+    eeprom_update_block(&value, dst, sizeof(value));
+}
+
+#define eeprom_busy_wait()
+
+#endif // AVR_SIM_H_
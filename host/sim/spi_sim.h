@@ -0,0 +1,168 @@
+/**
+ * \file    spi_sim.h
+ * \brief   Host simulation of the SPI master primitives of spi_1.h,
+ *          connected to a model of a W25Qxx-class SPI NOR flash (READ DATA 0x03, FAST READ 0x0B,
+ *          JEDEC ID 0x9F, 24-bit address, sequential read over the whole memory) backed by a memory buffer.
+ *          Included by spi_1.h when CRYPTBOOT_SIM is defined.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef SPI_SIM_H_
+#define SPI_SIM_H_
+
+#define SPI_IF_bm               0x80
+
+#define SIM_SPI_JEDEC_MANUFACTURER  0xEF                            // Winbond
+#define SIM_SPI_JEDEC_TYPE          0x40
+
+/**
+ * \brief State of the bus and of the simulated external memory.
+ */
+typedef struct simBus
+{
+    uint8_t           * memory;             // content of the external flash
+    uint32_t            memorySize;         // power of two
+    bool                absent;             // no memory on the bus, MISO reads 0xFF
+    bool                enabled;
+    bool                owner;              // chip select asserted
+    bool                busy;               // transfer started, received byte not taken yet
+    uint8_t             command;
+    uint32_t            commandBytes;       // bytes transferred since chip select was asserted
+    uint32_t            pointer;            // internal address counter of the memory
+    uint8_t             rxData;
+    uint64_t            rxReadyAt;          // timeline cycle at which the byte being transferred is received
+} simBus_t;
+
+static simBus_t     simBus;
+
+/**
+ * \return byte sent by the memory in answer to the given byte of the current command
+ */
+static uint8_t simSpiAnswer(uint8_t data)
+{
+    uint32_t    index = simBus.commandBytes++;
+    uint32_t    dataAt = (simBus.command == SPI_CMD_FAST_READ) ? 5 : 4;
+    uint8_t     answer = 0xFF;
+
+    if (index == 0)
+    {
+        simBus.command = data;
+        simStats.bytesWritten++;
+    } else if ((simBus.command == SPI_CMD_READ) || (simBus.command == SPI_CMD_FAST_READ))
+    {
+        if (index < dataAt)
+        {
+            if (index < 4)
+            {
+                simBus.pointer = ((simBus.pointer << 8) | data) & (simBus.memorySize - 1);
+            }
+            simStats.bytesWritten++;
+        } else
+        {
+            answer = simBus.memory[simBus.pointer];
+            simBus.pointer = (simBus.pointer + 1) & (simBus.memorySize - 1);
+            simStats.bytesRead++;
+        }
+    } else if (simBus.command == SPI_CMD_JEDEC_ID)
+    {
+        uint8_t capacity = 0;
+
+        while ((1UL << capacity) < simBus.memorySize)
+        {
+            capacity++;
+        }
+        answer = (index == 1) ? SIM_SPI_JEDEC_MANUFACTURER : (index == 2) ? SIM_SPI_JEDEC_TYPE : capacity;
+        simStats.bytesRead++;
+    }
+
+    return answer;
+}
+
+static void spiSelect(void)
+{
+    if (!simBus.owner)
+    {
+        simStats.transactions++;
+    }
+    simBus.owner = true;
+    simBus.commandBytes = 0;
+    simBus.pointer = 0;
+}
+
+static void spiDeselect(void)
+{
+    if (simBus.owner)
+    {
+        simStats.stops++;
+    }
+    simBus.owner = false;
+}
+
+static void spiSend(uint8_t data)
+{
+    if (!simBus.enabled || simBus.busy)
+    {
+        fprintf(stderr, "SIM: SPI transfer %s\n", simBus.enabled ? "started while another one is running" : "with SPI disabled");
+        simStats.errors++;
+        return;
+    }
+
+    simBus.busy = true;
+    simBus.rxData = (simBus.owner && !simBus.absent && (simBus.memory != NULL)) ? simSpiAnswer(data) : 0xFF;
+    simBus.rxReadyAt = simStats.elapsedCycles + 8 * simClock.sclCycles;
+    simStats.sclClocks += 8;
+}
+
+static uint8_t spiStatus(void)
+{
+    return (simBus.busy && (simStats.elapsedCycles >= simBus.rxReadyAt)) ? SPI_IF_bm : 0;
+}
+
+/**
+ * \brief   Blocking wait of spi_1.h, the CPU waits until the byte is shifted.
+ */
+static void spiWait(void)
+{
+    if (!simBus.busy)
+    {
+        fprintf(stderr, "SIM: SPI wait without a transfer, the CPU would hang\n");
+        simStats.errors++;
+    } else if (simStats.elapsedCycles < simBus.rxReadyAt)
+    {
+        simStats.elapsedCycles = simBus.rxReadyAt;
+    }
+}
+
+static uint8_t spiReceive(void)
+{
+    if (!simBus.busy || (simStats.elapsedCycles < simBus.rxReadyAt))
+    {
+        fprintf(stderr, "SIM: SPI data read before the transfer is complete\n");
+        simStats.errors++;
+    }
+    simBus.busy = false;
+
+    return simBus.rxData;
+}
+
+static void spiInit(void)
+{
+    simBus.enabled = true;
+    simBus.owner = false;
+    simBus.busy = false;
+    spiAheadLength = 0;
+    spiAheadCount = 0;
+    spiFailed = !isFlashOnBus();
+}
+
+static void spiRelease(void)
+{
+    simBus.enabled = false;
+    simBus.owner = false;
+}
+
+#endif // SPI_SIM_H_
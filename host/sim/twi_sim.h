@@ -0,0 +1,259 @@
+/**
+ * \file    twi_sim.h
+ * \brief   Host simulation of the TWI master primitives of twi_1.h,
+ *          connected to a model of a 24Cxx serial EEPROM (16-bit word address,
+ *          sequential read, page write) backed by a memory buffer. Memories above 64 KB
+ *          select the block by device address bits (TWI_BLOCK_SELECT_bp), like 24LC1025,
+ *          and sequential read wraps within the block. After a page write the memory does not
+ *          acknowledge its address for the write cycle (ACK polling); a STOP issued before the last
+ *          data byte has been shifted out (WIF) is dropped by the TWI master, so the page is lost.
+ *          A stuck bus (SCL held low) can be injected after a given number of transferred bytes.
+ *          Included by twi_1.h when CRYPTBOOT_SIM is defined.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef TWI_SIM_H_
+#define TWI_SIM_H_
+
+#define TWI_RIF_bm              0x80
+#define TWI_WIF_bm              0x40
+#define TWI_RXACK_bm            0x10
+#define TWI_BUSSTATE_gm         0x03
+#define TWI_BUSSTATE_IDLE_gc    0x01
+#define TWI_BUSSTATE_OWNER_gc   0x02
+
+#ifndef SIM_TWI_MEM_PAGE_SIZE
+#define SIM_TWI_MEM_PAGE_SIZE   0x40
+#endif
+
+/**
+ * \brief State of the bus and of the simulated external memory.
+ */
+typedef struct simBus
+{
+    uint8_t           * memory;             // content of the external EEPROM
+    uint32_t            memorySize;         // power of two
+    uint8_t             deviceAddr;         // 8-bit format, R/W bit cleared
+    bool                absent;             // no memory on the bus, address is not acknowledged
+    bool                enabled;
+    bool                owner;              // master owns the bus (START issued, no STOP yet)
+    bool                selected;           // device acknowledged its address
+    bool                reading;
+    uint8_t             addressBytes;       // word address bytes received in current write transfer
+    uint32_t            pointer;            // internal address counter of the memory
+    uint32_t            block;              // address bits above 16 from the device address
+    uint64_t            rxReadyAt;          // timeline cycle at which the byte being clocked in is received
+    uint32_t            stuckAfter;         // bus is stuck after this many START/address/data bytes
+    bool                written;            // data bytes received in current write transfer
+    bool                shifting;           // byte written to MDATA and not yet waited for (WIF)
+    bool                refuseWrites;       // memory does not acknowledge data bytes (write protected)
+    bool                refused;            // data byte not acknowledged in current write transfer
+    uint64_t            busyUntil;          // timeline cycle at which the write cycle ends
+    uint32_t            writeCycles;        // CPU cycles per write cycle (tWR)
+    uint32_t            pageWrites;
+    uint32_t            probesNacked;       // START not acknowledged during a write cycle
+} simBus_t;
+
+static simBus_t     simBus = { .deviceAddr = 0xA0, .stuckAfter = UINT32_MAX };
+
+/**
+ * \return true if the bus is stuck, no byte can be transferred any more
+ */
+static bool simTwiStuck(void)
+{
+    return (simStats.starts + simStats.bytesWritten + simStats.bytesRead) >= simBus.stuckAfter;
+}
+
+/**
+ * \brief   Master spends the given number of SCL clocks on the bus, the CPU waits for it.
+ */
+static void simTwiClocks(uint32_t clocks)
+{
+    simStats.sclClocks += clocks;
+    simStats.elapsedCycles += (uint64_t)clocks * simClock.sclCycles;
+}
+
+static uint8_t simTwiStatus(void)
+{
+    uint8_t status = simBus.owner ? TWI_BUSSTATE_OWNER_gc : TWI_BUSSTATE_IDLE_gc;
+
+    if (simBus.owner)
+    {
+        if (simTwiStuck())
+        {                                                           // no flag is ever set
+        } else if (simBus.reading)
+        {
+            status |= (simStats.elapsedCycles >= simBus.rxReadyAt) ? TWI_RIF_bm : 0;
+        } else
+        {
+            status |= TWI_WIF_bm;
+        }
+        status |= (simBus.selected && !simBus.refused) ? 0 : TWI_RXACK_bm;
+    }
+
+    return status;
+}
+
+static void twiInit(uint8_t baud)
+{
+    (void)baud;
+    simBus.enabled = true;
+    simBus.owner = false;
+    twiFailed = false;
+}
+
+/**
+ * \brief   Bounded wait of twi_1.h: on a stuck bus the CPU polls for TWI_TIMEOUT_US
+ *          and the bus is marked as failed.
+ */
+static uint8_t twiWait(uint8_t flags)
+{
+    if (!(simTwiStatus() & flags))
+    {
+        simStats.elapsedCycles += (uint64_t)TWI_TIMEOUT_LOOPS * TWI_WAIT_CYCLES;
+        twiFailed = true;
+    }
+    if (flags & TWI_WIF_bm)
+    {
+        simBus.shifting = false;
+    }
+
+    return simTwiStatus();
+}
+
+static uint8_t twiStart(uint8_t deviceAddr)
+{
+    if (!simBus.enabled)
+    {
+        fprintf(stderr, "SIM: START with TWI disabled\n");
+        simStats.errors++;
+        return 0;
+    }
+    if (twiFailed || simTwiStuck())
+    {
+        twiWait(TWI_WIF_bm | TWI_RIF_bm);
+        return simTwiStatus();
+    }
+
+    simStats.transactions += !simBus.owner;
+    simStats.starts++;
+    simTwiClocks(1 + 9);                                            // START + address byte with ACK
+    simBus.owner = true;
+    uint8_t blockMask = (uint8_t)((((simBus.memorySize - 1) >> 16) << TWI_BLOCK_SELECT_bp) & 0xFE);
+
+    simBus.selected = (simBus.memory != NULL) && !simBus.absent && ((deviceAddr & 0xFE & ~blockMask) == simBus.deviceAddr)
+                      && (simStats.elapsedCycles >= simBus.busyUntil);
+    simBus.probesNacked += (simStats.elapsedCycles < simBus.busyUntil);
+    simBus.block = (uint32_t)((deviceAddr & blockMask) >> TWI_BLOCK_SELECT_bp) << 16;
+    simBus.reading = deviceAddr & 0x01;
+    simBus.addressBytes = 0;
+    simBus.shifting = false;
+    simBus.refused = false;
+    simBus.rxReadyAt = simStats.elapsedCycles + 9 * simClock.sclCycles;     // first byte follows the address
+
+    return simTwiStatus();
+}
+
+/**
+ * \brief   Smart mode read: waits for the byte being clocked in, then reading MDATA
+ *          starts reception of the next byte in the background.
+ */
+static uint8_t twiRead(uint8_t *data, bool ackFlag)
+{
+    (void)ackFlag;
+    if (twiFailed || simTwiStuck())
+    {
+        twiWait(TWI_RIF_bm);
+    } else if (simBus.owner && simBus.reading)
+    {
+        if (simStats.elapsedCycles < simBus.rxReadyAt)
+        {
+            simStats.elapsedCycles = simBus.rxReadyAt;
+        }
+        *data = simBus.selected ? simBus.memory[simBus.pointer] : 0xFF;
+        simBus.pointer = ((simBus.pointer & ~(uint32_t)0xFFFF) | ((simBus.pointer + 1) & 0xFFFF)) & (simBus.memorySize - 1);
+        simStats.bytesRead++;
+        simStats.sclClocks += 9;
+        simBus.rxReadyAt = simStats.elapsedCycles + 9 * simClock.sclCycles;
+    }
+
+    return simTwiStatus();
+}
+
+static uint8_t twiWrite(uint8_t data)
+{
+    if (twiFailed || simTwiStuck())
+    {
+        twiWait(TWI_WIF_bm);
+    } else if (simBus.owner && !simBus.reading)
+    {
+        simStats.bytesWritten++;
+        simTwiClocks(9);
+        simBus.shifting = true;
+        if (!simBus.selected)
+        {
+            return simTwiStatus();
+        }
+        if (simBus.addressBytes < 2)
+        {
+            simBus.pointer = (simBus.block | (((simBus.pointer << 8) | data) & 0xFFFF)) & (simBus.memorySize - 1);
+            simBus.addressBytes++;
+        } else if (simBus.refuseWrites)
+        {
+            simBus.refused = true;
+        } else
+        {                                                           // page write, address wraps within the page
+            if (simBus.written && !(simBus.pointer & (SIM_TWI_MEM_PAGE_SIZE - 1)))
+            {
+                fprintf(stderr, "SIM: page write wraps at 0x%05X\n", (unsigned)simBus.pointer);
+                simStats.errors++;
+            }
+            simBus.memory[simBus.pointer] = data;
+            simBus.written = true;
+            simBus.pointer = (simBus.pointer & ~(uint32_t)(SIM_TWI_MEM_PAGE_SIZE - 1))
+                           | ((simBus.pointer + 1) & (SIM_TWI_MEM_PAGE_SIZE - 1));
+        }
+    }
+
+    return simTwiStatus();
+}
+
+static uint8_t twiStatus(void)
+{
+    return simTwiStatus();
+}
+
+static void twiStop(void)
+{
+    if (simBus.written && simBus.shifting)
+    {                                                               // MCMD takes effect only while the clock is held,
+        fprintf(stderr, "SIM: STOP while the last byte is shifted out, page write is lost\n");
+        simStats.errors++;                                          // the memory never starts its write cycle
+        simBus.written = false;
+    }
+    simBus.shifting = false;
+    if (simBus.owner)
+    {
+        simStats.stops++;
+        simTwiClocks(1);
+    }
+    if (simBus.written)
+    {
+        simBus.busyUntil = simStats.elapsedCycles + simBus.writeCycles;
+        simBus.pageWrites++;
+    }
+    simBus.owner = false;
+    simBus.written = false;
+}
+
+static void twiRelease(void)
+{
+    simBus.enabled = false;
+    simBus.owner = false;
+}
+
+#endif // TWI_SIM_H_
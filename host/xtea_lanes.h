@@ -0,0 +1,200 @@
+/**
+ * \file    xtea_lanes.h
+ * \brief   Multi-lane XTEA encryption for host tools: XTEA_LANES independent blocks,
+ *          each with its own round keys, are encrypted at once by an AVX2, SSE2
+ *          or scalar kernel (selected at run time). Results are bit-exact
+ *          with xteaEcbEncrypt() of xtea.h.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef XTEA_LANES_H_
+#define XTEA_LANES_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "xtea.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XTEA_LANES_X86
+#endif
+
+#define XTEA_LANES                  16
+#define XTEA_LANES_MAX_ROUNDS       255
+
+/**
+ * \brief   Round keys of all lanes, interleaved so that the key of one round
+ *          for all lanes is a contiguous vector: roundKey[2 * round + half][lane].
+ */
+typedef struct xteaLanesSchedule
+{
+    uint32_t            roundKey[2 * XTEA_LANES_MAX_ROUNDS][XTEA_LANES] __attribute__((aligned(32)));
+} xteaLanesSchedule_t;
+
+/**
+ * \brief   Blocks of all lanes as big-endian 32-bit halves, like v0/v1 of xteaEcbEncrypt().
+ */
+typedef struct xteaLanesState
+{
+    uint32_t            v0[XTEA_LANES] __attribute__((aligned(32)));
+    uint32_t            v1[XTEA_LANES] __attribute__((aligned(32)));
+} xteaLanesState_t;
+
+typedef void (*xteaLanesKernel_t)(const xteaLanesSchedule_t *schedule, xteaLanesState_t *state, unsigned rounds);
+
+/**
+ * \brief   Compute round keys of a lane from 16-byte key (after optional XOR with 'pad',
+ *          as done by xteaCfbMacInit() for ipad/opad keys).
+ */
+static void xteaLanesSetKey(xteaLanesSchedule_t *schedule, unsigned lane, const uint8_t key[XTEA_KEY_SIZE],
+                            uint8_t pad, unsigned rounds)
+{
+    const uint32_t  delta = 0x9E3779B9;
+    uint32_t        sum = 0;
+    uint32_t        word[XTEA_KEY_SIZE / sizeof(uint32_t)];
+
+    for (unsigned idx = 0; idx < (XTEA_KEY_SIZE / sizeof(uint32_t)); idx++)
+    {
+        word[idx] = ((uint32_t)(key[(4 * idx) + 0] ^ pad) << 24) | ((uint32_t)(key[(4 * idx) + 1] ^ pad) << 16)
+                  | ((uint32_t)(key[(4 * idx) + 2] ^ pad) << 8)  |  (uint32_t)(key[(4 * idx) + 3] ^ pad);
+    }
+    for (unsigned round = 0; round < rounds; round++)
+    {
+        schedule->roundKey[2 * round][lane] = sum + word[sum & 3];
+        sum += delta;
+        schedule->roundKey[(2 * round) + 1][lane] = sum + word[(sum >> 11) & 3];
+    }
+}
+
+/**
+ * \brief Load an 8-byte block into a lane.
+ */
+static inline void xteaLanesLoad(xteaLanesState_t *state, unsigned lane, const uint8_t block[XTEA_BLOCK_SIZE])
+{
+    state->v0[lane] = ((uint32_t)block[0] << 24) | ((uint32_t)block[1] << 16) | ((uint32_t)block[2] << 8) | block[3];
+    state->v1[lane] = ((uint32_t)block[4] << 24) | ((uint32_t)block[5] << 16) | ((uint32_t)block[6] << 8) | block[7];
+}
+
+/**
+ * \brief Store the block of a lane as 8 bytes.
+ */
+static inline void xteaLanesStore(const xteaLanesState_t *state, unsigned lane, uint8_t block[XTEA_BLOCK_SIZE])
+{
+    for (unsigned idx = 0; idx < 4; idx++)
+    {
+        block[idx]     = (uint8_t)(state->v0[lane] >> (24 - (8 * idx)));
+        block[idx + 4] = (uint8_t)(state->v1[lane] >> (24 - (8 * idx)));
+    }
+}
+
+static void xteaLanesScalar(const xteaLanesSchedule_t *schedule, xteaLanesState_t *state, unsigned rounds)
+{
+    for (unsigned lane = 0; lane < XTEA_LANES; lane++)
+    {
+        uint32_t    v0 = state->v0[lane];
+        uint32_t    v1 = state->v1[lane];
+
+        for (unsigned round = 0; round < rounds; round++)
+        {
+            v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ schedule->roundKey[2 * round][lane];
+            v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ schedule->roundKey[(2 * round) + 1][lane];
+        }
+        state->v0[lane] = v0;
+        state->v1[lane] = v1;
+    }
+}
+
+#ifdef XTEA_LANES_X86
+__attribute__((target("sse2")))
+static void xteaLanesSse2(const xteaLanesSchedule_t *schedule, xteaLanesState_t *state, unsigned rounds)
+{
+    __m128i v0[XTEA_LANES / 4];
+    __m128i v1[XTEA_LANES / 4];
+
+    for (unsigned vec = 0; vec < (XTEA_LANES / 4); vec++)
+    {
+        v0[vec] = _mm_load_si128((const __m128i *)&state->v0[4 * vec]);
+        v1[vec] = _mm_load_si128((const __m128i *)&state->v1[4 * vec]);
+    }
+    for (unsigned round = 0; round < rounds; round++)
+    {
+        for (unsigned vec = 0; vec < (XTEA_LANES / 4); vec++)
+        {                                                           // independent vectors hide instruction latency
+            __m128i f = _mm_add_epi32(_mm_xor_si128(_mm_slli_epi32(v1[vec], 4), _mm_srli_epi32(v1[vec], 5)), v1[vec]);
+            v0[vec] = _mm_add_epi32(v0[vec], _mm_xor_si128(f, _mm_load_si128((const __m128i *)&schedule->roundKey[2 * round][4 * vec])));
+            f = _mm_add_epi32(_mm_xor_si128(_mm_slli_epi32(v0[vec], 4), _mm_srli_epi32(v0[vec], 5)), v0[vec]);
+            v1[vec] = _mm_add_epi32(v1[vec], _mm_xor_si128(f, _mm_load_si128((const __m128i *)&schedule->roundKey[(2 * round) + 1][4 * vec])));
+        }
+    }
+    for (unsigned vec = 0; vec < (XTEA_LANES / 4); vec++)
+    {
+        _mm_store_si128((__m128i *)&state->v0[4 * vec], v0[vec]);
+        _mm_store_si128((__m128i *)&state->v1[4 * vec], v1[vec]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void xteaLanesAvx2(const xteaLanesSchedule_t *schedule, xteaLanesState_t *state, unsigned rounds)
+{
+    __m256i v0[XTEA_LANES / 8];
+    __m256i v1[XTEA_LANES / 8];
+
+    for (unsigned vec = 0; vec < (XTEA_LANES / 8); vec++)
+    {
+        v0[vec] = _mm256_load_si256((const __m256i *)&state->v0[8 * vec]);
+        v1[vec] = _mm256_load_si256((const __m256i *)&state->v1[8 * vec]);
+    }
+    for (unsigned round = 0; round < rounds; round++)
+    {
+        for (unsigned vec = 0; vec < (XTEA_LANES / 8); vec++)
+        {
+            __m256i f = _mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v1[vec], 4), _mm256_srli_epi32(v1[vec], 5)), v1[vec]);
+            v0[vec] = _mm256_add_epi32(v0[vec], _mm256_xor_si256(f, _mm256_load_si256((const __m256i *)&schedule->roundKey[2 * round][8 * vec])));
+            f = _mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v0[vec], 4), _mm256_srli_epi32(v0[vec], 5)), v0[vec]);
+            v1[vec] = _mm256_add_epi32(v1[vec], _mm256_xor_si256(f, _mm256_load_si256((const __m256i *)&schedule->roundKey[(2 * round) + 1][8 * vec])));
+        }
+    }
+    for (unsigned vec = 0; vec < (XTEA_LANES / 8); vec++)
+    {
+        _mm256_store_si256((__m256i *)&state->v0[8 * vec], v0[vec]);
+        _mm256_store_si256((__m256i *)&state->v1[8 * vec], v1[vec]);
+    }
+}
+#endif
+
+/**
+ * \brief   Select the kernel by name ("avx2", "sse2", "scalar") or the fastest one
+ *          supported by the CPU for "auto".
+ *
+ * \return kernel, or NULL if not available
+ */
+static xteaLanesKernel_t xteaLanesKernel(const char *name, const char **selected)
+{
+#ifdef XTEA_LANES_X86
+    __builtin_cpu_init();
+    if (((strcmp(name, "auto") == 0) && __builtin_cpu_supports("avx2")) || (strcmp(name, "avx2") == 0))
+    {
+        *selected = "avx2";
+        return __builtin_cpu_supports("avx2") ? xteaLanesAvx2 : NULL;
+    }
+    if (((strcmp(name, "auto") == 0) && __builtin_cpu_supports("sse2")) || (strcmp(name, "sse2") == 0))
+    {
+        *selected = "sse2";
+        return __builtin_cpu_supports("sse2") ? xteaLanesSse2 : NULL;
+    }
+#endif
+    if ((strcmp(name, "auto") == 0) || (strcmp(name, "scalar") == 0))
+    {
+        *selected = "scalar";
+        return xteaLanesScalar;
+    }
+
+    return NULL;
+}
+
+#endif // XTEA_LANES_H_
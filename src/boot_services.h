@@ -0,0 +1,129 @@
+/**
+ * \file    boot_services.h
+ * \brief   Services of the bootloader for the application (BOOT_SERVICES): a versioned table of entry points
+ *          at the fixed address BOOT_SERVICES_AT of the boot section, through which the application calls
+ *          the XTEA, CFB-MAC and external memory code of the bootloader instead of carrying its own copy,
+ *          e.g. to check the MAC of a downloaded image before it triggers a reboot.
+ *          Included by the application as is (with xtea.h for the contexts), by the bootloader
+ *          through cryptboot_x.h.
+ *
+ *          Requirements on the application side:
+ *          - the boot section must not be locked (NVMCTRL_BOOTLOCK_bm prevents also instruction fetch
+ *            from it), a bootloader built with BOOT_SERVICES leaves it unlocked: the application can
+ *            read the code of the bootloader and jump into its page programming, i.e. rewrite itself
+ *            without a MAC check; the boot section itself stays write protected;
+ *          - the last BOOT_SERVICES_RAM_SIZE bytes of RAM hold the state of the memory bus shared with
+ *            the bootloader and must be kept free: the application is linked with its stack starting
+ *            at BOOT_SERVICES_STACK_TOP (-Wl,--defsym=__stack=0x3ff7 for 1 KB RAM at 0x3c00 of ATtiny1604),
+ *            isBootServicesAvailable() is false otherwise;
+ *          - contexts are passed to the bootloader as they are, isBootServicesAvailable() checks
+ *            that the application sees them with the same layout (XTEA_KEY_SCHEDULE, -fshort-enums,
+ *            -fpack-struct as in the bootloader Makefile);
+ *          - services are not reentrant and must not be called from interrupts.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef BOOT_SERVICES_H_
+#define BOOT_SERVICES_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifndef CRYPTBOOT_SIM
+#include <avr/io.h>
+#endif
+
+// entries are only appended, a new version of the table keeps the previous ones at their offsets
+#define BOOT_SERVICES_VERSION       1
+#define BOOT_SERVICES_NONE          0xFF                // erased Flash, bootloader without services
+
+// BOOTEND fuse of the bootloader, its boot section is BOOTEND_FUSE * 256 bytes (the bootloader defines it
+// in cryptboot_x.h, an application for a bootloader built with a different boot section defines it as well)
+#ifndef BOOTEND_FUSE
+#define BOOTEND_FUSE                0x08
+#endif
+
+// Flash address of the table: the last BOOT_SERVICES_SIZE bytes of the boot section
+#define BOOT_SERVICES_SIZE          32
+#define BOOT_SERVICES_AT            ((BOOTEND_FUSE * 0x100) - BOOT_SERVICES_SIZE)
+
+// the linker places the table at BOOT_SERVICES_LINK_AT (BOOT_SERVICES_LINK in Makefile)
+#if defined(BOOT_SERVICES_LINK_AT) && (BOOT_SERVICES_LINK_AT != BOOT_SERVICES_AT)
+    #error "Table of services is not linked at BOOT_SERVICES_AT, BOOT_SECTION_SIZE in Makefile must match BOOTEND_FUSE !!!"
+#endif
+
+// RAM shared with the bootloader for the state of the memory bus (twiState_t or spiState_t)
+#ifndef BOOT_SERVICES_RAM_SIZE
+#define BOOT_SERVICES_RAM_SIZE      8
+#endif
+#define BOOT_SERVICES_RAM_AT        (RAMEND + 1 - BOOT_SERVICES_RAM_SIZE)
+
+// highest address of the stack of the bootloader and of the application, below the shared RAM
+#define BOOT_SERVICES_STACK_TOP     (BOOT_SERVICES_RAM_AT - 1)
+
+// top of the application's stack, __stack of the linker (RAMEND unless it is defined by -Wl,--defsym)
+#ifndef BOOT_SERVICES_APP_STACK
+extern uint8_t                      __stack;
+#define BOOT_SERVICES_APP_STACK     ((uintptr_t)&__stack)
+#endif
+
+#ifndef BOOT_SERVICES_TABLE
+#define BOOT_SERVICES_TABLE         ((const bootServices_t *)(MAPPED_PROGMEM_START + BOOT_SERVICES_AT))
+#endif
+
+// contexts of xtea.h, passed by pointer
+struct xteaEcbCtx;
+struct xteaCipherCtx;
+struct xteaCtx;
+
+/**
+ * \brief   Table of services. Functions of xtea.h behave as documented there; external memory is addressed
+ *          as in the bootloader (a 24Cxx EEPROM at TWI_MEM_ADDR, or SPI NOR flash in a bootloader built
+ *          with SPI_STORAGE). XTEA functions may be used without memoryInit(): each of them closes
+ *          the read-ahead window of the shared state of the memory bus first, so they never touch the bus.
+ */
+typedef struct bootServices
+{
+    /// BOOT_SERVICES_VERSION of the bootloader.
+    uint8_t             version;
+    /// sizeof(bootServices_t) in the bootloader.
+    uint8_t             size;
+    /// sizeof(xteaCipherCtx_t) and sizeof(xteaCtx_t) in the bootloader.
+    uint16_t            cipherCtxSize;
+    uint16_t            macCtxSize;
+    /// Initializes the memory bus as the bootloader does (pins, clock), false if no memory answered.
+    bool              (*memoryInit)(void);
+    /// Reads 1-255 bytes at the address of external memory, false if the bus failed (until next memoryInit()).
+    bool              (*memoryRead)(uint32_t address, uint8_t *data, uint8_t length);
+    /// Returns the memory bus to its reset state.
+    void              (*memoryRelease)(void);
+    /// xteaSetKey(), xteaCfbBlock()
+    void              (*setKey)(struct xteaEcbCtx *ctx, const uint8_t key[]);
+    void              (*cfbBlock)(struct xteaCipherCtx *ctx, uint8_t data[]);
+    /// xteaCfbMacInit(), xteaCfbMacUpdate(), xteaCfbMacFinish()
+    void              (*macInit)(struct xteaCtx *ctx, const uint8_t key[], const uint_fast8_t rounds);
+    void              (*macUpdate)(struct xteaCtx *ctx, const uint8_t data[], const uint32_t length);
+    void              (*macFinish)(struct xteaCtx *ctx);
+} bootServices_t;
+
+/**
+ * \brief   Checks whether the bootloader provides the services of this header, passes contexts
+ *          of the same layout and the application's stack leaves the shared RAM free
+ *          (true if the services can be called).
+ */
+#define isBootServicesAvailable()   ((BOOT_SERVICES_APP_STACK <= BOOT_SERVICES_STACK_TOP)                  \
+                                     && (BOOT_SERVICES_TABLE->version != BOOT_SERVICES_NONE)               \
+                                     && (BOOT_SERVICES_TABLE->version >= BOOT_SERVICES_VERSION)            \
+                                     && (BOOT_SERVICES_TABLE->size >= sizeof(bootServices_t))              \
+                                     && (BOOT_SERVICES_TABLE->cipherCtxSize == sizeof(xteaCipherCtx_t))    \
+                                     && (BOOT_SERVICES_TABLE->macCtxSize == sizeof(xteaCtx_t)))
+
+// contexts for the application (the bootloader includes xtea.h after its memory bus, see cryptboot_x.h)
+#ifndef CRYPTBOOT_H_
+#include "xtea.h"
+#endif
+
+#endif // BOOT_SERVICES_H_
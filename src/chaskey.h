@@ -0,0 +1,284 @@
+/**
+ * \file chaskey.h
+ * \brief Chaskey MAC library (permutation-based MAC for 8/32-bit microcontrollers), size-optimized.
+ *        N. Mouha et al., "Chaskey: An Efficient MAC Algorithm for 32-bit Microcontrollers", SAC 2014.
+ *        Number of permutation rounds is a parameter: 8 - original Chaskey, 12 - Chaskey-12, 16 - Chaskey-LTS.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef CHASKEY_H_
+#define CHASKEY_H_
+
+#include <stdbool.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CHASKEY_BLOCK_SIZE  16
+#define CHASKEY_KEY_SIZE    16
+
+// minimal number of permutation rounds, known attack is on 7 rounds
+#ifndef CHASKEY_ROUNDS
+#define CHASKEY_ROUNDS      12
+#endif
+
+// hook called once per block with the number of rounds, used by the host simulation to account CPU time
+#ifndef CHASKEY_BLOCK_HOOK
+#define CHASKEY_BLOCK_HOOK(rounds)
+#endif
+
+// hook called once per round, as XTEA_ROUND_HOOK() of xtea.h
+#ifndef CHASKEY_ROUND_HOOK
+#define CHASKEY_ROUND_HOOK()
+#endif
+
+// hook called with the end of input data needed for the next block, as XTEA_INPUT_HOOK() of xtea.h
+#ifndef CHASKEY_INPUT_HOOK
+#define CHASKEY_INPUT_HOOK(end)
+#endif
+
+/**
+ * \brief Chaskey state, 128 bits as words or bytes (little-endian, as on AVR).
+ */
+typedef union chaskeyState
+{
+    uint32_t            u32[CHASKEY_BLOCK_SIZE / sizeof(uint32_t)];
+    uint8_t             u8[CHASKEY_BLOCK_SIZE];
+} chaskeyState_t;
+
+/**
+ * \brief Chaskey MAC context.
+ */
+typedef struct chaskeyCtx
+{
+    /// Internal state, MAC code after chaskeyMacFinish().
+    chaskeyState_t      state;
+    /// Subkey K1 = 2 * K, the subkey K2 = 4 * K is derived from it at the end.
+    chaskeyState_t      subkey;
+    /// Buffer for the last block, absorbed only when more data follows.
+    uint8_t             data[CHASKEY_BLOCK_SIZE];
+    /// Amount of data in the variable 'data'.
+    uint_fast8_t        dataLength;
+    /// Number of permutation rounds.
+    uint_fast8_t        rounds;
+} chaskeyCtx_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+static void chaskeyPermute     (chaskeyCtx_t *ctx);
+static void chaskeyTimesTwo    (chaskeyState_t *value);
+static void chaskeyAbsorb      (chaskeyCtx_t *ctx, const uint8_t data[CHASKEY_BLOCK_SIZE]);
+static void chaskeyMacInit     (chaskeyCtx_t *ctx, const uint8_t key[CHASKEY_KEY_SIZE], const uint_fast8_t rounds);
+static void chaskeyMacUpdate   (chaskeyCtx_t *ctx, const uint8_t data[], const uint32_t length);
+static void chaskeyMacFinish   (chaskeyCtx_t *ctx);
+static bool chaskeyMacCmp      (chaskeyCtx_t *ctx, const uint8_t mac[], const uint_fast8_t length);
+
+/**
+ * \brief 32-bit left rotation.
+ */
+static inline uint32_t chaskeyRotl(const uint32_t value, const uint_fast8_t shift)
+{
+    return (value << shift) | (value >> (32 - shift));
+}
+
+/**
+ * \brief Apply the Chaskey permutation to the state.
+ *
+ * \param[in]   ctx     Chaskey context.
+ *
+ * \return nothing
+ */
+static void chaskeyPermute(chaskeyCtx_t *ctx)
+{
+    register uint32_t       v0 = ctx->state.u32[0];
+    register uint32_t       v1 = ctx->state.u32[1];
+    register uint32_t       v2 = ctx->state.u32[2];
+    register uint32_t       v3 = ctx->state.u32[3];
+    register uint_fast8_t   rounds = ctx->rounds;
+
+    CHASKEY_BLOCK_HOOK(rounds);
+    while (rounds--)
+    {
+        v0 += v1; v1 = chaskeyRotl(v1, 5);  v1 ^= v0; v0 = chaskeyRotl(v0, 16);
+        v2 += v3; v3 = chaskeyRotl(v3, 8);  v3 ^= v2;
+        v0 += v3; v3 = chaskeyRotl(v3, 13); v3 ^= v0;
+        v2 += v1; v1 = chaskeyRotl(v1, 7);  v1 ^= v2; v2 = chaskeyRotl(v2, 16);
+        CHASKEY_ROUND_HOOK();
+    }
+    ctx->state.u32[0] = v0;
+    ctx->state.u32[1] = v1;
+    ctx->state.u32[2] = v2;
+    ctx->state.u32[3] = v3;
+}
+
+/**
+ * \brief Multiply the 128-bit value by x in GF(2^128) (subkey derivation).
+ *
+ * \param[in,out]   value   value to be doubled.
+ *
+ * \return nothing
+ */
+static void chaskeyTimesTwo(chaskeyState_t *value)
+{
+    register uint32_t carry = (value->u32[3] & 0x80000000UL) ? 0x87 : 0x00;
+
+    value->u32[3] = (value->u32[3] << 1) | (value->u32[2] >> 31);
+    value->u32[2] = (value->u32[2] << 1) | (value->u32[1] >> 31);
+    value->u32[1] = (value->u32[1] << 1) | (value->u32[0] >> 31);
+    value->u32[0] = (value->u32[0] << 1) ^ carry;
+}
+
+/**
+ * \brief Add a complete block, which is not the last one, to MAC calculation.
+ *
+ * \param[in]   ctx     Chaskey context.
+ * \param[in]   data    Block of 128-bit [16 bytes] data to be added.
+ *
+ * \return nothing
+ */
+static void chaskeyAbsorb(chaskeyCtx_t *ctx, const uint8_t data[CHASKEY_BLOCK_SIZE])
+{
+    register uint_fast8_t idx = CHASKEY_BLOCK_SIZE;
+
+    while (idx--)
+    {
+        ctx->state.u8[idx] ^= data[idx];
+    }
+    chaskeyPermute(ctx);
+}
+
+/**
+ * \brief Initialize the MAC calculation.
+ *
+ * \param[in]   ctx     Chaskey context.
+ * \param[in]   key     128-bit [16 bytes] key.
+ * \param[in]   rounds  Number of permutation rounds.
+ *
+ * \return nothing
+ */
+static void chaskeyMacInit(chaskeyCtx_t *ctx, const uint8_t key[CHASKEY_KEY_SIZE], const uint_fast8_t rounds)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+
+    memcpy(ctx->state.u8, key, CHASKEY_KEY_SIZE);
+    memcpy(ctx->subkey.u8, key, CHASKEY_KEY_SIZE);
+    chaskeyTimesTwo(&ctx->subkey);
+    ctx->dataLength = 0x00;
+    ctx->rounds = rounds;
+}
+
+/**
+ * \brief   Add data to an initialized MAC calculation. Complete blocks followed by more data are taken
+ *          directly from 'data', the last (possibly complete) block goes through 'ctx->data',
+ *          as it is processed differently by chaskeyMacFinish().
+ *
+ * \param[in]   ctx     Chaskey context.
+ * \param[in]   data    Data to be added.
+ * \param[in]   length  Size of the data to be added in bytes.
+ *
+ * \return nothing
+ */
+static void chaskeyMacUpdate(chaskeyCtx_t *ctx, const uint8_t data[], const uint32_t length)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+
+    uint32_t    idx = 0;
+
+    while (idx < length)
+    {
+        if (CHASKEY_BLOCK_SIZE == ctx->dataLength)
+        {                                                           // more data follows the buffered block
+            chaskeyAbsorb(ctx, ctx->data);
+            ctx->dataLength = 0x00;
+        }
+        if ((0x00 == ctx->dataLength) && ((length - idx) > CHASKEY_BLOCK_SIZE))
+        {
+            CHASKEY_INPUT_HOOK(data + idx + CHASKEY_BLOCK_SIZE);
+            chaskeyAbsorb(ctx, data + idx);
+            idx += CHASKEY_BLOCK_SIZE;
+        } else
+        {
+            CHASKEY_INPUT_HOOK(data + idx + 1);
+            ctx->data[ctx->dataLength++] = data[idx++];
+        }
+    }
+}
+
+/**
+ * \brief   Finish a MAC operation: the last block is XOR-ed with K1 if complete,
+ *          otherwise it is padded with 0x01 0x00 ... and XOR-ed with K2.
+ *
+ * \param[in]  ctx Chaskey context.
+ *
+ * \return Computed MAC code is in 'state' field of Chaskey context.
+ */
+static void chaskeyMacFinish(chaskeyCtx_t *ctx)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+
+    register uint_fast8_t idx = ctx->dataLength;
+
+    if (idx < CHASKEY_BLOCK_SIZE)
+    {
+        ctx->data[idx++] = 0x01;
+        while (idx < CHASKEY_BLOCK_SIZE)
+        {
+            ctx->data[idx++] = 0x00;
+        }
+        chaskeyTimesTwo(&ctx->subkey);
+    }
+    idx = CHASKEY_BLOCK_SIZE;
+    while (idx--)
+    {
+        ctx->state.u8[idx] ^= ctx->data[idx] ^ ctx->subkey.u8[idx];
+    }
+    chaskeyPermute(ctx);
+    idx = CHASKEY_BLOCK_SIZE;
+    while (idx--)
+    {
+        ctx->state.u8[idx] ^= ctx->subkey.u8[idx];
+    }
+}
+
+/**
+ * \brief   A function that compares the indicated MAC code with the beginning
+ *          of the code computed previously from passed data to check if they match.
+ *
+ * \param[in]   ctx     Chaskey context.
+ * \param[in]   mac     MAC code to compare with code stored in Chaskey context.
+ * \param[in]   length  MAC size in bytes (at most CHASKEY_BLOCK_SIZE).
+ *
+ * \return true - if MAC codes match, otherwise returns false.
+ */
+static inline bool chaskeyMacCmp(chaskeyCtx_t *ctx, const uint8_t mac[], const uint_fast8_t length)
+{
+    if (ctx == NULL)
+    {
+        return false;
+    }
+
+    return (0 == memcmp(mac, ctx->state.u8, length));
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // CHASKEY_H_
@@ -7,6 +7,7 @@
  *          Bootloader communicates with external memory on standard TWI pins:
  *          TWI0 SCL   PA2
  *          TWI0 SDA   PA1
+ *          or, built with SPI_STORAGE, with SPI NOR flash on standard SPI0 pins (see spi_1.h).
  *
  * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
  *
@@ -19,13 +20,93 @@
 static firmwareCfg_t    firmwareConfig;
 static bootCfg_t        bootConfig;
 static xteaCtx_t        ctx;
+#ifdef CHASKEY_MAC
+static chaskeyCtx_t     macCtx;
+#endif
+#ifdef SPECK_CIPHER
+static speckCtx_t       speckCtx;                                   // round keys, chaining value is in 'ctx.cipher'
+#endif
+#ifdef PAGE_PIPELINE
+static uint8_t          buffer[2 * MAPPED_PROGMEM_PAGE_SIZE];     // page being programmed, next page being received
+#else
 static uint8_t          buffer[MAPPED_PROGMEM_PAGE_SIZE];
+#endif
+static memAddr_t        firmwareAt;                                 // descriptor of the firmware in external memory
+#ifdef PAGE_MAC_CHAIN
+static xteaCipherCtx_t  pageCipher;
+static uint8_t          pageTag[XTEA_BLOCK_SIZE];
+#endif
+#ifdef LZ_PAYLOAD
+static usize_t          lzOutPos;
+#endif
+#ifdef SPARSE_PAYLOAD
+static usize_t          sparseOutPos;
+#endif
+#ifdef CRC_CHECK_ON_BOOT
+static uint8_t          appDamaged;                                 // application checksum does not match
+#endif
+#ifdef BOOT_METRICS
+static bootMetrics_t    bootMetrics;
+static uint16_t         pagesWritten;
+static uint16_t         metricsLapAt;                               // RTC count at the end of the previous phase
+#endif
 
 static bool isBootloaderRequested(void);
+static bool isUpdatePending(void);
+#ifdef FW_SLOTS
+static void selectNewestSlot(void);
+#endif
+static bool isFirmwareNewer(void);
 static bool isFirmwareSchouldBeProcessed(void);
+static bool isModeSupported(void);
 static bool isFirmwareMacOk(void);
 static void processFirmwareData(void);
+static void commitPage(uint8_t *appPtr, const uint8_t *data, uint8_t length);
+static void macUpdateFromMemory(uint8_t *data, uint8_t length);
+static void cfbDecrypt(xteaCipherCtx_t *cipher, uint8_t *data, uint8_t length);
+#ifdef CHASKEY_MAC
+static bool isChaskeyMac(void);
+#endif
+#ifdef SPECK_CIPHER
+static bool isSpeckCipher(void);
+#endif
+#ifdef PAGE_MAC_CHAIN
+static bool processPageChain(void);
+#endif
+#ifdef LZ_PAYLOAD
+static void processCompressedData(void);
+static void lzPutByte(uint8_t data);
+static uint8_t lzGetByte(usize_t position);
+#endif
+#ifdef SPARSE_PAYLOAD
+static void processSparseData(void);
+#endif
 static void loadBootloaderData(void);
+#ifdef CRC_CHECK
+static bool isApplicationVerified(void);
+static bool isFlashCrcOk(void);
+static uint16_t flashCrc(uint16_t crc, const uint8_t *data, usize_t length);
+#endif
+#ifdef RESUMABLE_UPDATE
+static usize_t resumeFromJournal(xteaCipherCtx_t *cipher, uint8_t *tag);
+static void updateJournal(const uint8_t *appPtr, const xteaCipherCtx_t *cipher, const uint8_t *tag);
+static void clearJournal(void);
+#endif
+#ifdef BOOT_METRICS
+static void metricsStart(void);
+static uint16_t metricsLap(void);
+static void metricsStop(void);
+#endif
+#ifdef BOOT_SERVICES
+static bool serviceMemInit(void);
+static bool serviceMemRead(uint32_t address, uint8_t *data, uint8_t length);
+static void serviceMemRelease(void);
+static void serviceSetKey(struct xteaEcbCtx *ctx, const uint8_t key[]);
+static void serviceCfbBlock(struct xteaCipherCtx *ctx, uint8_t data[]);
+static void serviceMacInit(struct xteaCtx *ctx, const uint8_t key[], const uint_fast8_t rounds);
+static void serviceMacUpdate(struct xteaCtx *ctx, const uint8_t data[], const uint32_t length);
+static void serviceMacFinish(struct xteaCtx *ctx);
+#endif
 
 /**
  * \brief   Main boot function.
@@ -34,11 +115,11 @@ static void loadBootloaderData(void);
  * 
  * \return  function passes execution to the application
  */
-__attribute__((naked)) __attribute__((section(".ctors"))) void boot(void)
+BOOT_ENTRY void boot(void)
 {
     uint8_t causeOfReset;
 
-    asm volatile("clr r1");                                         // Initialize system for AVR GCC support, expects R1 = 0
+    BOOT_CPU_INIT();                                                // Initialize system for AVR GCC support, expects R1 = 0
     causeOfReset = RSTCTRL.RSTFR;                                   // Get reset cause
     CPU_CCP = CCP_IOREG_gc;                                         // Un-protect protected I/O registers
     CLKCTRL.MCLKCTRLB = CLKCTRL_PEN_bm;                             // Set main clock prescaler to 2 -> CLK_MAIN = 10 MHz
@@ -46,24 +127,42 @@ __attribute__((naked)) __attribute__((section(".ctors"))) void boot(void)
                                                                     // If WDRF is set OR nothing except BORF is set, that's not bootloader entry condition so jump to app
     if (!(causeOfReset && (causeOfReset & RSTCTRL_WDRF_bm || (!(causeOfReset & (~RSTCTRL_BORF_bm))))))
     {
-        twiInit(TWI_BAUD(F_CPU, F_SCL, T_RISE));                    // Initialize I2C interface in Master mode
+#ifdef BOOT_METRICS
+        metricsStart();
+#endif
+        memInit();                                                  // Initialize external memory interface in Master mode
 
         if(isBootloaderRequested())                                 // Check if entering application or continuing to bootloader
         {
             processFirmwareData();                                  // Start programming at start for application section
-                                                                    // Update timestamp [and encryption key, if present]
-            bootConfig.timeStamp = firmwareConfig.timeStamp;        // to prevent firmware from reloading after reboot
-            eeprom_update_block((uint8_t *)&bootConfig, (uint8_t *)(MAPPED_EEPROM_SIZE - sizeof(bootConfig)), sizeof(bootConfig));
+            BOOT_METRICS_LAP(program);
+            if (!memFailed)                                         // Update timestamp [and encryption key, if present]
+            {                                                       // to prevent firmware from reloading after reboot,
+                bootConfig.timeStamp = firmwareConfig.timeStamp;    // update interrupted by bus failure is retried
+                eeprom_update_block((uint8_t *)&bootConfig, (uint8_t *)(MAPPED_EEPROM_SIZE - sizeof(bootConfig)), sizeof(bootConfig));
+#ifdef RESUMABLE_UPDATE
+                clearJournal();
+#endif
+            }
+#ifdef BOOT_METRICS
+            eeprom_update_word((uint16_t *)BOOT_PAGES_WRITTEN_AT, pagesWritten);
+            eeprom_update_block((uint8_t *)&bootMetrics, (uint8_t *)BOOT_METRICS_AT, sizeof(bootMetrics));
+#endif
             eeprom_busy_wait();
             _PROTECTED_WRITE(RSTCTRL.SWRR, RSTCTRL_SWRE_bm);        // Issue system reset
         }
 
-        twiRelease();                                               // Releasing I2C interface before starting application
+        memRelease();                                               // Releasing memory interface before starting application
+#ifdef BOOT_METRICS
+        metricsStop();
+#endif
     }
     RSTCTRL.RSTFR = causeOfReset;                                   // Clear the reset causes before jumping to app
     GPIOR0 = causeOfReset;                                          // but, stash the reset cause in GPIOR0 for use by app
-    NVMCTRL.CTRLB = NVMCTRL_BOOTLOCK_bm;                            // Enable Boot Section Lock
-    __asm__ __volatile__ (APP_START_JUMP);                          // Go to application, located immediately after boot section
+#ifndef BOOT_SERVICES
+    NVMCTRL.CTRLB = NVMCTRL_BOOTLOCK_bm;                            // Enable Boot Section Lock [not with BOOT_SERVICES,
+#endif                                                              // it would prevent the application from calling them]
+    BOOT_APP_START();                                               // Go to application, located immediately after boot section
 }
 
 /**
@@ -75,13 +174,124 @@ static bool isBootloaderRequested(void)
 {
     register uint8_t result = false;
 
-    if (isDeviceOnBus(TWI_MEM_ADDR))
+    if (isUpdatePending())
     {
-        loadBootloaderData();
+        loadBootloaderData();                                       // opens sequential read of descriptor and firmware
         if (isFirmwareSchouldBeProcessed() && isFirmwareMacOk())
         {
             result = true;
         }
+        memEndRead();                                               // single read transaction ends here
+    }
+
+    return result;
+}
+
+/**
+ * \brief   Fast path taken on every boot: reads only the descriptor fields from 'version'
+ *          to 'firmwareSize' and the stored time stamp, which is enough to reject
+ *          the firmware in external memory when there is no new one (the usual case).
+ *          Missing memory is detected by the address NACK of the same read.
+ * 
+ * \return true if the firmware in external memory may be new, false if the application is to be started
+ */
+static bool isUpdatePending(void)
+{
+    register uint8_t result = false;
+
+#ifdef CRC_CHECK_ON_BOOT
+    appDamaged = (*(const uint16_t *)FW_CRC_AT != FW_CRC_NONE)      // checksum stored by the last update, and
+                 && (*(const uint16_t *)MAPPED_APPLICATION_START != 0xFFFF)
+                 && !isFlashCrcOk();                                // application not erased on purpose
+#endif
+    firmwareAt = TWI_CONTROL_DATA_AT;
+#ifdef FW_SLOTS
+    selectNewestSlot();
+#endif
+    if (memBeginRead(firmwareAt + offsetof(firmwareCfg_t, version)))
+    {
+        memReadBytes((uint8_t *)&firmwareConfig.version, offsetof(firmwareCfg_t, cipherIv) - offsetof(firmwareCfg_t, version));
+        bootConfig.timeStamp = eeprom_read_dword((uint32_t *)(MAPPED_EEPROM_SIZE - sizeof(uint32_t)));
+        result = isFirmwareNewer();                                 // bus failed meanwhile: rejected by the full check
+    }
+    memEndRead();
+    BOOT_METRICS_LAP(probe);
+
+    return result;
+}
+
+#ifdef FW_SLOTS
+/**
+ * \brief   A function that reads the image directory and sets 'firmwareAt' to the descriptor
+ *          with the highest time stamp among used slots, so the next release and a known-good
+ *          fallback can be staged side by side (switching between them takes only a directory
+ *          update and a reboot; an older slot is loaded only with DOWNGRADE).
+ *          Slots being staged or erased (no firmware size) and images this build cannot load
+ *          are skipped, so they do not hide an older loadable image; of slots with the same
+ *          time stamp the first one is taken. 'firmwareAt' is left unchanged if no slot is used.
+ * 
+ * \return nothing
+ */
+static void selectNewestSlot(void)
+{
+    uint32_t            directory[FW_SLOTS];
+    uint32_t            newest          = 0;
+    register uint8_t    slot;
+
+    memRead(TWI_DIRECTORY_AT, (uint8_t *)&directory, sizeof(directory));
+    for (slot = 0; (slot < FW_SLOTS) && !memFailed; slot++)
+    {
+        if (directory[slot] != FW_SLOT_UNUSED)
+        {                                                           // descriptor fields from 'version' to 'firmwareSize'
+            memRead((memAddr_t)directory[slot] + offsetof(firmwareCfg_t, version), (uint8_t *)&firmwareConfig.version,
+                    offsetof(firmwareCfg_t, cipherIv) - offsetof(firmwareCfg_t, version));
+            if ((firmwareConfig.timeStamp != 0xFFFFFFFF) && (firmwareConfig.timeStamp > newest)
+                && (firmwareConfig.firmwareSize > 0) && (firmwareConfig.firmwareSize <= MAPPED_APPLICATION_SIZE))
+            {                                                       // and 'rfu' (page size, payload) for the mode,
+                memRead((memAddr_t)directory[slot] + offsetof(firmwareCfg_t, rfu),  // only of a newer slot
+                        (uint8_t *)&firmwareConfig.rfu, sizeof(firmwareConfig.rfu));
+                if (isModeSupported())
+                {
+                    newest = firmwareConfig.timeStamp;
+                    firmwareAt = (memAddr_t)directory[slot];
+                }
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * \brief   Auxiliary function that checks if time stamp in the firmware descriptor is newer than the time stamp
+ *          stored in internal EEPROM memory of the microcontroller [or just different with DOWNGRADE],
+ *          and if the size of the new firmware fits application section.
+ *          [With CRC_CHECK_ON_BOOT the firmware already loaded is accepted again if the application is damaged.]
+ * 
+ * \return true if firmware can be loaded, false otherwise
+ */
+BOOT_NOINLINE static bool isFirmwareNewer(void)
+{
+    register uint8_t result = false;
+
+    if ((firmwareConfig.firmwareSize - 1) < MAPPED_APPLICATION_SIZE)
+    {                                                               // not empty (0 wraps around) and fits application section
+#ifndef DOWNGRADE_ALLOWED
+        if ((uint32_t)(bootConfig.timeStamp + 1) <= firmwareConfig.timeStamp)
+        {                                                           // newer, or any one when EEPROM is erased (wraps to 0)
+            result = true;
+        }
+#else
+        if ((firmwareConfig.timeStamp != bootConfig.timeStamp) && (firmwareConfig.timeStamp != 0xFFFFFFFF))
+        {
+            result = true;
+        }
+#endif
+#ifdef CRC_CHECK_ON_BOOT
+        if (appDamaged && (firmwareConfig.timeStamp == bootConfig.timeStamp))
+        {                                                           // application is programmed again from the image
+            result = true;                                          // it was loaded from, if that image is still there
+        }
+#endif
     }
 
     return result;
@@ -90,7 +300,8 @@ static bool isBootloaderRequested(void)
 /**
  * \brief   Auxiliary function that checks the preconditions for further firmware processing
  *          (this allows to bypass time-consuming calculation of the signature by Bootloader if conditions are not correct):
- *          - checking if 'MAC type' is 'CFB-MAC' and MAC size is 8 bytes, and if the encryption algorithm used is XTEA.
+ *          - checking if 'MAC type' is 'CFB-MAC' [or page chained CFB-MAC] and MAC size is 8 bytes,
+ *            and if the encryption algorithm used is XTEA.
  *          - checking if time stamp in the firmware descriptor and time stamp stored in internal EEPROM memory
  *            of the microcontroller are different from each other.
  *          - checking the size of the new firmware.
@@ -101,22 +312,97 @@ static bool isFirmwareSchouldBeProcessed(void)
 {
     register uint8_t result = false;
 
-#ifndef DOWNGRADE_ALLOWED
-    if (((firmwareConfig.mode & 0xFA) == 0)
-        && ((firmwareConfig.timeStamp > bootConfig.timeStamp) || (bootConfig.timeStamp == 0xFFFFFFFF))
-        && (firmwareConfig.firmwareSize > 0)
-        && (firmwareConfig.firmwareSize <= MAPPED_APPLICATION_SIZE))
-#else
-    if (((firmwareConfig.mode & 0xFA) == 0)
-        && (firmwareConfig.timeStamp != bootConfig.timeStamp)
-        && (firmwareConfig.timeStamp != 0xFFFFFFFF)
-        && (firmwareConfig.firmwareSize > 0)
-        && (firmwareConfig.firmwareSize <= MAPPED_APPLICATION_SIZE))
-#endif
-    {
+    if (!memFailed && isModeSupported() && isFirmwareNewer())       // whole descriptor is checked again, it is read
+    {                                                               // once more along with the signed firmware
          result = true;
     }
 
+#ifdef CRC_CHECK_ON_BOOT
+    if ((firmwareConfig.timeStamp == bootConfig.timeStamp) && ((firmwareConfig.rfu[2] & firmwareConfig.rfu[3]) == 0xFF))
+    {                                                               // damaged application is repaired only
+         result = false;                                            // by firmware with checksum
+    }
+#endif
+    BOOT_METRICS_LAP(header);
+
+    return result;
+}
+
+/**
+ * \brief   Auxiliary function that checks if the firmware descriptor 'mode' is handled by this build.
+ *
+ * \return true if MAC type, MAC size, cipher types and numbers of rounds are supported, false otherwise
+ */
+static bool isModeSupported(void)
+{
+    register uint8_t mode       = firmwareConfig.mode;              // fields handled below are cleared in it
+    register uint8_t result     = true;
+    register uint8_t payloadOk;
+#ifdef XTEA_KEY_SCHEDULE
+    register uint8_t xteaCipher = true;                             // 'cipherRounds' and 'macRounds' are XTEA rounds
+    register uint8_t xteaMac    = true;
+#endif
+
+#ifdef PAGE_MAC_CHAIN
+    if (((mode & FW_MODE_MAC_TYPE_gm) == FW_MODE_MAC_PAGE_CHAIN_gc)
+        && (firmwareConfig.rfu[0] == (MAPPED_PROGMEM_PAGE_SIZE / XTEA_BLOCK_SIZE)))
+    {                                                               // chain segments must match Flash page size
+        mode &= ~FW_MODE_MAC_TYPE_gm;
+    }
+#endif
+
+#ifdef CHASKEY_MAC
+    if (isChaskeyMac())
+    {                                                               // 'macRounds' are permutation rounds
+        result = (firmwareConfig.macRounds >= CHASKEY_ROUNDS);
+        mode &= ~FW_MODE_MAC_TYPE_gm;
+#ifdef XTEA_KEY_SCHEDULE
+        xteaMac = false;
+#endif
+    }
+#endif
+
+#ifdef SPECK_CIPHER
+    if (isSpeckCipher())
+    {                                                               // Speck takes the place of XTEA in the CFB chain
+        if ((mode & FW_MODE_CIPHER_gm) == FW_MODE_CIPHER_SPECK_gc)  // of the new key and firmware, so the other
+        {                                                           // field must be Speck or none
+            mode &= ~FW_MODE_CIPHER_gm;
+        }
+        if ((mode & FW_MODE_NEWKEY_gm) == FW_MODE_NEWKEY_SPECK_gc)
+        {
+            mode &= ~FW_MODE_NEWKEY_gm;
+        }
+        result = result && ((mode & (FW_MODE_CIPHER_gm | FW_MODE_NEWKEY_gm)) == 0)
+                 && (firmwareConfig.cipherRounds == SPECK_ROUNDS);
+#ifdef XTEA_KEY_SCHEDULE
+        xteaCipher = false;
+#endif
+    }
+#endif
+
+    result = result && ((mode & ~FW_MODE_SUPPORTED_gm) == 0);
+
+#ifdef XTEA_KEY_SCHEDULE
+    if ((xteaCipher && (firmwareConfig.cipherRounds > XTEA_SCHEDULE_ROUNDS)) || (xteaMac && (firmwareConfig.macRounds > XTEA_SCHEDULE_ROUNDS)))
+    {                                                               // round keys are computed for limited number of rounds
+        result = false;
+    }
+#endif
+
+    if (firmwareConfig.rfu[1] != FW_PAYLOAD_PLAIN)
+    {                                                               // only whole image MAC for compressed or sparse payload
+        payloadOk = false;
+#ifdef LZ_PAYLOAD
+        payloadOk |= (firmwareConfig.rfu[1] == FW_PAYLOAD_LZ);
+#endif
+#ifdef SPARSE_PAYLOAD
+        payloadOk |= (firmwareConfig.rfu[1] == FW_PAYLOAD_SPARSE)   // pages must match Flash page size
+                     && (firmwareConfig.rfu[0] == (MAPPED_PROGMEM_PAGE_SIZE / XTEA_BLOCK_SIZE));
+#endif
+        result = result && payloadOk && ((firmwareConfig.mode & FW_MODE_MAC_TYPE_gm) != FW_MODE_MAC_PAGE_CHAIN_gc);
+    }
+
     return result;
 }
 
@@ -128,35 +414,62 @@ static bool isFirmwareSchouldBeProcessed(void)
  */
 static bool isFirmwareMacOk(void)
 {
-    usize_t startPos        = 0;
     usize_t remainingBytes  = (usize_t)firmwareConfig.firmwareSize;
     uint8_t shift           = (firmwareConfig.firmwareSize < MAPPED_PROGMEM_PAGE_SIZE) ? (uint8_t)firmwareConfig.firmwareSize : MAPPED_PROGMEM_PAGE_SIZE;
     uint8_t result          = false;
 
-    xteaCfbMacInit(&ctx, (uint8_t *)&bootConfig.key, firmwareConfig.macRounds);
-    xteaCfbMacUpdate(&ctx, (uint8_t *)&firmwareConfig.version, sizeof(firmwareConfig) - sizeof(firmwareConfig.firmwareMac));
-
-    while (shift)
+#ifdef CHASKEY_MAC
+    if (isChaskeyMac())
     {
-        twiEepromRead(TWI_MEM_ADDR, (TWI_FIRMWARE_AT_ADDR + startPos), (uint8_t *)&buffer, shift);
-        xteaCfbMacUpdate(&ctx, (uint8_t *)&buffer, shift);
+        chaskeyMacInit(&macCtx, (uint8_t *)&bootConfig.key, firmwareConfig.macRounds);
+        chaskeyMacUpdate(&macCtx, (uint8_t *)&firmwareConfig.version, sizeof(firmwareConfig) - sizeof(firmwareConfig.firmwareMac));
+    } else
+#endif
+    {
+        xteaCfbMacInit(&ctx, (uint8_t *)&bootConfig.key, firmwareConfig.macRounds);
+        xteaCfbMacUpdate(&ctx, (uint8_t *)&firmwareConfig.version, sizeof(firmwareConfig) - sizeof(firmwareConfig.firmwareMac));
+    }
 
-        startPos += shift;
-        remainingBytes = firmwareConfig.firmwareSize - startPos;
+#ifdef PAGE_MAC_CHAIN
+    if ((firmwareConfig.mode & FW_MODE_MAC_TYPE_gm) == FW_MODE_MAC_PAGE_CHAIN_gc)
+    {                                                               // only the tag of the first page is signed here,
+        macUpdateFromMemory((uint8_t *)&pageTag, XTEA_BLOCK_SIZE);
+        shift = 0;                                                  // pages are verified one by one while programming
+    }
+#endif
+
+    while (shift && !memFailed)                                     // firmware follows descriptor, so the read
+    {                                                               // opened by loadBootloaderData() just continues
+        macUpdateFromMemory((uint8_t *)&buffer, shift);
+
+        remainingBytes -= shift;
         if (remainingBytes < MAPPED_PROGMEM_PAGE_SIZE)
         {
             shift = remainingBytes;
         }
     }
 
-    xteaCfbMacFinish(&ctx);
-    result = xteaCfbMacCmp(&ctx, (uint8_t *)&firmwareConfig.firmwareMac);
+#ifdef CHASKEY_MAC
+    if (isChaskeyMac())
+    {
+        chaskeyMacFinish(&macCtx);
+        result = chaskeyMacCmp(&macCtx, (uint8_t *)&firmwareConfig.firmwareMac, XTEA_BLOCK_SIZE);
+    } else
+#endif
+    {
+        xteaCfbMacFinish(&ctx);
+        result = xteaCfbMacCmp(&ctx, (uint8_t *)&firmwareConfig.firmwareMac);
+    }
 
-    if (!result)                                                    // calculated MAC code does not match code contained in the firmware,
+    if (memFailed)                                                  // firmware could not be read, it is not faulty
+    {
+        result = false;
+    } else if (!result)                                             // calculated MAC code does not match code contained in the firmware,
     {                                                               // so stored timestamp is updated to prevent re-attempting to load this faulty firmware
         eeprom_update_dword((uint32_t *)(MAPPED_EEPROM_SIZE - sizeof(uint32_t)), firmwareConfig.timeStamp);
         eeprom_busy_wait();
     }
+    BOOT_METRICS_LAP(mac);
 
     return result;
 }
@@ -173,57 +486,835 @@ static void processFirmwareData(void)
     usize_t     remainingBytes  = (usize_t)firmwareConfig.firmwareSize;
     uint8_t   * appPtr          = (uint8_t *)MAPPED_APPLICATION_START;
     uint8_t   * dPtr            = (uint8_t *)&firmwareConfig.newKey;
+#ifdef PAGE_PIPELINE
+    uint8_t   * nextPtr;
+#endif
+    uint8_t     length;
 
-    xteaSetKey(&(ctx.cipher.base), bootConfig.key);
+#ifdef SPECK_CIPHER
+    if (isSpeckCipher())
+    {
+        speckSetKey(&speckCtx, bootConfig.key);
+        speckCtx.operation = speckDecrypt;
+    } else
+#endif
+    {
+        xteaSetKey(&(ctx.cipher.base), bootConfig.key);
+    }
     xteaSetIv(&(ctx.cipher), firmwareConfig.cipherIv);
     ctx.cipher.base.rounds = firmwareConfig.cipherRounds;
     ctx.cipher.base.operation = xteaDecrypt;
     ctx.dataLength = 0;
+#ifdef BOOT_METRICS
+    pagesWritten = 0;                                               // no startup code, .bss is not cleared
+    bootMetrics.nvm = 0;
+#endif
+
+    if ((firmwareConfig.mode & FW_MODE_NEWKEY_gm) != FW_MODE_NEWKEY_NONE_gc)
+    {                                                               // if newKey is present in the firmware then decrypt new encryption key
+        cfbDecrypt(&ctx.cipher, dPtr, XTEA_KEY_SIZE);
+    }
+
+#ifdef PAGE_MAC_CHAIN
+    if ((firmwareConfig.mode & FW_MODE_MAC_TYPE_gm) == FW_MODE_MAC_PAGE_CHAIN_gc)
+    {
+        memcpy(&pageCipher, &ctx.cipher, sizeof(pageCipher));      // 'ctx' is needed for page tags
+        if (!processPageChain())
+        {                                                           // forged or damaged page, application is incomplete:
+            commitPage(appPtr, buffer, 0);                          // erase its first page, so it is never started,
+            return;                                                 // and keep the old key
+        }
+    } else
+#endif
+#ifdef LZ_PAYLOAD
+    if (firmwareConfig.rfu[1] == FW_PAYLOAD_LZ)
+    {
+        processCompressedData();
+    } else
+#endif
+#ifdef SPARSE_PAYLOAD
+    if (firmwareConfig.rfu[1] == FW_PAYLOAD_SPARSE)
+    {
+        processSparseData();
+    } else
+#endif
+    {
+#ifdef RESUMABLE_UPDATE
+        usize_t committed = resumeFromJournal(&ctx.cipher, NULL);  // MAC of the whole image is verified anyway,
+        remainingBytes -= committed;                                // only pages already programmed are skipped
+        appPtr += committed;
+        memBeginRead(firmwareAt + sizeof(firmwareConfig) + committed);
+#else
+        memBeginRead(firmwareAt + sizeof(firmwareConfig));
+#endif
+
+        dPtr = (uint8_t *)&buffer;
+#ifdef PAGE_PIPELINE
+        memReadAhead(dPtr, (remainingBytes < MAPPED_PROGMEM_PAGE_SIZE) ? (uint8_t)remainingBytes : MAPPED_PROGMEM_PAGE_SIZE);
+#endif
+        while (remainingBytes && !memFailed)
+        {
+            length = (remainingBytes < MAPPED_PROGMEM_PAGE_SIZE) ? (uint8_t)remainingBytes : MAPPED_PROGMEM_PAGE_SIZE;
+            remainingBytes -= length;
+
+#ifdef PAGE_PIPELINE
+            memReadWait(dPtr + length);                             // page received in the background of the previous one
+            nextPtr = (dPtr == buffer) ? (buffer + MAPPED_PROGMEM_PAGE_SIZE) : buffer;
+            if (remainingBytes)
+            {                                                       // next page is received into the other half of 'buffer'
+                memReadAhead(nextPtr,                               // in the background of decryption and programming of this
+                             (remainingBytes < MAPPED_PROGMEM_PAGE_SIZE) ? (uint8_t)remainingBytes : MAPPED_PROGMEM_PAGE_SIZE);
+            }                                                       // one; this page lies outside the read-ahead window,
+            if ((firmwareConfig.mode & FW_MODE_CIPHER_gm) != FW_MODE_CIPHER_NONE_gc)
+            {                                                       // so XTEA_INPUT_HOOK never waits
+                cfbDecrypt(&ctx.cipher, dPtr, length);
+            }
+#else
+            memReadAhead(dPtr, length);                             // with MEM_READ_AHEAD page is received in the background
+            if ((firmwareConfig.mode & FW_MODE_CIPHER_gm) != FW_MODE_CIPHER_NONE_gc)
+            {                                                       // of decryption, XTEA_INPUT_HOOK waits for every block
+                cfbDecrypt(&ctx.cipher, dPtr, length);              // before it is decrypted in place
+            }
+            memReadWait(dPtr + length);
+#endif
+
+            commitPage(appPtr, dPtr, length);                       // page complete or no more data to write
+            appPtr += MAPPED_PROGMEM_PAGE_SIZE;
+#ifdef PAGE_PIPELINE
+            dPtr = nextPtr;
+#endif
+#ifdef RESUMABLE_UPDATE
+            if (remainingBytes)
+            {
+                updateJournal(appPtr, &ctx.cipher, NULL);
+            }
+#endif
+        }
+
+        memEndRead();
+    }
+
+    if (memFailed)
+    {                                                               // bus failed while programming, application is incomplete:
+        commitPage((uint8_t *)MAPPED_APPLICATION_START, buffer, 0); // erase its first page, so it is never started
+#ifdef RESUMABLE_UPDATE
+        clearJournal();                                             // and start over, the erased page precedes any checkpoint
+#endif
+#ifdef CRC_CHECK
+    } else if (!isApplicationVerified())
+    {                                                               // programmed Flash does not match the checksum:
+        commitPage((uint8_t *)MAPPED_APPLICATION_START, buffer, 0); // erase first page of application and keep the old key
+#endif
+    } else if ((firmwareConfig.mode & FW_MODE_NEWKEY_gm) != FW_MODE_NEWKEY_NONE_gc)
+    {                                                               // new key replaces the old one only for complete firmware
+        memcpy(&bootConfig.key, &firmwareConfig.newKey, XTEA_KEY_SIZE);
+    }
+}
+
+/**
+ * \brief   A function that writes a page of firmware to internal FLASH memory,
+ *          unless the page already holds exactly this content (incremental releases
+ *          usually change only a few pages, and every erase-write costs time and endurance).
+ *          The page is compared and loaded into the NVM page buffer in a single pass;
+ *          part of the page above 'length' is left erased.
+ *
+ * \param[in]   appPtr  mapped address of the FLASH page
+ * \param[in]   data    firmware data of the page (a half of 'buffer' with PAGE_PIPELINE)
+ * \param[in]   length  amount of firmware data
+ *
+ * \return nothing
+ */
+static void commitPage(uint8_t *appPtr, const uint8_t *data, uint8_t length)
+{
+    register uint8_t    idx;
+    register uint8_t    value;
+    register uint8_t    differs = false;
+#ifdef BOOT_METRICS
+    uint16_t            started = RTC.CNT;
+#endif
 
-    twiBeginRead(TWI_MEM_ADDR, TWI_FIRMWARE_AT_ADDR);
+    while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm);                      // previous page must be written before it can be compared
+    for (idx = 0; idx < MAPPED_PROGMEM_PAGE_SIZE; idx++)
+    {
+        value = (idx < length) ? data[idx] : 0xFF;
+        differs |= appPtr[idx] ^ value;                             // mapped FLASH reads return FLASH content, not the page buffer,
+        appPtr[idx] = value;                                        // so each byte is compared before it is loaded
+    }
 
-    if ((firmwareConfig.mode & 0x0C) == 0x04)                       // if newKey is present in the firmware then decrypt new encryption key
+    if (differs)
     {
-        xteaCfbBlock(&ctx.cipher, dPtr);
-        xteaCfbBlock(&ctx.cipher, (dPtr + XTEA_BLOCK_SIZE));
-        memcpy(&bootConfig.key, dPtr, XTEA_KEY_SIZE);
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+#ifdef BOOT_METRICS
+        pagesWritten++;
+#endif
+    } else
+    {                                                               // nothing to program, drop the loaded page buffer
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEBUFCLR_gc);
+    }
+#ifdef BOOT_METRICS
+    bootMetrics.nvm += RTC.CNT - started;                           // including the wait for the previous page
+#endif
+}
+
+/**
+ * \brief   A function that reads data from the sequential read of external memory and adds it
+ *          to the MAC calculation in place, with MEM_READ_AHEAD the following bytes are received while
+ *          XTEA rounds of the current block are computed (see XTEA_ROUND_HOOK and XTEA_INPUT_HOOK).
+ *
+ * \param[out]  data    buffer for read data
+ * \param[in]   length  amount of data to be read
+ *
+ * \return nothing
+ */
+static void macUpdateFromMemory(uint8_t *data, uint8_t length)
+{
+    memReadAhead(data, length);
+#ifdef CHASKEY_MAC
+    if (isChaskeyMac())
+    {
+        chaskeyMacUpdate(&macCtx, data, length);
+    } else
+#endif
+    {
+        xteaCfbMacUpdate(&ctx, data, length);
+    }
+}
+
+/**
+ * \brief   A function that decrypts data in place in CFB mode with the cipher of the firmware
+ *          (XTEA, or Speck64/128 in a build with SPECK_CIPHER). The chaining value is kept
+ *          in 'cipher->iv' for both, so it is saved to the journal and copied for the page chain alike.
+ *
+ * \param[in]       cipher  XTEA cipher context (key and rounds for XTEA, chaining value).
+ * \param[in,out]   data    Data to be decrypted.
+ * \param[in]       length  Size of the data in bytes.
+ *
+ * \return nothing
+ */
+static void cfbDecrypt(xteaCipherCtx_t *cipher, uint8_t *data, uint8_t length)
+{
+#ifdef SPECK_CIPHER
+    if (isSpeckCipher())
+    {
+        speckCfbBuffer(&speckCtx, cipher->iv, data, length);
+    } else
+#endif
+    {
+        xteaCfbBuffer(cipher, data, length);
+    }
+}
+
+#ifdef SPECK_CIPHER
+/**
+ * \brief   Auxiliary function that checks if the new key and firmware are encrypted by Speck64/128
+ *          instead of XTEA (Speck needs only additions, XORs and rotations by 8 and 3 bits).
+ *
+ * \return true if the firmware or new key cipher type is Speck, false otherwise
+ */
+static bool isSpeckCipher(void)
+{
+    return ((firmwareConfig.mode & FW_MODE_CIPHER_gm) == FW_MODE_CIPHER_SPECK_gc)
+           || ((firmwareConfig.mode & FW_MODE_NEWKEY_gm) == FW_MODE_NEWKEY_SPECK_gc);
+}
+#endif
+
+#ifdef CHASKEY_MAC
+/**
+ * \brief   Auxiliary function that checks if the firmware is authenticated by Chaskey MAC
+ *          instead of XTEA CFB-MAC (Chaskey computes several times fewer CPU cycles per byte).
+ *
+ * \return true if MAC type is Chaskey, false otherwise
+ */
+static bool isChaskeyMac(void)
+{
+    return (firmwareConfig.mode & FW_MODE_MAC_TYPE_gm) == FW_MODE_MAC_CHASKEY_gc;
+}
+#endif
+
+#ifdef PAGE_MAC_CHAIN
+/**
+ * \brief   A function that programs firmware stored in the page chained format, in a single pass
+ *          over external memory. Stream layout: T1 | P1 | T2 | P2 | ... | Tn | Pn, where
+ *          Ti = CFB-MAC(Pi | Ti+1) (Tn = CFB-MAC(Pn)) and T1 was signed along with the descriptor.
+ *          Every page is authenticated by the already trusted tag just before it is programmed.
+ *
+ * \return true if all pages were authenticated and programmed, false at first bad page
+ */
+static bool processPageChain(void)
+{
+    usize_t     remainingBytes  = (usize_t)firmwareConfig.firmwareSize;
+    uint8_t   * appPtr          = (uint8_t *)MAPPED_APPLICATION_START;
+    uint8_t     length;
+    uint8_t     result          = true;
+#ifdef RESUMABLE_UPDATE
+    usize_t     committed       = resumeFromJournal(&pageCipher, (uint8_t *)&pageTag);
+
+    remainingBytes -= committed;                                    // only the descriptor and the first page tag are verified
+    appPtr += committed;                                            // again, trusted tag of the next page comes from the journal
+    memBeginRead(firmwareAt + sizeof(firmwareConfig) + XTEA_BLOCK_SIZE
+                 + committed + ((committed / MAPPED_PROGMEM_PAGE_SIZE) * XTEA_BLOCK_SIZE));
+#else
+    memBeginRead(firmwareAt + sizeof(firmwareConfig) + XTEA_BLOCK_SIZE);
+#endif
+
+    while (remainingBytes && result && !memFailed)
+    {
+        length = (remainingBytes < MAPPED_PROGMEM_PAGE_SIZE) ? (uint8_t)remainingBytes : MAPPED_PROGMEM_PAGE_SIZE;
+        remainingBytes -= length;
+
+        xteaCfbMacInit(&ctx, (uint8_t *)&bootConfig.key, firmwareConfig.macRounds);
+        macUpdateFromMemory((uint8_t *)&buffer, length);
+        if (remainingBytes)                                         // tag of the next page is covered by this one,
+        {                                                           // it is received into the unused half of 'firmwareMac'
+            macUpdateFromMemory((uint8_t *)&firmwareConfig.firmwareMac + XTEA_BLOCK_SIZE, XTEA_BLOCK_SIZE);
+        }                                                           // (the MAC itself identifies the image in the journal)
+        xteaCfbMacFinish(&ctx);
+        result = xteaCfbMacCmp(&ctx, (uint8_t *)&pageTag);
+        memcpy(&pageTag, (uint8_t *)&firmwareConfig.firmwareMac + XTEA_BLOCK_SIZE, XTEA_BLOCK_SIZE);
+
+        if (result)
+        {
+            if ((firmwareConfig.mode & FW_MODE_CIPHER_gm) != FW_MODE_CIPHER_NONE_gc)
+            {
+                cfbDecrypt(&pageCipher, (uint8_t *)&buffer, length);
+            }
+            commitPage(appPtr, buffer, length);
+            appPtr += length;
+#ifdef RESUMABLE_UPDATE
+            if (remainingBytes)
+            {
+                updateJournal(appPtr, &pageCipher, (uint8_t *)&pageTag);
+            }
+#endif
+        }
     }
 
-    dPtr = (uint8_t *)&buffer;
-    while (remainingBytes--)
+    memEndRead();
+
+    return result;
+}
+#endif
+
+#ifdef LZ_PAYLOAD
+/**
+ * \brief   A function that reads, decrypts and decompresses LZ compressed firmware
+ *          and writes it to internal FLASH memory. Decompressed stream is made of:
+ *          0x00-0x7F   literal run, followed by 1-128 bytes copied to output,
+ *          0x80-0xFF   match of 3-130 bytes, followed by 16-bit little-endian distance
+ *                      back into already decompressed data.
+ *          There is no window in RAM - matches are copied from the page being assembled
+ *          in 'buffer' or from pages already programmed into FLASH.
+ *
+ * \return nothing
+ */
+static void processCompressedData(void)
+{
+    usize_t     remainingBytes  = (usize_t)firmwareConfig.firmwareSize;
+    usize_t     distance        = 0;
+    uint8_t     count           = 0;
+    uint8_t     state           = LZ_TOKEN;
+    uint8_t     data;
+    uint8_t     idx;
+
+    lzOutPos = 0;
+    memBeginRead(firmwareAt + sizeof(firmwareConfig));
+
+    while (remainingBytes && !memFailed)
     {
-        twiRead((dPtr + ctx.dataLength), TWI_ACK);
-        ctx.dataLength++;
-        if ((ctx.dataLength == XTEA_BLOCK_SIZE) || !remainingBytes)
+        ctx.dataLength = (remainingBytes < XTEA_BLOCK_SIZE) ? (uint8_t)remainingBytes : XTEA_BLOCK_SIZE;
+        remainingBytes -= ctx.dataLength;
+        memReadAhead(ctx.data, ctx.dataLength);
+        if ((firmwareConfig.mode & FW_MODE_CIPHER_gm) != FW_MODE_CIPHER_NONE_gc)
+        {
+            cfbDecrypt(&ctx.cipher, ctx.data, ctx.dataLength);
+        }
+        memReadWait(ctx.data + ctx.dataLength);
+
+        for (idx = 0; idx < ctx.dataLength; idx++)
         {
-            if ((firmwareConfig.mode & 0x03) == 0x01)
+            data = ctx.data[idx];
+            if (state == LZ_LITERAL)
+            {
+                lzPutByte(data);
+                state = (--count) ? LZ_LITERAL : LZ_TOKEN;
+            } else if (state == LZ_DISTANCE_LO)
+            {
+                distance = data;
+                state = LZ_DISTANCE_HI;
+            } else if (state == LZ_DISTANCE_HI)
             {
-                xteaCfbBlock(&ctx.cipher, dPtr);
+                distance |= (usize_t)data << 8;
+                while (count)
+                {
+                    lzPutByte(lzGetByte(lzOutPos - distance));
+                    count--;
+                }
+                state = LZ_TOKEN;
+            } else if (data & 0x80)
+            {
+                count = (data & 0x7F) + LZ_MIN_MATCH;
+                state = LZ_DISTANCE_LO;
+            } else
+            {
+                count = data + 1;
+                state = LZ_LITERAL;
             }
-            memcpy(appPtr, dPtr, ctx.dataLength);
-            appPtr += ctx.dataLength;
-            ctx.dataLength = 0;
         }
+    }
+
+    memEndRead();
+
+    if (lzOutPos % MAPPED_PROGMEM_PAGE_SIZE)                        // commit last, incomplete page
+    {
+        commitPage((uint8_t *)MAPPED_APPLICATION_START + (lzOutPos & ~(usize_t)(MAPPED_PROGMEM_PAGE_SIZE - 1)),
+                   buffer, lzOutPos % MAPPED_PROGMEM_PAGE_SIZE);
+    }
+}
+
+/**
+ * \brief   Auxiliary function that appends a byte to decompressed firmware,
+ *          every completed page is committed to FLASH.
+ *
+ * \param[in]   data    decompressed byte
+ *
+ * \return nothing
+ */
+static void lzPutByte(uint8_t data)
+{
+    if (lzOutPos < MAPPED_APPLICATION_SIZE)                         // never write past application section
+    {
+        buffer[lzOutPos % MAPPED_PROGMEM_PAGE_SIZE] = data;
+        lzOutPos++;
+        if (!(lzOutPos % MAPPED_PROGMEM_PAGE_SIZE))
+        {
+            commitPage((uint8_t *)MAPPED_APPLICATION_START + lzOutPos - MAPPED_PROGMEM_PAGE_SIZE, buffer,
+                       MAPPED_PROGMEM_PAGE_SIZE);
+        }
+    }
+}
+
+/**
+ * \brief   Auxiliary function that returns a byte of already decompressed firmware.
+ *
+ * \param[in]   position    offset from the start of application
+ *
+ * \return byte from the page assembled in 'buffer', or from FLASH for earlier pages
+ */
+static uint8_t lzGetByte(usize_t position)
+{
+    if (position >= (lzOutPos & ~(usize_t)(MAPPED_PROGMEM_PAGE_SIZE - 1)))
+    {
+        return buffer[position % MAPPED_PROGMEM_PAGE_SIZE];
+    }
+
+    while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm);                      // page may still be programmed
+
+    return *((uint8_t *)MAPPED_APPLICATION_START + position);
+}
+#endif
+
+#ifdef SPARSE_PAYLOAD
+/**
+ * \brief   A function that reads and decrypts firmware in the sparse format and writes it
+ *          to internal FLASH memory. Payload is made of groups of FW_SPARSE_GROUP pages:
+ *          a bit mask (bit 0 of the first byte - first page of the group) followed by the data
+ *          of marked pages only. Pages not marked are left erased, so neither the bus
+ *          nor the NVM controller spend time on the gaps between sections of the application.
+ *          The payload ends with the last marked page.
+ *
+ * \return nothing
+ */
+static void processSparseData(void)
+{
+    usize_t     remainingBytes  = (usize_t)firmwareConfig.firmwareSize;
+    uint8_t   * appPtr          = (uint8_t *)MAPPED_APPLICATION_START;
+    uint8_t   * dPtr            = ctx.data;
+    uint8_t     page            = 0;                                // page in the group, 0 - its mask
+    uint8_t     length;
+
+    sparseOutPos = 0;
+    memBeginRead(firmwareAt + sizeof(firmwareConfig));
+
+    while (remainingBytes && !memFailed && (sparseOutPos < MAPPED_APPLICATION_SIZE))
+    {
+        if (!page)
+        {                                                           // mask is as long as an XTEA block,
+            dPtr = ctx.data;                                        // so the pages stay block aligned
+            length = XTEA_BLOCK_SIZE;
+        } else if (ctx.data[(page - 1) / 8] & (1 << ((page - 1) % 8)))
+        {
+            dPtr = (uint8_t *)&buffer;
+            length = MAPPED_PROGMEM_PAGE_SIZE;
+        } else
+        {
+            length = 0;                                             // page is not in the payload
+        }
+        if (length > remainingBytes)
+        {
+            break;
+        }
+        remainingBytes -= length;
 
-        if (!((usize_t)appPtr % MAPPED_PROGMEM_PAGE_SIZE) || !remainingBytes)
-        {   // Page boundary reached or no more data to write, Commit page to Flash
-            while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm);
-            _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+        memReadAhead(dPtr, length);
+        if ((firmwareConfig.mode & FW_MODE_CIPHER_gm) != FW_MODE_CIPHER_NONE_gc)
+        {
+            cfbDecrypt(&ctx.cipher, dPtr, length);
         }
+        memReadWait(dPtr + length);
+
+        if (page)
+        {
+            commitPage(appPtr, buffer, length);                     // page with data, or left erased
+            appPtr += MAPPED_PROGMEM_PAGE_SIZE;
+            sparseOutPos += MAPPED_PROGMEM_PAGE_SIZE;
+        }
+        page = (page < FW_SPARSE_GROUP) ? (page + 1) : 0;
     }
 
-    twiStop();
+    memEndRead();
 }
+#endif
 
 /**
  * \brief   A function that initializes local variables with the data describing firmware
  *          contained in external memory and the key and timestamp data
  *          of current firmware from internal EEPROM of the microcontroller.
+ *          The sequential read of external memory is left open, so that the firmware
+ *          following the descriptor can be read by isFirmwareMacOk() in the same transaction.
  * 
  * \return nothing
  */
 static void loadBootloaderData(void)
 {
-    twiEepromRead(TWI_MEM_ADDR, TWI_CONTROL_DATA_AT, (uint8_t *)&firmwareConfig, sizeof(firmwareConfig));
+    memBeginRead(firmwareAt);
+    memReadBytes((uint8_t *)&firmwareConfig, sizeof(firmwareConfig));
     eeprom_read_block((uint8_t *)&bootConfig, (void *)(MAPPED_EEPROM_SIZE - sizeof(bootConfig)), sizeof(bootConfig));
 }
+
+#ifdef CRC_CHECK
+/**
+ * \brief   A function that checks the programmed application against the checksum from the descriptor,
+ *          CRC-16-CCITT of the 'appEnd' bytes programmed from the image. For the scan at boot the checksum
+ *          of the whole Flash is then computed as it is (pages above the application are not erased)
+ *          and programmed into the last two bytes of Flash, where the application must not reach,
+ *          so that the CRCSCAN result over the whole Flash is zero. Firmware without checksum is not
+ *          checked, neither is it scanned at boot: only the checksum left by the previous one is cleared
+ *          (as it is on mismatch, the application is erased then).
+ *
+ * \return true if the checksum matches or the descriptor has none, false otherwise
+ */
+static bool isApplicationVerified(void)
+{
+    uint8_t   * lastPage    = (uint8_t *)(MAPPED_APPLICATION_START + MAPPED_APPLICATION_SIZE - MAPPED_PROGMEM_PAGE_SIZE);
+    usize_t     appEnd      = (usize_t)firmwareConfig.firmwareSize;
+    uint16_t    checksum    = FW_CRC_NONE;
+    uint8_t     hasChecksum = ((firmwareConfig.rfu[2] & firmwareConfig.rfu[3]) != 0xFF);
+    uint8_t     result      = !hasChecksum;
+
+#ifdef LZ_PAYLOAD
+    if (firmwareConfig.rfu[1] == FW_PAYLOAD_LZ)
+    {
+        appEnd = lzOutPos;                                          // 'firmwareSize' is the size of compressed data
+    }
+#endif
+#ifdef SPARSE_PAYLOAD
+    if (firmwareConfig.rfu[1] == FW_PAYLOAD_SPARSE)
+    {
+        appEnd = sparseOutPos;
+    }
+#endif
+
+    while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm);                      // last page may be still programmed
+    if (hasChecksum && (appEnd <= (MAPPED_APPLICATION_SIZE - sizeof(uint16_t))))
+    {
+        result = (flashCrc(FW_CRC_INIT, (const uint8_t *)MAPPED_APPLICATION_START, appEnd)
+                  == (((uint16_t)firmwareConfig.rfu[2] << 8) | firmwareConfig.rfu[3]));
+    }
+    if (hasChecksum && result)
+    {                                                               // a damaged application gets no checksum to scan at boot
+        checksum = flashCrc(FW_CRC_INIT, (const uint8_t *)MAPPED_PROGMEM_START, MAPPED_PROGMEM_SIZE - sizeof(uint16_t));
+    } else if (*(const uint16_t *)FW_CRC_AT == FW_CRC_NONE)
+    {                                                               // no checksum to store or to clear
+        return result;
+    }
+
+    memcpy(&buffer, lastPage, MAPPED_PROGMEM_PAGE_SIZE);            // last page may hold the end of application
+    buffer[MAPPED_PROGMEM_PAGE_SIZE - 2] = (uint8_t)(checksum >> 8);
+    buffer[MAPPED_PROGMEM_PAGE_SIZE - 1] = (uint8_t)checksum;
+    commitPage(lastPage, buffer, MAPPED_PROGMEM_PAGE_SIZE);
+
+    if (checksum != FW_CRC_NONE)
+    {
+        result = isFlashCrcOk();                                    // checksum of the whole Flash is programmed correctly
+    }
+
+    return result;
+}
+
+/**
+ * \brief   A function that computes CRC-16-CCITT (MSB first, no final XOR, as CRCSCAN) of a part of Flash,
+ *          a byte at a time without a table.
+ *
+ * \param[in]   crc     CRC of preceding data, FW_CRC_INIT at start
+ * \param[in]   data    mapped address of the data
+ * \param[in]   length  amount of data
+ *
+ * \return CRC updated with data
+ */
+static uint16_t flashCrc(uint16_t crc, const uint8_t *data, usize_t length)
+{
+    register uint8_t    x;
+
+    while (length--)
+    {
+        x = (uint8_t)(crc >> 8) ^ *data++;
+        x ^= x >> 4;
+        crc = (uint16_t)((crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x);
+    }
+
+    return crc;
+}
+
+/**
+ * \brief   A function that computes CRC-16-CCITT of the whole Flash with the CRCSCAN peripheral
+ *          in priority mode (the CPU is halted until the scan is complete). The checksum stored
+ *          at the end of Flash is included, so the result is zero for intact Flash.
+ *
+ * \return true if Flash content matches its checksum, false otherwise
+ */
+static bool isFlashCrcOk(void)
+{
+    register uint8_t result;
+
+    while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm);                      // Flash must not be programmed while it is scanned
+    CRCSCAN.CTRLB = CRCSCAN_SRC_FLASH_gc | CRCSCAN_MODE_PRIORITY_gc;
+    CRCSCAN.CTRLA = CRCSCAN_ENABLE_bm;
+    while (CRCSCAN.STATUS & CRCSCAN_BUSY_bm);
+    result = CRCSCAN.STATUS & CRCSCAN_OK_bm;
+    CRCSCAN.CTRLA = CRCSCAN_RESET_bm;                               // scan is not locked (NMIEN is not set), ready for the next one
+
+    return result;
+}
+#endif
+
+#ifdef RESUMABLE_UPDATE
+/**
+ * \brief   A function that reads the journal of an update interrupted by power loss. If it was made
+ *          for the image being loaded, the decryption state [and the trusted tag of the next page]
+ *          are restored, so programming continues from the first page after the checkpoint.
+ *
+ * \param[out]  cipher  firmware decryption context, its IV is set to the state at the checkpoint
+ * \param[out]  tag     trusted tag of the next page, or NULL if not used
+ *
+ * \return number of bytes of application already programmed, 0 to start over
+ */
+static usize_t resumeFromJournal(xteaCipherCtx_t *cipher, uint8_t *tag)
+{
+    bootJournal_t * journal     = (bootJournal_t *)BOOT_JOURNAL_AT;
+    uint32_t        committed   = (uint32_t)eeprom_read_byte(&journal->checkpoint) * (RESUME_PAGES * MAPPED_PROGMEM_PAGE_SIZE);
+
+    eeprom_read_block((uint8_t *)&buffer, journal->id, XTEA_BLOCK_SIZE);
+    if ((committed < firmwareConfig.firmwareSize) && !memcmp(&buffer, &firmwareConfig.firmwareMac, XTEA_BLOCK_SIZE))
+    {                                                               // 'firmwareMac' has just been verified
+        eeprom_read_block(cipher->iv, journal->iv, XTEA_IV_SIZE);
+        if (tag != NULL)
+        {
+            eeprom_read_block(tag, journal->tag, XTEA_BLOCK_SIZE);
+        }
+    } else
+    {
+        committed = 0;
+    }
+
+    return (usize_t)committed;
+}
+
+/**
+ * \brief   A function that records progress of the update every RESUME_PAGES pages (EEPROM wear
+ *          and write time stay low, at most RESUME_PAGES - 1 pages are processed again after power loss).
+ *
+ * \param[in]   appPtr  mapped address of the first page not programmed yet
+ * \param[in]   cipher  firmware decryption context after the programmed pages
+ * \param[in]   tag     trusted tag of the next page, or NULL if not used
+ *
+ * \return nothing
+ */
+static void updateJournal(const uint8_t *appPtr, const xteaCipherCtx_t *cipher, const uint8_t *tag)
+{
+    bootJournal_t * journal = (bootJournal_t *)BOOT_JOURNAL_AT;
+    uint16_t        pages   = (uint16_t)((appPtr - (uint8_t *)MAPPED_APPLICATION_START) / MAPPED_PROGMEM_PAGE_SIZE);
+
+    if (!(pages % RESUME_PAGES) && !memFailed)
+    {
+        while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm);                  // recorded pages must be programmed already
+        eeprom_update_byte(&journal->checkpoint, 0);
+        eeprom_update_block(&firmwareConfig.firmwareMac, journal->id, XTEA_BLOCK_SIZE);
+        eeprom_update_block(cipher->iv, journal->iv, XTEA_IV_SIZE);
+        if (tag != NULL)
+        {
+            eeprom_update_block(tag, journal->tag, XTEA_BLOCK_SIZE);
+        }
+        eeprom_update_byte(&journal->checkpoint, (uint8_t)(pages / RESUME_PAGES));
+        eeprom_busy_wait();
+    }
+}
+
+/**
+ * \brief   A function that marks the journal as empty, after a completed update or when the application
+ *          has to be programmed from the start.
+ *
+ * \return nothing
+ */
+static void clearJournal(void)
+{
+    eeprom_update_byte(&((bootJournal_t *)BOOT_JOURNAL_AT)->checkpoint, 0);
+}
+#endif
+
+#ifdef BOOT_METRICS
+/**
+ * \brief   A function that starts the RTC from the internal 32.768 kHz oscillator as the time base of phase timing
+ *          (the RTC is not used by the bootloader otherwise, and it is in reset state at this point).
+ *
+ * \return nothing
+ */
+static void metricsStart(void)
+{
+    RTC.CLKSEL = RTC_CLKSEL_INT32K_gc;
+    RTC.CTRLA = BOOT_METRICS_PRESCALER | RTC_RTCEN_bm;
+    metricsLapAt = 0;
+}
+
+/**
+ * \brief   A function that ends the current phase.
+ *
+ * \return  RTC ticks since the end of the previous phase
+ */
+static uint16_t metricsLap(void)
+{
+    uint16_t now    = RTC.CNT;
+    uint16_t result = now - metricsLapAt;
+
+    metricsLapAt = now;
+
+    return result;
+}
+
+/**
+ * \brief   A function that returns the RTC to reset state before starting application
+ *          (after an update the software reset does it).
+ *
+ * \return nothing
+ */
+static void metricsStop(void)
+{
+    while (RTC.STATUS & RTC_CTRLABUSY_bm);
+    RTC.CTRLA = 0;
+    while (RTC.STATUS & RTC_CNTBUSY_bm);
+    RTC.CNT = 0;
+    while (RTC.STATUS & RTC_CNTBUSY_bm);
+}
+#endif
+
+#ifdef BOOT_SERVICES
+/**
+ * \brief   Table of services for the application (see boot_services.h), placed at BOOT_SERVICES_AT
+ *          by the linker. XTEA functions are wrapped: they find the state of the memory bus (read-ahead window
+ *          polled by XTEA_ROUND_HOOK and XTEA_INPUT_HOOK) in the shared RAM, which holds whatever the application
+ *          left there, so the window is closed before they are called.
+ */
+const bootServices_t bootServices BOOT_SERVICES_SECTION =
+{
+    .version        = BOOT_SERVICES_VERSION,
+    .size           = sizeof(bootServices_t),
+    .cipherCtxSize  = sizeof(xteaCipherCtx_t),
+    .macCtxSize     = sizeof(xteaCtx_t),
+    .memoryInit     = serviceMemInit,
+    .memoryRead     = serviceMemRead,
+    .memoryRelease  = serviceMemRelease,
+    .setKey         = serviceSetKey,
+    .cfbBlock       = serviceCfbBlock,
+    .macInit        = serviceMacInit,
+    .macUpdate      = serviceMacUpdate,
+    .macFinish      = serviceMacFinish
+};
+
+_Static_assert(sizeof(memState_t) <= BOOT_SERVICES_RAM_SIZE, "state of the memory bus exceeds BOOT_SERVICES_RAM_SIZE");
+#ifndef CRYPTBOOT_SIM
+_Static_assert(sizeof(bootServices_t) <= BOOT_SERVICES_SIZE, "table of services exceeds BOOT_SERVICES_SIZE");
+#endif
+
+/**
+ * \brief   Service: initializes the memory bus. The read-ahead window is closed,
+ *          so that XTEA services called by the application do not touch the bus.
+ *
+ * \return true if the memory answered, false otherwise
+ */
+static bool serviceMemInit(void)
+{
+    memInit();
+    memReadAhead(NULL, 0);
+
+    return !memFailed;
+}
+
+/**
+ * \brief   Service: reads data from external memory in a single sequential read.
+ *
+ * \param[in]   address     address of the first byte to be read
+ * \param[out]  data        buffer for read data
+ * \param[in]   length      amount of data to be read, 1-255 bytes
+ *
+ * \return true if the data has been read, false if the bus failed
+ */
+static bool serviceMemRead(uint32_t address, uint8_t *data, uint8_t length)
+{
+    memRead((memAddr_t)address, data, length);
+
+    return !memFailed;
+}
+
+/**
+ * \brief   Service: returns the memory bus to its reset state.
+ *
+ * \return nothing
+ */
+static void serviceMemRelease(void)
+{
+    memRelease();
+}
+
+/**
+ * \brief   Services: xteaSetKey(), xteaCfbBlock(), xteaCfbMacInit(), xteaCfbMacUpdate() and xteaCfbMacFinish()
+ *          with the read-ahead window closed, so that the hooks neither wait for nor take bytes of the bus.
+ */
+static void serviceSetKey(struct xteaEcbCtx *ctx, const uint8_t key[])
+{
+    memReadAhead(NULL, 0);
+    xteaSetKey(ctx, key);
+}
+
+static void serviceCfbBlock(struct xteaCipherCtx *ctx, uint8_t data[])
+{
+    memReadAhead(NULL, 0);
+    xteaCfbBlock(ctx, data);
+}
+
+static void serviceMacInit(struct xteaCtx *ctx, const uint8_t key[], const uint_fast8_t rounds)
+{
+    memReadAhead(NULL, 0);
+    xteaCfbMacInit(ctx, key, rounds);
+}
+
+static void serviceMacUpdate(struct xteaCtx *ctx, const uint8_t data[], const uint32_t length)
+{
+    memReadAhead(NULL, 0);
+    xteaCfbMacUpdate(ctx, data, length);
+}
+
+static void serviceMacFinish(struct xteaCtx *ctx)
+{
+    memReadAhead(NULL, 0);
+    xteaCfbMacFinish(ctx);
+}
+#endif
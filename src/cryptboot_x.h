@@ -15,6 +15,7 @@
 /* Memory configuration
  * BOOTEND_FUSE * 256 must be above Bootloader Program Memory Usage,
  * this is less than 2048 bytes at optimization level -Os, so BOOTEND_FUSE = 0x08
+ * (BOOT_SECTION_SIZE in Makefile must match it, the build fails if the code does not fit)
  */
 #define BOOTEND_FUSE                0x08
 #define BOOT_SIZE                   (BOOTEND_FUSE * 0x100)
@@ -25,17 +26,135 @@
 #define F_CPU                       10000000UL
 #define F_SCL                       400000UL
 #define T_RISE                      300UL
+#define F_SCK                       (F_CPU / 2)         // SPI_STORAGE
 #define TWI_MEM_ADDR                0xA0
 #define TWI_MEM_PAGE_SIZE           0x40
 #define TWI_FIRMWARE_AT_ADDR        BOOT_SIZE
 #define TWI_CONTROL_DATA_AT         TWI_FIRMWARE_AT_ADDR-TWI_MEM_PAGE_SIZE
+#define TWI_DIRECTORY_AT            0x0000
 
+#ifndef CRYPTBOOT_SIM
 #include <avr/eeprom.h>
 #include <avr/io.h>
+
+#define BOOT_ENTRY                  __attribute__((naked)) __attribute__((section(".ctors")))
+#define BOOT_NOINLINE               __attribute__((noinline))   // shared by the fast path and the full check
+#ifndef BOOT_SERVICES
+#define BOOT_CPU_INIT()             asm volatile("clr r1")
+#else                                                   // stack below the RAM shared with the application
+#define BOOT_CPU_INIT()             do { asm volatile("clr r1"); SP = BOOT_SERVICES_STACK_TOP; } while (0)
+#define BOOT_SERVICES_SECTION       __attribute__((used)) __attribute__((section(".bootservices")))
+#endif
+#define BOOT_APP_START()            __asm__ __volatile__ (APP_START_JUMP)
+#else
+// registers, memories and boot entry/exit of the host simulation harness (host/sim)
+#include "avr_sim.h"
+#endif
 #include <stdbool.h>
+#include <stddef.h>
 
+/* External memory backend
+ * memInit()                        initialize the bus, memFailed is set if no memory is present
+ * memBeginRead(address)            begin sequential read at the address, false if it could not be started
+ * memReadBytes(data, length)       read the next bytes of the sequential read
+ * memReadAhead/Poll/Wait           receive the next bytes in the background of computation (MEM_READ_AHEAD),
+ *                                  otherwise memReadAhead() reads them at once and memReadWait() does nothing
+ * memEndRead()                     end the sequential read
+ * memRead(address, data, length)   read bytes at the address in a single sequential read
+ * memRelease()                     return the bus to reset state before starting application
+ * TWI/I2C serial EEPROM (24Cxx) by default, SPI NOR flash (W25Qxx) with SPI_STORAGE.
+ */
+// state of the memory bus is shared with the application (BOOT_SERVICES, see boot_services.h)
+#ifdef BOOT_SERVICES
+#include "boot_services.h"
+#define TWI_STATE_AT                BOOT_SERVICES_RAM_AT
+#define SPI_STATE_AT                BOOT_SERVICES_RAM_AT
+#endif
+#ifdef MEM_READ_AHEAD
+#define TWI_READ_AHEAD
+#define SPI_READ_AHEAD
+#endif
+#ifndef SPI_STORAGE
 #include "twi_1.h"
+
+typedef twiAddr_t                   memAddr_t;
+typedef twiState_t                  memState_t;
+#define memFailed                   twiFailed
+#define memInit()                   twiInit(TWI_BAUD(F_CPU, F_SCL, T_RISE))
+#define memBeginRead(address)       twiBeginRead(TWI_MEM_ADDR, address)
+#define memReadBytes(data, length)  twiReadBytes(data, length)
+#ifdef MEM_READ_AHEAD
+#define memReadAhead(data, length)  twiReadAhead(data, length)
+#define memReadPoll()               twiReadPoll()
+#define memReadWait(upTo)           twiReadWait(upTo)
+#else
+#define memReadAhead(data, length)  twiReadBytes(data, length)
+#define memReadWait(upTo)
+#endif
+#define memEndRead()                twiStop()
+#define memRead(address, data, length) twiEepromRead(TWI_MEM_ADDR, address, data, length)
+#define memRelease()                twiRelease()
+#else
+#include "spi_1.h"
+
+typedef spiAddr_t                   memAddr_t;
+typedef spiState_t                  memState_t;
+#define memFailed                   spiFailed
+#define memInit()                   spiInit()
+#define memBeginRead(address)       spiBeginRead(address)
+#define memReadBytes(data, length)  spiReadBytes(data, length)
+#ifdef MEM_READ_AHEAD
+#define memReadAhead(data, length)  spiReadAhead(data, length)
+#define memReadPoll()               spiReadPoll()
+#define memReadWait(upTo)           spiReadWait(upTo)
+#else
+#define memReadAhead(data, length)  spiReadBytes(data, length)
+#define memReadWait(upTo)
+#endif
+#define memEndRead()                spiStop()
+#define memRead(address, data, length) spiFlashRead(address, data, length)
+#define memRelease()                spiRelease()
+#endif
+
+// reception of external memory data continues in the background of XTEA computation
+#ifdef MEM_READ_AHEAD
+#ifndef XTEA_ROUND_HOOK
+#define XTEA_ROUND_HOOK()           memReadPoll()
+#endif
+#ifndef XTEA_INPUT_HOOK
+#define XTEA_INPUT_HOOK(end)        memReadWait(end)
+#endif
+#elif defined(PAGE_PIPELINE)
+    #error "PAGE_PIPELINE receives the next page in the background, it needs MEM_READ_AHEAD !!!"
+#endif
+
 #include "xtea.h"
+// round keys are in the bootloader's context and in the decryption context of page chained images
+#if defined(XTEA_KEY_SCHEDULE) && defined(PAGE_MAC_CHAIN) && defined(INTERNAL_SRAM_SIZE) && (INTERNAL_SRAM_SIZE <= 1024)
+    #error "XTEA_KEY_SCHEDULE with PAGE_MAC_CHAIN takes 16 * XTEA_SCHEDULE_ROUNDS bytes, too much for 1 KB of RAM !!!"
+#endif
+#ifdef CHASKEY_MAC
+#ifdef MEM_READ_AHEAD
+#ifndef CHASKEY_ROUND_HOOK
+#define CHASKEY_ROUND_HOOK()        memReadPoll()
+#endif
+#ifndef CHASKEY_INPUT_HOOK
+#define CHASKEY_INPUT_HOOK(end)     memReadWait(end)
+#endif
+#endif
+#include "chaskey.h"
+#endif
+#ifdef SPECK_CIPHER
+#ifdef MEM_READ_AHEAD
+#ifndef SPECK_ROUND_HOOK
+#define SPECK_ROUND_HOOK()          memReadPoll()
+#endif
+#ifndef SPECK_INPUT_HOOK
+#define SPECK_INPUT_HOOK(end)       memReadWait(end)
+#endif
+#endif
+#include "speck.h"
+#endif
 
 // workaround for wrong version of <avr/eeprom.h> when compiling on Linux
 #if defined (NVMCTRL_STATUS) && defined (eeprom_is_ready)
@@ -46,6 +165,8 @@
 // Fuse configuration
 // BOOTEND sets the size (end) of the boot section in blocks of 256 bytes.
 // APPEND = 0x00 defines the section from BOOTEND * 256 to end of Flash as application code.
+// CRCSRC stays NOCRC also with CRC_CHECK: a failed scan started by the fuse would halt the device
+// before the bootloader could repair the application, so the bootloader starts the scan itself.
 // Remaining fuses have default configuration.
 FUSES = {
     .OSCCFG = FREQSEL_20MHZ_gc,
@@ -63,6 +184,62 @@ FUSES = {
 
 LOCKBITS = (LB_RWLOCK_gc);
 
+// firmwareCfg_t.mode bit fields (full description in firmware_creator.py)
+#define FW_MODE_CIPHER_gm           0x03                // firmware cipher type
+#define FW_MODE_CIPHER_NONE_gc      0x00
+#define FW_MODE_CIPHER_XTEA_gc      0x01
+#define FW_MODE_CIPHER_SPECK_gc     0x03                // Speck64/128 in CFB mode (SPECK_CIPHER), 'cipherRounds' - SPECK_ROUNDS
+#define FW_MODE_NEWKEY_gm           0x0C                // new key cipher type
+#define FW_MODE_NEWKEY_NONE_gc      0x00
+#define FW_MODE_NEWKEY_XTEA_gc      0x04
+#define FW_MODE_NEWKEY_SPECK_gc     0x0C                // new key and firmware are one CFB chain of the same cipher
+#define FW_MODE_MAC_SIZE_gm         0x30                // MAC size
+#define FW_MODE_MAC_TYPE_gm         0xC0                // MAC type
+#define FW_MODE_MAC_CFB_XTEA_gc     0x00                // CFB-MAC [XTEA] over descriptor and whole firmware
+#define FW_MODE_MAC_CHASKEY_gc      0x80                // Chaskey MAC over descriptor and whole firmware (CHASKEY_MAC),
+                                                        // 'macRounds' - permutation rounds, at least CHASKEY_ROUNDS
+#define FW_MODE_MAC_PAGE_CHAIN_gc   0xC0                // CFB-MAC [XTEA] over descriptor and first page tag,
+                                                        // every page authenticated by its own tag (PAGE_MAC_CHAIN)
+#define FW_MODE_SUPPORTED_gm        (FW_MODE_CIPHER_XTEA_gc | FW_MODE_NEWKEY_XTEA_gc)
+
+// firmwareCfg_t.rfu[1] - payload format
+#define FW_PAYLOAD_PLAIN            0xFF
+#define FW_PAYLOAD_LZ               0x01                // LZ compressed before encryption (LZ_PAYLOAD)
+#define FW_PAYLOAD_SPARSE           0x02                // only pages with data (SPARSE_PAYLOAD), groups of
+                                                        // FW_SPARSE_GROUP pages from application start, each
+                                                        // a bit mask (LSB first) followed by the marked pages,
+                                                        // rfu[0] - page size in XTEA blocks
+#define FW_SPARSE_GROUP             (8 * XTEA_BLOCK_SIZE)
+
+// firmwareCfg_t.rfu[2..3] - CRC-16-CCITT of the programmed application (CRC_CHECK), big-endian; the bootloader
+// stores the checksum of the whole Flash in its last two bytes, so that the CRCSCAN result over it is zero
+#define FW_CRC_NONE                 0xFFFF
+#define FW_CRC_INIT                 0xFFFF
+#define FW_CRC_AT                   (MAPPED_PROGMEM_START + MAPPED_PROGMEM_SIZE - sizeof(uint16_t))
+
+#ifdef CRC_CHECK_ON_BOOT
+#ifndef CRC_CHECK
+#define CRC_CHECK
+#endif
+#endif
+
+// phase timing (BOOT_METRICS) compiles out entirely without it
+#ifdef BOOT_METRICS
+#ifndef BOOT_METRICS_PRESCALER
+#define BOOT_METRICS_PRESCALER      RTC_PRESCALER_DIV32_gc
+#endif
+#define BOOT_METRICS_LAP(phase)     (bootMetrics.phase = metricsLap())
+#else
+#define BOOT_METRICS_LAP(phase)
+#endif
+
+// LZ decompressor states
+#define LZ_TOKEN                    0
+#define LZ_LITERAL                  1
+#define LZ_DISTANCE_LO              2
+#define LZ_DISTANCE_HI              3
+#define LZ_MIN_MATCH                3
+
 #ifndef BIG_FIRMWARE
 typedef uint16_t usize_t;
 #else
@@ -75,6 +252,48 @@ typedef struct bootCfg
     uint32_t                        timeStamp;
 } bootCfg_t;
 
+// image directory (FW_SLOTS): FW_SLOTS addresses of firmware descriptors (uint32_t, little-endian) at TWI_DIRECTORY_AT,
+// 0xFFFFFFFF marks an unused slot; firmware follows its descriptor, a slot must not cross a 64 KB block of memory.
+// The newest slot (highest time stamp) is the candidate for update, with no slot used it is TWI_CONTROL_DATA_AT.
+#define FW_SLOT_UNUSED              0xFFFFFFFF
+
+// Internal EEPROM used by the bootloader, from its end down (README.md, "Internal EEPROM"); the addresses do not
+// depend on the build options, a part is only written by the option that uses it:
+// number of FLASH pages actually erase-written by the last update (BOOT_METRICS, uint16_t just below bootCfg_t)
+#define BOOT_PAGES_WRITTEN_AT       (MAPPED_EEPROM_SIZE - sizeof(bootCfg_t) - sizeof(uint16_t))
+
+// progress of an update interrupted by power loss (RESUMABLE_UPDATE), in internal EEPROM just below the pages written.
+// Written every RESUME_PAGES committed pages: 'checkpoint' is cleared first and set last, so a checkpoint torn
+// by power loss reads as 0 (start over). 'id' is the verified MAC of the image, a different image starts over.
+#ifndef RESUME_PAGES
+#define RESUME_PAGES                16
+#endif
+
+typedef struct bootJournal
+{
+    uint8_t                         id[XTEA_BLOCK_SIZE];
+    uint8_t                         iv[XTEA_IV_SIZE];       // firmware decryption state after the committed pages
+    uint8_t                         tag[XTEA_BLOCK_SIZE];   // trusted tag of the next page (page chained images)
+    uint8_t                         checkpoint;             // committed pages / RESUME_PAGES, 0 - nothing to resume
+} bootJournal_t;
+
+#define BOOT_JOURNAL_AT             (BOOT_PAGES_WRITTEN_AT - sizeof(bootJournal_t))
+
+// phase times of the last update (BOOT_METRICS), in internal EEPROM just below bootJournal_t, for the application
+// to report. Written along with the pages written count, in ticks of the RTC clocked by the internal 32.768 kHz
+// oscillator and divided by BOOT_METRICS_PRESCALER (1/1024 s by default, so a phase may last up to 64 s).
+typedef struct bootMetrics
+{
+    uint16_t                        probe;          // memory interface start and fast path: [directory,] descriptor
+                                                    // fields and stored time stamp [, CRC scan of the application]
+    uint16_t                        header;         // whole descriptor read and checked
+    uint16_t                        mac;            // firmware MAC verified
+    uint16_t                        program;        // firmware decrypted and programmed [, programmed Flash checked]
+    uint16_t                        nvm;            // part of 'program' spent on page erase-writes
+} bootMetrics_t;
+
+#define BOOT_METRICS_AT             (BOOT_JOURNAL_AT - sizeof(bootMetrics_t))
+
 typedef struct firmwareCfg
 {
     uint8_t                         firmwareMac[2 * XTEA_BLOCK_SIZE];
@@ -85,7 +304,10 @@ typedef struct firmwareCfg
     uint32_t                        timeStamp;
     uint32_t                        firmwareSize;
     uint8_t                         cipherIv[2 * XTEA_IV_SIZE];
-    uint8_t                         rfu[4];
+    uint8_t                         rfu[4];         // rfu[0] - page size in XTEA blocks for FW_MODE_MAC_PAGE_CHAIN_gc
+                                                    //          and FW_PAYLOAD_SPARSE
+                                                    // rfu[1] - payload format (FW_PAYLOAD_*)
+                                                    // rfu[2..3] - application checksum, big-endian
     uint8_t                         newKey[XTEA_KEY_SIZE];
 } firmwareCfg_t;                //  64 bytes length
 
@@ -0,0 +1,234 @@
+/**
+ * \file speck.h
+ * \brief Speck64/128 block cipher library (CFB mode), size-optimized.
+ *        R. Beaulieu et al., "The SIMON and SPECK Families of Lightweight Block Ciphers", 2013.
+ *        64-bit block and 128-bit key as XTEA, words in little-endian byte order (as on AVR).
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 by Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef SPECK_H_
+#define SPECK_H_
+
+#include <stdbool.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SPECK_BLOCK_SIZE    8
+#define SPECK_IV_SIZE       SPECK_BLOCK_SIZE
+#define SPECK_KEY_SIZE      16
+
+// number of rounds of Speck64/128, fixed by the key schedule
+#define SPECK_ROUNDS        27
+
+// hook called once per block with the number of rounds, used by the host simulation to account CPU time
+#ifndef SPECK_BLOCK_HOOK
+#define SPECK_BLOCK_HOOK(rounds)
+#endif
+
+// hook called once per round, as XTEA_ROUND_HOOK() of xtea.h
+#ifndef SPECK_ROUND_HOOK
+#define SPECK_ROUND_HOOK()
+#endif
+
+// hook called by buffer-level functions with the end of input data needed for the next block,
+// as XTEA_INPUT_HOOK() of xtea.h
+#ifndef SPECK_INPUT_HOOK
+#define SPECK_INPUT_HOOK(end)
+#endif
+
+/**
+ *  \brief Cipher operation type.
+ */
+typedef enum speckOperation
+{
+    speckEncrypt = 0x00,
+    speckDecrypt = 0x01
+} speckOperation_t;
+
+/**
+ * \brief Speck context: round keys and operation. The CFB chaining value (IV) is kept by the caller,
+ *        so that it can be stored and restored independently of the round keys.
+ */
+typedef struct speckCtx
+{
+    /// Round keys computed from 128-bit key.
+    uint32_t            roundKey[SPECK_ROUNDS];
+    /// Type of operation to be performed by cipher.
+    speckOperation_t    operation;
+} speckCtx_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+static void speckSetKey        (speckCtx_t *ctx, const uint8_t key[SPECK_KEY_SIZE]);
+static void speckEcbEncrypt    (const speckCtx_t *ctx, const uint8_t input[SPECK_BLOCK_SIZE], uint8_t output[SPECK_BLOCK_SIZE]);
+static void speckCfbBytes      (const speckCtx_t *ctx, uint8_t iv[SPECK_IV_SIZE], uint8_t data[], uint_fast8_t length);
+static void speckCfbBuffer     (const speckCtx_t *ctx, uint8_t iv[SPECK_IV_SIZE], uint8_t data[], size_t length);
+
+/**
+ * \brief 32-bit rotations.
+ */
+static inline uint32_t speckRotl(const uint32_t value, const uint_fast8_t shift)
+{
+    return (value << shift) | (value >> (32 - shift));
+}
+
+static inline uint32_t speckRotr(const uint32_t value, const uint_fast8_t shift)
+{
+    return (value >> shift) | (value << (32 - shift));
+}
+
+/**
+ * \brief Load/store 32-bit word in little-endian byte order.
+ */
+static inline uint32_t speckLoad(const uint8_t *src)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t    value;
+
+    memcpy(&value, src, sizeof(value));
+    return value;
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+#else
+    #error "Unsupported hardware !!!"
+#endif
+}
+
+static inline void speckStore(uint8_t *dst, const uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(dst, &value, sizeof(value));
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    dst[0] = (uint8_t)(value);
+    dst[1] = (uint8_t)(value >> 8);
+    dst[2] = (uint8_t)(value >> 16);
+    dst[3] = (uint8_t)(value >> 24);
+#else
+    #error "Unsupported hardware !!!"
+#endif
+}
+
+/**
+ * \brief A function that computes round keys from a key: k[i + 1] = (k[i] <<< 3) ^ l[i + 3],
+ *        where l[i + 3] = (k[i] + (l[i] >>> 8)) ^ i, key = k[0] | l[0] | l[1] | l[2].
+ *
+ * \param[in]   ctx     Speck context.
+ * \param[in]   key     128-bit [16 bytes] cipher key.
+ *
+ * \return nothing
+ */
+static void speckSetKey(speckCtx_t *ctx, const uint8_t key[SPECK_KEY_SIZE])
+{
+    uint32_t                k = speckLoad(key);
+    uint32_t                l[3];
+    register uint_fast8_t   idx;
+
+    l[0] = speckLoad(key + 4);
+    l[1] = speckLoad(key + 8);
+    l[2] = speckLoad(key + 12);
+    for (idx = 0; idx < SPECK_ROUNDS; idx++)
+    {
+        ctx->roundKey[idx] = k;
+        l[idx % 3] = (k + speckRotr(l[idx % 3], 8)) ^ idx;
+        k = speckRotl(k, 3) ^ l[idx % 3];
+    }
+}
+
+/**
+ * \brief Base function to encrypt a data block in the ECB mode.
+ *
+ * \param[in]   ctx     Speck context (round keys).
+ * \param[in]   input   64-bit [8 bytes] data block to encrypt.
+ * \param[out]  output  64-bit [8 bytes] block of encrypted data, may be the same as 'input'.
+ *
+ * \return Processed data is returned by the 'output' parameter.
+ */
+static void speckEcbEncrypt(const speckCtx_t *ctx, const uint8_t input[SPECK_BLOCK_SIZE], uint8_t output[SPECK_BLOCK_SIZE])
+{
+    const uint32_t        * roundKey = ctx->roundKey;
+    register uint32_t       y = speckLoad(input);
+    register uint32_t       x = speckLoad(input + 4);
+    register uint_fast8_t   rounds = SPECK_ROUNDS;
+
+    SPECK_BLOCK_HOOK(rounds);
+    while (rounds--)
+    {
+        x = (speckRotr(x, 8) + y) ^ *roundKey++;
+        y = speckRotl(y, 3) ^ x;
+        SPECK_ROUND_HOOK();
+    }
+    speckStore(output, y);
+    speckStore(output + 4, x);
+}
+
+/**
+ * \brief   Function that encrypts/decrypts up to one block of data in CFB mode.
+ *          A partial block (last block of a message) uses only 'length' bytes of the key stream,
+ *          bytes of 'data' above 'length' are not accessed.
+ *
+ * \param[in]       ctx     Speck context.
+ * \param[in,out]   iv      64-bit [8 bytes] chaining value, updated by the function.
+ * \param[in,out]   data    Data processed by the function.
+ * \param[in]       length  Size of the data, 1-8 bytes.
+ *
+ * \return Processed data is returned by the 'data' parameter.
+ */
+static void speckCfbBytes(const speckCtx_t *ctx, uint8_t iv[SPECK_IV_SIZE], uint8_t data[], uint_fast8_t length)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+
+    register uint_fast8_t idx   = length;
+    register uint_fast8_t vTmp;
+
+    speckEcbEncrypt(ctx, iv, iv);
+
+    while (idx--)
+    {
+        vTmp = data[idx];
+        data[idx] ^= iv[idx];
+        iv[idx] = (speckEncrypt == ctx->operation) ? data[idx] : vTmp;
+    }
+}
+
+/**
+ * \brief   Function that encrypts/decrypts a buffer of any length in place in CFB mode,
+ *          block after block, without copying the data.
+ *
+ * \param[in]       ctx     Speck context.
+ * \param[in,out]   iv      64-bit [8 bytes] chaining value, updated by the function.
+ * \param[in,out]   data    Data processed by the function.
+ * \param[in]       length  Size of the data in bytes.
+ *
+ * \return Processed data is returned by the 'data' parameter.
+ */
+static void speckCfbBuffer(const speckCtx_t *ctx, uint8_t iv[SPECK_IV_SIZE], uint8_t data[], size_t length)
+{
+    register uint_fast8_t   size;
+
+    while (length)
+    {
+        size = (length < SPECK_BLOCK_SIZE) ? (uint_fast8_t)length : SPECK_BLOCK_SIZE;
+        SPECK_INPUT_HOOK(data + size);
+        speckCfbBytes(ctx, iv, data, size);
+        data += size;
+        length -= size;
+    }
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // SPECK_H_
@@ -0,0 +1,405 @@
+/**
+ * \file    spi_1.h
+ * \brief   Library for reading SPI NOR flash memory (W25Qxx and compatible) in Master mode
+ *          for tinyAVR 0-, 1- and 2-series, and megaAVR 0-series.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef SPI_1_H_
+#define SPI_1_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifndef CRYPTBOOT_SIM
+#include <avr/io.h>
+#endif
+
+#define SPI_CMD_READ                0x03                            // READ DATA, no dummy byte
+#define SPI_CMD_FAST_READ           0x0B                            // FAST READ, one dummy byte after the address
+#define SPI_CMD_JEDEC_ID            0x9F
+#define SPI_CMD_RELEASE_POWER_DOWN  0xAB
+#define SPI_DUMMY                   0xFF
+
+/**
+ * \brief   READ DATA is specified up to 50 MHz on W25Qxx parts, far above any SCK of the AVR,
+ *          so it is used unless SPI_FAST_READ is defined (parts that support FAST READ only).
+ */
+#ifdef SPI_FAST_READ
+#define SPI_READ_CMD                SPI_CMD_FAST_READ
+#else
+#define SPI_READ_CMD                SPI_CMD_READ
+#endif
+
+/**
+ * \brief   Pins of SPI0 at their default (PORTMUX) location, chip select is a GPIO
+ *          (SS of SPI0 by default, it may be moved with SPI_CS_bm).
+ */
+#if defined(__AVR_ATmega4808__) || defined(__AVR_ATmega4809__) || \
+    defined(__AVR_ATmega3208__) || defined(__AVR_ATmega3209__) || \
+    defined(__AVR_ATmega1608__) || defined(__AVR_ATmega1609__)
+#define SPI_PORT                    PORTA
+#define SPI_MOSI_bm                 PIN4_bm
+#define SPI_MISO_PINCTRL            PORTA_PIN5CTRL
+#define SPI_SCK_bm                  PIN6_bm
+#ifndef SPI_CS_bm
+#define SPI_CS_bm                   PIN7_bm
+#endif
+#else
+#define SPI_PORT                    PORTA
+#define SPI_MOSI_bm                 PIN1_bm
+#define SPI_MISO_PINCTRL            PORTA_PIN2CTRL
+#define SPI_SCK_bm                  PIN3_bm
+#ifndef SPI_CS_bm
+#define SPI_CS_bm                   PIN4_bm
+#endif
+#endif
+
+/**
+ * \brief   Memory cell address, 24 bits are sent to the memory (up to 16 MB).
+ */
+typedef uint32_t    spiAddr_t;
+
+static void spiInit(void);
+static void spiSelect(void);
+static void spiDeselect(void);
+static void spiSend(uint8_t data);
+static void spiWait(void);
+static uint8_t spiReceive(void);
+static void spiRelease(void);
+static uint8_t spiTransfer(uint8_t data);
+static bool isFlashOnBus(void);
+static void spiFlashRead(const spiAddr_t address, uint8_t *data, uint8_t length);
+static bool spiBeginRead(const spiAddr_t address);
+static void spiReadBytes(uint8_t *data, uint8_t length);
+static void spiStop(void);
+#ifdef SPI_READ_AHEAD
+static uint8_t spiStatus(void);
+static void spiReadAhead(uint8_t *data, uint8_t length);
+static void spiReadPoll(void);
+static void spiReadWait(const uint8_t *upTo);
+#endif
+
+/**
+ * \brief   State of the bus. It is kept at the fixed RAM address SPI_STATE_AT if that is defined,
+ *          so that code running from another image (see boot_services.h) finds it at the same place.
+ */
+typedef struct spiState
+{
+    uint8_t       * aheadBase;                                      // read-ahead window, see spiReadAhead()
+    uint8_t         aheadLength;
+    uint8_t         aheadCount;                                     // bytes of the window received so far
+    uint8_t         failed;                                         // no memory answered, cleared by spiInit()
+} spiState_t;
+
+#ifndef SPI_STATE_AT
+static spiState_t   spiState;
+#else
+#define spiState            (*(spiState_t *)(SPI_STATE_AT))
+#endif
+#define spiAheadBase        (spiState.aheadBase)
+#define spiAheadLength      (spiState.aheadLength)
+#define spiAheadCount       (spiState.aheadCount)
+#define spiFailed           (spiState.failed)
+
+#ifndef CRYPTBOOT_SIM
+/**
+ * \brief   Initialization of the SPI module in the Master mode 0 with SCK = F_CPU / 2,
+ *          the memory is woken up from power-down and checked with its JEDEC ID (see isFlashOnBus()).
+ *
+ * \return nothing
+ */
+static void spiInit(void)
+{
+    SPI_PORT.OUTSET = SPI_CS_bm;
+    SPI_PORT.DIRSET = SPI_MOSI_bm | SPI_SCK_bm | SPI_CS_bm;
+    SPI_MISO_PINCTRL |= PORT_PULLUPEN_bm;                           // missing memory reads as 0xFF
+    SPI0.CTRLB = SPI_SSD_bm;                                        // SS pin is not used by the master
+    SPI0.CTRLA = SPI_MASTER_bm | SPI_CLK2X_bm | SPI_PRESC_DIV4_gc | SPI_ENABLE_bm;
+#ifdef SPI_READ_AHEAD
+    spiAheadLength = 0;                                              // no startup code, .bss is not cleared
+    spiAheadCount = 0;
+#endif
+    spiFailed = !isFlashOnBus();
+}
+
+/**
+ * \brief Function asserts the chip select of the memory.
+ *
+ * \return nothing
+ */
+static void spiSelect(void)
+{
+    SPI_PORT.OUTCLR = SPI_CS_bm;
+}
+
+/**
+ * \brief Function releases the chip select of the memory.
+ *
+ * \return nothing
+ */
+static void spiDeselect(void)
+{
+    SPI_PORT.OUTSET = SPI_CS_bm;
+}
+
+/**
+ * \brief Function starts the transfer of a byte, a byte from the memory is received at the same time.
+ *
+ * \param[in] data data byte for writing to the memory
+ *
+ * \return nothing
+ */
+static void spiSend(uint8_t data)
+{
+    SPI0.DATA = data;
+}
+
+#ifdef SPI_READ_AHEAD
+/**
+ * \brief Function returns the state of the SPI master without waiting.
+ *
+ * \return current value of the interrupt flags register
+ */
+static uint8_t spiStatus(void)
+{
+    return SPI0.INTFLAGS;
+}
+#endif
+
+/**
+ * \brief   Function waits until the transfer started by spiSend() is complete. The master drives
+ *          the clock, so the transfer always ends after 8 SCK clocks, with or without a memory.
+ *
+ * \return nothing
+ */
+static void spiWait(void)
+{
+    while (!(SPI0.INTFLAGS & SPI_IF_bm))
+    {
+    }
+}
+
+/**
+ * \brief Function returns the byte received by the last transfer (and clears SPI_IF_bm).
+ *
+ * \return received byte
+ */
+static uint8_t spiReceive(void)
+{
+    return SPI0.DATA;
+}
+
+/**
+ * \brief The function turns off SPI module of the microcontroller and returns its pins to reset state.
+ *
+ * \return nothing
+ */
+static void spiRelease(void)
+{
+    SPI0.CTRLA = 0;
+    SPI0.CTRLB = 0;
+    SPI_PORT.DIRCLR = SPI_MOSI_bm | SPI_SCK_bm | SPI_CS_bm;
+    SPI_PORT.OUTCLR = SPI_CS_bm;
+    SPI_MISO_PINCTRL &= ~(PORT_PULLUPEN_bm);
+}
+#else
+// bus primitives of the host simulation harness (host/sim)
+#include "spi_sim.h"
+#endif // CRYPTBOOT_SIM
+
+/**
+ * \brief Function transfers a byte to the memory and returns the byte received at the same time.
+ *
+ * \param[in] data data byte for writing to the memory
+ *
+ * \return received byte
+ */
+static uint8_t spiTransfer(uint8_t data)
+{
+    spiSend(data);
+    spiWait();
+
+    return spiReceive();
+}
+
+/**
+ * \brief   This function checks whether a memory is present on the bus. The memory is released
+ *          from power-down first (the application may have left it there), the following
+ *          JEDEC ID command gives it enough time to wake up before the first read.
+ *
+ * \return true if memory is present, false otherwise
+ */
+static bool isFlashOnBus(void)
+{
+    uint8_t manufacturer;
+
+    spiSelect();
+    spiTransfer(SPI_CMD_RELEASE_POWER_DOWN);
+    spiDeselect();
+    spiTransfer(SPI_DUMMY);                                         // tRES1 (3 us) with chip select released
+    spiTransfer(SPI_DUMMY);
+    spiSelect();
+    spiTransfer(SPI_CMD_JEDEC_ID);
+    manufacturer = spiTransfer(SPI_DUMMY);                          // 0x00/0xFF - MISO held or floating
+    spiDeselect();
+
+    return (manufacturer != 0x00) && (manufacturer != 0xFF);
+}
+
+/**
+ * \brief Function reading 'n' bytes of data from external SPI flash memory.
+ *
+ * \param[in]   address     address of first memory cell to be read
+ * \param[out]  data        buffer for read data
+ * \param[in]   length      amount of data to be read
+ *
+ * \return nothing
+ */
+static void spiFlashRead(const spiAddr_t address, uint8_t *data, uint8_t length)
+{
+    spiBeginRead(address);
+    spiReadBytes(data, length);
+    spiStop();
+}
+
+/**
+ * \brief   Function starts the sequence of data readings from external SPI flash memory,
+ *          the read is ended by spiStop(). A sequential read crosses page, sector and block
+ *          boundaries up to the end of the memory.
+ *
+ * \param[in]   address     address of first memory cell to be read
+ *
+ * \return true if the read has been started, false otherwise
+ */
+static bool spiBeginRead(const spiAddr_t address)
+{
+#ifdef SPI_READ_AHEAD
+    spiAheadLength = 0;
+    spiAheadCount = 0;
+#endif
+    if (!spiFailed)
+    {
+        spiSelect();
+        spiTransfer(SPI_READ_CMD);
+        spiTransfer((uint8_t)(address >> 16));
+        spiTransfer((uint8_t)(address >> 8));
+        spiTransfer((uint8_t)(address & 0xFF));
+#ifdef SPI_FAST_READ
+        spiTransfer(SPI_DUMMY);
+#endif
+    }
+
+    return !spiFailed;
+}
+
+/**
+ * \brief   Function reading 'n' bytes of data within a sequential read started by spiBeginRead().
+ *
+ * \param[out]  data        buffer for read data
+ * \param[in]   length      amount of data to be read
+ *
+ * \return nothing
+ */
+static void spiReadBytes(uint8_t *data, uint8_t length)
+{
+    while (length-- && !spiFailed)
+    {
+        *data = spiTransfer(SPI_DUMMY);
+        data++;
+    }
+}
+
+/**
+ * \brief   Function ends the sequential read. Bytes still expected by the read-ahead buffer are received first,
+ *          so no transfer is left running.
+ *
+ * \return nothing
+ */
+static void spiStop(void)
+{
+#ifdef SPI_READ_AHEAD
+    if (spiAheadLength)
+    {
+        spiReadWait(spiAheadBase + spiAheadLength);
+    }
+#endif
+    spiDeselect();
+}
+
+#ifdef SPI_READ_AHEAD
+/**
+ * \brief   Function sets the buffer for bytes to be received in the background of a sequential read
+ *          started by spiBeginRead() (see XTEA_ROUND_HOOK in xtea.h). Transfer of the first byte is
+ *          started at once, each byte taken by spiReadPoll() starts the next one. The buffer must not
+ *          be used before spiReadWait() confirms that its part has been received.
+ *
+ * \param[out]  data        buffer for read data
+ * \param[in]   length      amount of data to be read
+ *
+ * \return nothing
+ */
+static void spiReadAhead(uint8_t *data, uint8_t length)
+{
+    spiAheadBase = data;
+    spiAheadLength = length;
+    spiAheadCount = 0;
+    if (length && !spiFailed)
+    {
+        spiSend(SPI_DUMMY);
+    }
+}
+
+/**
+ * \brief   Function takes a byte already received by the SPI master (if any) into the read-ahead buffer
+ *          and starts the transfer of the next one. It never waits, so it can be called from time-consuming
+ *          loops (see XTEA_ROUND_HOOK).
+ *
+ * \return nothing
+ */
+static void spiReadPoll(void)
+{
+    if ((spiAheadCount != spiAheadLength) && (spiStatus() & SPI_IF_bm))
+    {
+        spiAheadBase[spiAheadCount++] = spiReceive();
+        if (spiAheadCount != spiAheadLength)
+        {
+            spiSend(SPI_DUMMY);
+        }
+    }
+}
+
+/**
+ * \brief   Function waits until the read-ahead buffer is filled up to the given position.
+ *          A position outside the window belongs to other data (e.g. the other half of a double buffer
+ *          while this one is received) and is not waited for. It is tested as an offset from the start
+ *          of the window, so pointers to different objects are never compared.
+ *
+ * \param[in]   upTo    position in the read-ahead buffer
+ *
+ * \return nothing
+ */
+static void spiReadWait(const uint8_t *upTo)
+{
+    uintptr_t   offset  = (uintptr_t)upTo - (uintptr_t)spiAheadBase;   // below the window it wraps around
+
+    if (offset > spiAheadLength)
+    {
+        return;
+    }
+    while ((spiAheadCount < (uint8_t)offset) && !spiFailed)
+    {
+        spiWait();
+        spiAheadBase[spiAheadCount++] = spiReceive();
+        if (spiAheadCount != spiAheadLength)
+        {
+            spiSend(SPI_DUMMY);
+        }
+    }
+}
+#endif
+
+#endif // SPI_1_H_
@@ -14,7 +14,9 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#ifndef CRYPTBOOT_SIM
 #include <avr/io.h>
+#endif
 
 /**
  * \brief Macro calculating value describing clock frequency of the I2C bus
@@ -24,6 +26,32 @@
 #define TWI_ACK             true
 #define TWI_NACK            false
 
+/**
+ * \brief   Every wait for the bus is bounded: a byte that is not transferred within TWI_TIMEOUT_US
+ *          (stuck SCL/SDA, missing pull-ups) fails the bus (see twiFailed) instead of hanging the device.
+ *          TWI_WAIT_CYCLES is the length of one polling iteration in CPU cycles.
+ */
+#ifndef TWI_TIMEOUT_US
+#define TWI_TIMEOUT_US      1000UL
+#endif
+#define TWI_WAIT_CYCLES     8UL
+#define TWI_TIMEOUT_LOOPS   (uint16_t)(((F_CPU / 1000000UL) * TWI_TIMEOUT_US) / TWI_WAIT_CYCLES)
+
+/**
+ * \brief   Memory cell address. With TWI_ADDRESS_32BIT address bits above 16 are sent
+ *          in the device address from bit TWI_BLOCK_SELECT_bp up (block select bit B0 of 24LC1025/24FC1025
+ *          is bit 3, A16/A17 of AT24CM01/AT24CM02 start at bit 1). A sequential read does not cross
+ *          a 64 KB block boundary on such parts.
+ */
+#ifdef TWI_ADDRESS_32BIT
+typedef uint32_t    twiAddr_t;
+#else
+typedef uint16_t    twiAddr_t;
+#endif
+#ifndef TWI_BLOCK_SELECT_bp
+#define TWI_BLOCK_SELECT_bp 3
+#endif
+
 static void twiInit(uint8_t baud);
 static uint8_t twiStart(uint8_t deviceAddr);
 static uint8_t twiRead(uint8_t *data, bool ackFlag);
@@ -31,9 +59,40 @@ static uint8_t twiWrite(uint8_t data);
 static void twiStop(void);
 static void twiRelease(void);
 static bool isDeviceOnBus(uint8_t deviceAddr);
-static void twiEepromRead(const uint8_t deviceAddr, const uint16_t address, uint8_t *data, uint8_t length);
-static void twiBeginRead(const uint8_t deviceAddr, const uint16_t address);
+static void twiEepromRead(const uint8_t deviceAddr, const twiAddr_t address, uint8_t *data, uint8_t length);
+static bool twiBeginRead(uint8_t deviceAddr, const twiAddr_t address);
+static void twiReadBytes(uint8_t *data, uint8_t length);
+#ifdef TWI_READ_AHEAD
+static uint8_t twiStatus(void);
+static void twiReadAhead(uint8_t *data, uint8_t length);
+static void twiReadPoll(void);
+static void twiReadWait(const uint8_t *upTo);
+#endif
+static uint8_t twiWait(uint8_t flags);
+
+/**
+ * \brief   State of the bus. It is kept at the fixed RAM address TWI_STATE_AT if that is defined,
+ *          so that code running from another image (see boot_services.h) finds it at the same place.
+ */
+typedef struct twiState
+{
+    uint8_t       * aheadBase;                                      // read-ahead window, see twiReadAhead()
+    uint8_t         aheadLength;
+    uint8_t         aheadCount;                                     // bytes of the window received so far
+    uint8_t         failed;                                         // sticky bus failure, cleared by twiInit()
+} twiState_t;
+
+#ifndef TWI_STATE_AT
+static twiState_t   twiState;
+#else
+#define twiState            (*(twiState_t *)(TWI_STATE_AT))
+#endif
+#define twiAheadBase        (twiState.aheadBase)
+#define twiAheadLength      (twiState.aheadLength)
+#define twiAheadCount       (twiState.aheadCount)
+#define twiFailed           (twiState.failed)
 
+#ifndef CRYPTBOOT_SIM
 /**
  * \brief Initialization of the TWI module in the Master mode.
  * 
@@ -49,6 +108,32 @@ static void twiInit(uint8_t baud)
     TWI0.MCTRLB |= TWI_FLUSH_bm;
     TWI0.MCTRLA = TWI_TIMEOUT_200US_gc | TWI_SMEN_bm | TWI_ENABLE_bm;
     TWI0.MSTATUS |= (TWI_BUSSTATE_IDLE_gc | TWI_RIF_bm | TWI_WIF_bm);
+    twiFailed = false;                                              // no startup code, .bss is not cleared
+}
+
+/**
+ * \brief   Function waits until any of the given status flags is set, at most TWI_TIMEOUT_US.
+ *          On timeout the bus is marked as failed and all further transfers return at once,
+ *          so the caller falls through to the application in bounded time.
+ * 
+ * \param[in] flags status flags to wait for
+ * 
+ * \return status after waiting
+ */
+static uint8_t twiWait(uint8_t flags)
+{
+    register uint16_t timeout = TWI_TIMEOUT_LOOPS;
+
+    while (!(TWI0.MSTATUS & flags))
+    {
+        if (!--timeout)
+        {
+            twiFailed = true;
+            break;
+        }
+    }
+
+    return TWI0.MSTATUS;
 }
 
 /**
@@ -60,12 +145,15 @@ static void twiInit(uint8_t baud)
  */
 static uint8_t twiStart(uint8_t deviceAddr)
 {
-    if ((TWI0.MSTATUS & TWI_BUSSTATE_gm) != TWI_BUSSTATE_BUSY_gc)
+    if (!twiFailed && ((TWI0.MSTATUS & TWI_BUSSTATE_gm) != TWI_BUSSTATE_BUSY_gc))
     {
         TWI0.MCTRLB &= ~(TWI_ACKACT_bm);
         TWI0.MADDR = deviceAddr;
 
-        while (!((TWI0.MSTATUS & TWI_WIF_bm) | (TWI0.MSTATUS & TWI_RIF_bm)));
+        twiWait(TWI_WIF_bm | TWI_RIF_bm);
+    } else
+    {                                                               // bus held by someone else (or stuck SDA)
+        twiFailed = true;
     }
 
     return TWI0.MSTATUS;
@@ -81,12 +169,9 @@ static uint8_t twiStart(uint8_t deviceAddr)
  */
 static uint8_t twiRead(uint8_t *data, bool ackFlag)
 {
-    if ((TWI0.MSTATUS & TWI_BUSSTATE_gm) == TWI_BUSSTATE_OWNER_gc)
+    if (!twiFailed && ((TWI0.MSTATUS & TWI_BUSSTATE_gm) == TWI_BUSSTATE_OWNER_gc))
     {
-        while (!(TWI0.MSTATUS & TWI_RIF_bm))
-        {
-            // TODO timeout
-        }
+        twiWait(TWI_RIF_bm);
 
         if (ackFlag)
         {
@@ -97,6 +182,9 @@ static uint8_t twiRead(uint8_t *data, bool ackFlag)
         }
 
         *data = TWI0.MDATA;
+    } else
+    {                                                               // arbitration lost or bus error
+        twiFailed = true;
     }
 
     return TWI0.MSTATUS;
@@ -111,19 +199,31 @@ static uint8_t twiRead(uint8_t *data, bool ackFlag)
  */
 static uint8_t twiWrite(uint8_t data)
 {
-    if ((TWI0.MSTATUS & TWI_BUSSTATE_gm) == TWI_BUSSTATE_OWNER_gc)
+    if (!twiFailed && ((TWI0.MSTATUS & TWI_BUSSTATE_gm) == TWI_BUSSTATE_OWNER_gc))
     {
-        while (!((TWI0.MSTATUS & TWI_WIF_bm) | (TWI0.MSTATUS & TWI_RXACK_bm)))
-        {
-            // TODO timeout
-        }
+        twiWait(TWI_WIF_bm | TWI_RXACK_bm);
 
         TWI0.MDATA = data;
+    } else
+    {                                                               // arbitration lost or bus error
+        twiFailed = true;
     }
 
     return TWI0.MSTATUS;
 }
 
+#ifdef TWI_READ_AHEAD
+/**
+ * \brief Function returns the state of the TWI master without waiting.
+ * 
+ * \return current value of the status register
+ */
+static uint8_t twiStatus(void)
+{
+    return TWI0.MSTATUS;
+}
+#endif
+
 /**
  * \brief Function that sends a "STOP" condition to the I2C bus.
  * 
@@ -143,6 +243,10 @@ static void twiRelease(void)
 {
     TWI0.MCTRLA &= ~(TWI_ENABLE_bm);
 }
+#else
+// bus primitives of the host simulation harness (host/sim)
+#include "twi_sim.h"
+#endif // CRYPTBOOT_SIM
 
 /**
  * \brief This function checks whether any device is active on the I2C bus at the given address.
@@ -169,7 +273,7 @@ static bool isDeviceOnBus(const uint8_t deviceAddr)
  * 
  * \return nothing
  */
-static void twiEepromRead(const uint8_t deviceAddr, const uint16_t address, uint8_t *data, uint8_t length)
+static void twiEepromRead(const uint8_t deviceAddr, const twiAddr_t address, uint8_t *data, uint8_t length)
 {
     twiBeginRead(deviceAddr, address);
 
@@ -184,19 +288,111 @@ static void twiEepromRead(const uint8_t deviceAddr, const uint16_t address, uint
 }
 
 /**
- * \brief Function starts the sequence of data readings from external I2C EEPROM memory.
+ * \brief   Function starts the sequence of data readings from external I2C EEPROM memory.
+ *          A device that does not respond fails the bus (see twiWait()), the read is ended by twiStop().
  * 
  * \param[in]   deviceAddr  device address (in 8-bit format)
  * \param[in]   address     address of first memory cell to be read
  * 
- * \return nothing
+ * \return true if the read has been started, false otherwise
  */
-static void twiBeginRead(const uint8_t deviceAddr, const uint16_t address)
+static bool twiBeginRead(uint8_t deviceAddr, const twiAddr_t address)
 {
-    twiStart(deviceAddr & 0xFE);
+#ifdef TWI_ADDRESS_32BIT
+    deviceAddr |= (uint8_t)(address >> 16) << TWI_BLOCK_SELECT_bp;
+#endif
+    if (twiStart(deviceAddr & 0xFE) & TWI_RXACK_bm)
+    {                                                               // no device, the read would never be answered
+        twiFailed = true;
+    }
     twiWrite((uint8_t)(address >> 8));
     twiWrite((uint8_t)(address & 0xFF));
     twiStart(deviceAddr | 0x01);
+#ifdef TWI_READ_AHEAD
+    twiAheadLength = 0;                                              // no startup code, .bss is not cleared
+    twiAheadCount = 0;
+#endif
+
+    return !twiFailed;
+}
+
+/**
+ * \brief   Function reading 'n' bytes of data within a sequential read started by twiBeginRead().
+ *          Every byte is acknowledged, so the read stays open for further data
+ *          until it is finished with twiStop().
+ * 
+ * \param[out]  data        buffer for read data
+ * \param[in]   length      amount of data to be read
+ * 
+ * \return nothing
+ */
+static void twiReadBytes(uint8_t *data, uint8_t length)
+{
+    while (length--)
+    {
+        twiRead(data, TWI_ACK);
+        data++;
+    }
+}
+
+#ifdef TWI_READ_AHEAD
+/**
+ * \brief   Function sets the buffer for bytes to be received in the background of a sequential read
+ *          started by twiBeginRead() (see XTEA_ROUND_HOOK in xtea.h). In smart mode reading MDATA
+ *          acknowledges the byte and starts reception of the next one, twiReadPoll() takes it.
+ *          The buffer must not be used before twiReadWait() confirms that its part has been received.
+ * 
+ * \param[out]  data        buffer for read data
+ * \param[in]   length      amount of data to be read
+ * 
+ * \return nothing
+ */
+static void twiReadAhead(uint8_t *data, uint8_t length)
+{
+    twiAheadBase = data;
+    twiAheadLength = length;
+    twiAheadCount = 0;
+}
+
+/**
+ * \brief   Function takes a byte already received by the TWI master (if any) into the read-ahead buffer.
+ *          It never waits, so it can be called from time-consuming loops (see XTEA_ROUND_HOOK).
+ * 
+ * \return nothing
+ */
+static void twiReadPoll(void)
+{
+    if ((twiAheadCount != twiAheadLength) && (twiStatus() & TWI_RIF_bm))
+    {
+        twiRead(twiAheadBase + twiAheadCount, TWI_ACK);
+        twiAheadCount++;
+    }
+}
+
+/**
+ * \brief   Function waits until the read-ahead buffer is filled up to the given position.
+ *          A position outside the window belongs to other data (e.g. the other half of a double buffer
+ *          while this one is received) and is not waited for. It is tested as an offset from the start
+ *          of the window, so pointers to different objects are never compared.
+ * 
+ * \param[in]   upTo    position in the read-ahead buffer
+ * 
+ * \return nothing
+ */
+static void twiReadWait(const uint8_t *upTo)
+{
+    uintptr_t   offset  = (uintptr_t)upTo - (uintptr_t)twiAheadBase;   // below the window it wraps around
+
+    if (offset > twiAheadLength)
+    {
+        return;
+    }
+    while (twiAheadCount < (uint8_t)offset)
+    {
+        twiRead(twiAheadBase + twiAheadCount, TWI_ACK);
+        twiAheadCount++;
+    }
 }
+#endif
 
 #endif // TWI_1_H_
\ No newline at end of file
@@ -0,0 +1,304 @@
+/**
+ * \file    twi_stage.h
+ * \brief   Library for the application: stages a firmware image received in chunks (e.g. over a radio link)
+ *          into the external 24Cxx EEPROM read by the bootloader, with the TWI master of twi_1.h.
+ *
+ *          Received bytes are gathered into aligned TWI_MEM_PAGE_SIZE pages, so every page of memory
+ *          is written once, with one page write. Two page buffers are used: while the memory is busy
+ *          with the write cycle of one page (up to 5 ms), the next one is received. The end of the write
+ *          cycle is found by ACK polling (the memory does not acknowledge its address until then),
+ *          a single probe per twiStagePoll() call, so the application is never blocked by the write cycle,
+ *          only by the transfer of a page (about 1.7 ms for 64 bytes at 400 kHz).
+ *
+ *          The firmware descriptor (first TWI_STAGE_HEADER_SIZE bytes of the image) is kept in RAM
+ *          and written last, after all pages of the firmware. Before anything else, 'firmwareSize'
+ *          of the descriptor in memory is cleared, so the bootloader never takes a partially staged
+ *          image (or the previous image partially overwritten) for an update. The descriptor is written
+ *          by a single page write if it does not cross a memory page (TWI_CONTROL_DATA_AT does not).
+ *
+ *          Usage:
+ *              twiInit(TWI_BAUD(F_CPU, F_SCL, T_RISE));
+ *              twiStageBegin(&stage, TWI_CONTROL_DATA_AT);
+ *              for every chunk from offset TWI_CONTROL_DATA_AT of '*.aligned.bin':
+ *                  while not all bytes accepted by twiStageWrite(): twiStagePoll(&stage);
+ *              twiStageFinish(&stage);
+ *              while (twiStagePoll(&stage) == TWI_STAGE_BUSY);
+ *              twiRelease();
+ *          twiStagePoll() is also called from time to time while chunks are received.
+ *
+ * \copyright SPDX-FileCopyrightText: Copyright 2021 Michal Protasowicki
+ *
+ * \license SPDX-License-Identifier: MIT
+ *
+ */
+
+#ifndef TWI_STAGE_H_
+#define TWI_STAGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "twi_1.h"
+
+// memory of the bootloader, as in cryptboot_x.h
+#ifndef TWI_MEM_ADDR
+#define TWI_MEM_ADDR                0xA0
+#endif
+#ifndef TWI_MEM_PAGE_SIZE
+#define TWI_MEM_PAGE_SIZE           0x40
+#endif
+
+// firmware descriptor (firmwareCfg_t of cryptboot_x.h) and offset of its 'firmwareSize' field
+#define TWI_STAGE_HEADER_SIZE       64
+#define TWI_STAGE_SIZE_AT           24
+
+// probes of a busy memory before the write fails: at least 10 SCL clocks each, 10 ms at 400 kHz
+#ifndef TWI_STAGE_PROBES
+#define TWI_STAGE_PROBES            400
+#endif
+
+/**
+ * \brief Result of twiStagePoll().
+ */
+typedef enum twiStageStatus
+{
+    TWI_STAGE_BUSY      = 0x00,         // data waiting for the memory, or the last write cycle not finished
+    TWI_STAGE_IDLE      = 0x01,         // nothing waiting for the memory, more data expected
+    TWI_STAGE_DONE      = 0x02,         // image staged, descriptor written
+    TWI_STAGE_FAILED    = 0x03          // bus failure or memory busy for too long, staging has to start over
+} twiStageStatus_t;
+
+/**
+ * \brief Staging context.
+ */
+typedef struct twiStage
+{
+    /// Page being received and page waiting for the memory.
+    uint8_t             page[2][TWI_MEM_PAGE_SIZE];
+    /// Descriptor, written by twiStagePoll() after twiStageFinish().
+    uint8_t             header[TWI_STAGE_HEADER_SIZE];
+    /// Data waiting for the memory (NULL if none), its address and length.
+    const uint8_t     * writeData;
+    twiAddr_t           writeAt;
+    uint8_t             writeLength;
+    /// Address of the descriptor and of the next received byte.
+    twiAddr_t           at;
+    twiAddr_t           next;
+    /// Page being received, offsets of its first and after its last received byte.
+    uint8_t             fill;
+    uint8_t             fillFrom;
+    uint8_t             fillTo;
+    /// Probes of the memory not acknowledged since the last write.
+    uint16_t            probes;
+    /// Data received completely (twiStageFinish()), descriptor passed to the memory.
+    bool                finished;
+    bool                committed;
+    twiStageStatus_t    status;
+} twiStage_t;
+
+static void twiStageBegin(twiStage_t *ctx, const twiAddr_t at);
+static uint16_t twiStageWrite(twiStage_t *ctx, const uint8_t *data, uint16_t length);
+static void twiStageFinish(twiStage_t *ctx);
+static twiStageStatus_t twiStagePoll(twiStage_t *ctx);
+static void twiStageHandOver(twiStage_t *ctx);
+static bool twiStageSend(uint8_t data);
+
+static const uint8_t twiStageZero[sizeof(uint32_t)];                // 'firmwareSize' of an invalid descriptor
+
+/**
+ * \brief   Function starts staging of an image at the given address of the descriptor. The first write
+ *          waiting for the memory clears 'firmwareSize' of the descriptor there.
+ *
+ * \param[in]   ctx     staging context
+ * \param[in]   at      address of the descriptor, TWI_CONTROL_DATA_AT (or of an image directory slot)
+ *
+ * \return nothing
+ */
+static void twiStageBegin(twiStage_t *ctx, const twiAddr_t at)
+{
+    ctx->writeData = twiStageZero;
+    ctx->writeAt = at + TWI_STAGE_SIZE_AT;
+    ctx->writeLength = sizeof(twiStageZero);
+    ctx->at = at;
+    ctx->next = at;
+    ctx->fill = 0;
+    ctx->fillFrom = (uint8_t)((at + TWI_STAGE_HEADER_SIZE) & (TWI_MEM_PAGE_SIZE - 1));
+    ctx->fillTo = ctx->fillFrom;
+    ctx->probes = 0;
+    ctx->finished = false;
+    ctx->committed = false;
+    ctx->status = TWI_STAGE_BUSY;
+}
+
+/**
+ * \brief   Function takes the next bytes of the image. Bytes are only copied, the memory is written
+ *          by twiStagePoll(). When both page buffers are full, fewer bytes than given are taken;
+ *          the rest is to be passed again after twiStagePoll().
+ *
+ * \param[in]   ctx     staging context
+ * \param[in]   data    next bytes of the image
+ * \param[in]   length  amount of data
+ *
+ * \return number of bytes taken
+ */
+static uint16_t twiStageWrite(twiStage_t *ctx, const uint8_t *data, uint16_t length)
+{
+    uint16_t    taken = 0;
+
+    while ((taken < length) && !ctx->finished && (ctx->status != TWI_STAGE_FAILED))
+    {
+        if ((twiAddr_t)(ctx->next - ctx->at) < TWI_STAGE_HEADER_SIZE)
+        {
+            ctx->header[ctx->next - ctx->at] = data[taken];
+        } else
+        {
+            if (ctx->fillTo == TWI_MEM_PAGE_SIZE)
+            {                                                       // page complete, the other one is free
+                twiStageHandOver(ctx);                              // if the memory has taken its data
+                if (ctx->fillTo == TWI_MEM_PAGE_SIZE)
+                {
+                    break;
+                }
+            }
+            ctx->page[ctx->fill][ctx->fillTo++] = data[taken];
+        }
+        ctx->next++;
+        taken++;
+    }
+
+    return taken;
+}
+
+/**
+ * \brief   Function marks the end of the image: the last (partial) page and then the descriptor
+ *          are written by twiStagePoll().
+ *
+ * \param[in]   ctx     staging context
+ *
+ * \return nothing
+ */
+static void twiStageFinish(twiStage_t *ctx)
+{
+    ctx->finished = true;
+}
+
+/**
+ * \brief   Function passes received data to the memory, to be called repeatedly. At most one probe
+ *          of the memory and one page write are done per call: if the memory is still busy with
+ *          the write cycle of the previous page, the function returns at once.
+ *
+ * \param[in]   ctx     staging context
+ *
+ * \return state of staging
+ */
+static twiStageStatus_t twiStagePoll(twiStage_t *ctx)
+{
+    register uint8_t    deviceAddr  = TWI_MEM_ADDR;
+    register uint8_t    length;
+    register bool       acked;
+
+    if ((ctx->status == TWI_STAGE_DONE) || (ctx->status == TWI_STAGE_FAILED))
+    {
+        return ctx->status;
+    }
+    twiStageHandOver(ctx);
+    if ((ctx->writeData == NULL) && ctx->finished && !ctx->committed && (ctx->fillTo == ctx->fillFrom))
+    {                                                               // all pages of the firmware passed
+        ctx->writeData = ctx->header;
+        ctx->writeAt = ctx->at;
+        ctx->writeLength = TWI_STAGE_HEADER_SIZE;
+        ctx->committed = true;
+    }
+    if ((ctx->writeData == NULL) && !ctx->committed)
+    {                                                               // waiting for data, the memory is not probed
+        ctx->status = TWI_STAGE_IDLE;
+        return ctx->status;
+    }
+
+#ifdef TWI_ADDRESS_32BIT
+    deviceAddr |= (uint8_t)(ctx->writeAt >> 16) << TWI_BLOCK_SELECT_bp;
+#endif
+    if (twiStart(deviceAddr) & TWI_RXACK_bm)
+    {                                                               // write cycle of the previous page not over
+        twiStop();
+        ctx->status = (++ctx->probes < TWI_STAGE_PROBES) ? TWI_STAGE_BUSY : TWI_STAGE_FAILED;
+    } else if (ctx->writeData != NULL)
+    {
+        length = TWI_MEM_PAGE_SIZE - (uint8_t)(ctx->writeAt & (TWI_MEM_PAGE_SIZE - 1));
+        if (length > ctx->writeLength)
+        {
+            length = ctx->writeLength;
+        }
+        acked = twiStageSend((uint8_t)(ctx->writeAt >> 8)) && twiStageSend((uint8_t)(ctx->writeAt & 0xFF));
+        ctx->writeAt += length;
+        ctx->writeLength -= length;
+        while (length-- && acked)
+        {
+            acked = twiStageSend(*ctx->writeData++);
+        }
+        twiStop();                                                  // last byte is out, memory starts its write cycle
+        if (!ctx->writeLength)
+        {
+            ctx->writeData = NULL;
+        }
+        ctx->probes = 0;
+        ctx->status = acked ? TWI_STAGE_BUSY : TWI_STAGE_FAILED;   // write refused (e.g. write protected memory)
+        twiStageHandOver(ctx);
+    } else
+    {                                                               // write cycle of the descriptor is over
+        twiStop();
+        ctx->status = TWI_STAGE_DONE;
+    }
+    if (twiFailed)
+    {
+        ctx->status = TWI_STAGE_FAILED;
+    }
+
+    return ctx->status;
+}
+
+/**
+ * \brief   Auxiliary function that passes the page being received to the memory, if it is complete
+ *          (or the last one) and the memory has taken the data of the other page.
+ *
+ * \param[in]   ctx     staging context
+ *
+ * \return nothing
+ */
+static void twiStageHandOver(twiStage_t *ctx)
+{
+    if ((ctx->writeData == NULL) && (ctx->fillTo > ctx->fillFrom)
+        && ((ctx->fillTo == TWI_MEM_PAGE_SIZE) || ctx->finished))
+    {
+        ctx->writeData = &ctx->page[ctx->fill][ctx->fillFrom];
+        ctx->writeAt = ctx->next - (ctx->fillTo - ctx->fillFrom);
+        ctx->writeLength = ctx->fillTo - ctx->fillFrom;
+        ctx->fill ^= 1;
+        ctx->fillFrom = (uint8_t)(ctx->next & (TWI_MEM_PAGE_SIZE - 1));
+        ctx->fillTo = ctx->fillFrom;
+    }
+}
+
+/**
+ * \brief   Auxiliary function that writes a byte and waits until it has been shifted out: a STOP
+ *          (MCMD) takes effect only while the TWI master holds the clock, one issued earlier is dropped.
+ *
+ * \param[in]   data    byte to write
+ *
+ * \return true if the byte has been acknowledged by the memory
+ */
+static bool twiStageSend(uint8_t data)
+{
+    register bool result = false;
+
+    twiWrite(data);
+    if (!twiFailed)
+    {                                                               // twiWait() is bounded, but a failed bus is not waited for
+        result = !(twiWait(TWI_WIF_bm) & TWI_RXACK_bm) && !twiFailed;
+    }
+
+    return result;
+}
+
+#endif // TWI_STAGE_H_
@@ -33,6 +33,30 @@
 #define XTEA_MAC_ROUNDS     32
 #endif
 
+// XTEA_KEY_SCHEDULE - round keys (sum + key[...]) are computed once per key instead of in every round
+//                     of every block; costs 8 bytes of RAM per round in every ECB context, so the number
+//                     of rounds is limited to XTEA_SCHEDULE_ROUNDS
+#ifndef XTEA_SCHEDULE_ROUNDS
+#define XTEA_SCHEDULE_ROUNDS        XTEA_ROUNDS
+#endif
+
+// hook called once per block with the number of rounds, used by the host simulation to account CPU time
+#ifndef XTEA_BLOCK_HOOK
+#define XTEA_BLOCK_HOOK(rounds)
+#endif
+
+// hook called once per round, lets the caller service peripherals during long block computation
+// (the bootloader receives external memory data with it, see cryptboot_x.h)
+#ifndef XTEA_ROUND_HOOK
+#define XTEA_ROUND_HOOK()
+#endif
+
+// hook called by buffer-level functions with the end of input data needed for the next block,
+// lets the caller fill the buffer in the background (e.g. from a bus) while preceding blocks are computed
+#ifndef XTEA_INPUT_HOOK
+#define XTEA_INPUT_HOOK(end)
+#endif
+
 /**
  *  \brief Cipher operation type.
  */
@@ -62,6 +86,10 @@ typedef struct xteaEcbCtx
     uint_fast8_t        rounds;
     /// Type of operation to be performed by cipher.
     xteaOperation_t     operation;
+#ifdef XTEA_KEY_SCHEDULE
+    /// Round keys: sum + key[sum & 3] and sum + key[(sum >> 11) & 3] of consecutive rounds.
+    uint32_t            schedule[2 * XTEA_SCHEDULE_ROUNDS];
+#endif
 } xteaEcbCtx_t;
 
 /**
@@ -86,7 +114,7 @@ typedef struct xteaCtx
     u32_u8_union_t      secondKey[XTEA_KEY_SIZE / sizeof(uint32_t)];
     /// buffer for auxiliary data / or computed MAC code.
     uint8_t             data[XTEA_BLOCK_SIZE];
-    /// amount of data in the variable 'data'
+    /// amount of data added to the current block (XORed into 'cipher.iv')
     uint_fast8_t        dataLength;
 } xteaCtx_t;
 
@@ -99,9 +127,16 @@ static void *xteaEcbEncrypt    (const u32_u8_union_t key[XTEA_KEY_SIZE / sizeof(
                                 const uint8_t input[XTEA_BLOCK_SIZE],
                                 uint8_t output[XTEA_BLOCK_SIZE],
                                 uint_fast8_t rounds);
+static void *xteaEcbEncryptCtx (const xteaEcbCtx_t *ctx,
+                                const uint8_t input[XTEA_BLOCK_SIZE],
+                                uint8_t output[XTEA_BLOCK_SIZE]);
+static void xteaLoadKey        (xteaEcbCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE]);
+static void xteaKeySchedule    (xteaEcbCtx_t *ctx);
 static void xteaSetKey         (xteaEcbCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE]);
 static void xteaSetIv          (xteaCipherCtx_t *ctx, const uint8_t iv[XTEA_IV_SIZE]);
 static void xteaCfbBlock       (xteaCipherCtx_t *ctx, uint8_t data[XTEA_BLOCK_SIZE]);
+static void xteaCfbBytes       (xteaCipherCtx_t *ctx, uint8_t data[], uint_fast8_t length);
+static void xteaCfbBuffer      (xteaCipherCtx_t *ctx, uint8_t data[], size_t length);
 static void xteaCfbMacInit     (xteaCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE], const uint_fast8_t rounds);
 static void xteaCfbMacUpdate   (xteaCtx_t *ctx, const uint8_t data[], const uint32_t length);
 static void xteaCfbMacFinish   (xteaCtx_t *ctx);
@@ -135,11 +170,14 @@ static void *xteaEcbEncrypt(const u32_u8_union_t key[XTEA_KEY_SIZE / sizeof(uint
     #error "Unsupported hardware !!!"
 #endif
 
+    XTEA_BLOCK_HOOK(rounds);
+
     while(rounds--)
     {
         v0.u32  += ((((v1.u32 << 4) & 0xFFFFFFF0) ^ ((v1.u32 >> 5) & 0x07FFFFFF)) + v1.u32) ^ (sum + key[sum & 3].u32);
         sum     += delta;
         v1.u32  += ((((v0.u32 << 4) & 0xFFFFFFF0) ^ ((v0.u32 >> 5) & 0x07FFFFFF)) + v0.u32) ^ (sum + key[((sum >> 11) & 0x001FFFFF) & 3].u32);
+        XTEA_ROUND_HOOK();
     }
 
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
@@ -168,14 +206,79 @@ static void *xteaEcbEncrypt(const u32_u8_union_t key[XTEA_KEY_SIZE / sizeof(uint
 }
 
 /**
- * \brief A function that loads a key into an XTEA ECB context.
+ * \brief   Function to encrypt a data block in the ECB mode with the key and number of rounds
+ *          of an XTEA ECB context, using its round keys with XTEA_KEY_SCHEDULE.
+ *
+ * \param[in]   ctx     XTEA ECB context.
+ * \param[in]   input   64-bit [8 bytes] data block to encrypt.
+ * \param[out]  output  64-bit [8 bytes] block of encrypted data.
+ *
+ * \return Processed data is returned by the 'output' parameter.
+ */
+static void *xteaEcbEncryptCtx(const xteaEcbCtx_t *ctx,
+                     const uint8_t input[XTEA_BLOCK_SIZE],
+                     uint8_t output[XTEA_BLOCK_SIZE])
+{
+#ifdef XTEA_KEY_SCHEDULE
+    uint_fast8_t            rounds  = ctx->rounds;
+    const uint32_t        * roundKey = ctx->schedule;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    u32_u8_union_t          v0      = { .u8 = {input[3], input[2], input[1], input[0]} };
+    u32_u8_union_t          v1      = { .u8 = {input[7], input[6], input[5], input[4]} };
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    u32_u8_union_t          v0      = { .u8 = {input[0], input[1], input[2], input[3]} };
+    u32_u8_union_t          v1      = { .u8 = {input[4], input[5], input[6], input[7]} };
+#else
+    #error "Unsupported hardware !!!"
+#endif
+
+    XTEA_BLOCK_HOOK(rounds);
+
+    while(rounds--)
+    {
+        v0.u32  += ((((v1.u32 << 4) & 0xFFFFFFF0) ^ ((v1.u32 >> 5) & 0x07FFFFFF)) + v1.u32) ^ *roundKey++;
+        v1.u32  += ((((v0.u32 << 4) & 0xFFFFFFF0) ^ ((v0.u32 >> 5) & 0x07FFFFFF)) + v0.u32) ^ *roundKey++;
+        XTEA_ROUND_HOOK();
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    output[0] = v0.u8[3];
+    output[1] = v0.u8[2];
+    output[2] = v0.u8[1];
+    output[3] = v0.u8[0];
+    output[4] = v1.u8[3];
+    output[5] = v1.u8[2];
+    output[6] = v1.u8[1];
+    output[7] = v1.u8[0];
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    output[0] = v0.u8[0];
+    output[1] = v0.u8[1];
+    output[2] = v0.u8[2];
+    output[3] = v0.u8[3];
+    output[4] = v1.u8[0];
+    output[5] = v1.u8[1];
+    output[6] = v1.u8[2];
+    output[7] = v1.u8[3];
+#else
+    #error "Unsupported hardware !!!"
+#endif
+
+    return output;
+#else
+    return xteaEcbEncrypt(ctx->key, input, output, ctx->rounds);
+#endif
+}
+
+/**
+ * \brief A function that loads a key into an XTEA ECB context, without computing round keys.
  *
  * \param[in]   ctx     XTEA ECB context.
  * \param[in]   key     128-bit [16 bytes] XTEA cipher key.
  *
  * \return nothing
  */
-static void xteaSetKey(xteaEcbCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE])
+static void xteaLoadKey(xteaEcbCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE])
 {
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     register uint_fast8_t idx = (uint_fast8_t)(XTEA_KEY_SIZE / sizeof(uint32_t));
@@ -195,6 +298,47 @@ static void xteaSetKey(xteaEcbCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE])
 #endif
 }
 
+/**
+ * \brief   A function that computes round keys from the key loaded into an XTEA ECB context.
+ *          Must be called after every change of the key (done by xteaSetKey() and CFB-MAC functions).
+ *
+ * \param[in]   ctx     XTEA ECB context.
+ *
+ * \return nothing
+ */
+static void xteaKeySchedule(xteaEcbCtx_t *ctx)
+{
+#ifdef XTEA_KEY_SCHEDULE
+    const uint32_t          delta   = 0x9E3779B9;
+    uint32_t                sum     = 0x00000000;
+    uint32_t              * roundKey = ctx->schedule;
+    register uint_fast8_t   idx     = XTEA_SCHEDULE_ROUNDS;
+
+    while (idx--)
+    {
+        *roundKey++ = sum + ctx->key[sum & 3].u32;
+        sum += delta;
+        *roundKey++ = sum + ctx->key[(sum >> 11) & 3].u32;
+    }
+#else
+    (void)ctx;
+#endif
+}
+
+/**
+ * \brief A function that loads a key into an XTEA ECB context.
+ *
+ * \param[in]   ctx     XTEA ECB context.
+ * \param[in]   key     128-bit [16 bytes] XTEA cipher key.
+ *
+ * \return nothing
+ */
+static void xteaSetKey(xteaEcbCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE])
+{
+    xteaLoadKey(ctx, key);
+    xteaKeySchedule(ctx);
+}
+
 /**
  * \brief A function that loads an initialization vector into an XTEA cipher context.
  *
@@ -222,22 +366,58 @@ static inline void xteaSetIv(xteaCipherCtx_t *ctx, const uint8_t iv[XTEA_IV_SIZE
  * \return Processed data is returned by the 'data' parameter.
  */
 static void xteaCfbBlock(xteaCipherCtx_t *ctx, uint8_t data[XTEA_BLOCK_SIZE])
+{
+    xteaCfbBytes(ctx, data, XTEA_BLOCK_SIZE);
+}
+
+/**
+ * \brief   Function that encrypts/decrypts up to one block of data in CFB mode.
+ *          A partial block (last block of a message) uses only 'length' bytes of the key stream,
+ *          bytes of 'data' above 'length' are not accessed.
+ *
+ * \param[in]       ctx     XTEA cipher context.
+ * \param[in,out]   data    Data processed by the function.
+ * \param[in]       length  Size of the data, 1-8 bytes.
+ *
+ * \return Processed data is returned by the 'data' parameter.
+ */
+static void xteaCfbBytes(xteaCipherCtx_t *ctx, uint8_t data[], uint_fast8_t length)
+{
+    xteaCfbBuffer(ctx, data, length);
+}
+
+/**
+ * \brief   Function that encrypts/decrypts a buffer of any length in place in CFB mode, without copying
+ *          the data. The chaining value is encrypted when a block begins, so the encryption needs
+ *          no data of its block; a partial last block uses only as many bytes of the key stream.
+ *
+ * \param[in]       ctx     XTEA cipher context.
+ * \param[in,out]   data    Data processed by the function.
+ * \param[in]       length  Size of the data in bytes.
+ *
+ * \return Processed data is returned by the 'data' parameter.
+ */
+static void xteaCfbBuffer(xteaCipherCtx_t *ctx, uint8_t data[], size_t length)
 {
     if (ctx == NULL)
     {
         return;
     }
 
-    register uint_fast8_t idx   = XTEA_BLOCK_SIZE;
-    register uint_fast8_t vTmp;
+    register uint_fast8_t   idx     = 0x00;
+    register uint_fast8_t   vTmp;
 
-    xteaEcbEncrypt(ctx->base.key, ctx->iv, ctx->iv, ctx->base.rounds);
-
-    while (idx--)
+    for (const uint8_t *end = data + length; data != end; data++)
     {
-        vTmp = data[idx];
-        data[idx] ^= ctx->iv[idx];
-        ctx->iv[idx] = (xteaEncrypt == ctx->base.operation) ? data[idx] : vTmp;
+        if (0x00 == idx)
+        {
+            xteaEcbEncryptCtx(&(ctx->base), ctx->iv, ctx->iv);
+        }
+        XTEA_INPUT_HOOK(data + 1);
+        vTmp = *data;
+        *data ^= ctx->iv[idx];
+        ctx->iv[idx] = (xteaEncrypt == ctx->base.operation) ? *data : vTmp;
+        idx = (idx + 1) & (XTEA_BLOCK_SIZE - 1);
     }
 }
 
@@ -267,7 +447,7 @@ static void xteaCfbMacInit(xteaCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE], con
 
     uint_fast8_t    idx = XTEA_KEY_SIZE;
 
-    xteaSetKey(&(ctx->cipher.base), key);
+    xteaLoadKey(&(ctx->cipher.base), key);
     ctx->cipher.base.rounds = rounds;
     ctx->cipher.base.operation = xteaEncrypt;
     ctx->dataLength = 0x00;
@@ -284,10 +464,13 @@ static void xteaCfbMacInit(xteaCtx_t *ctx, const uint8_t key[XTEA_KEY_SIZE], con
             ctx->cipher.iv[idx] = 0x00;
         }
     }
+    xteaKeySchedule(&(ctx->cipher.base));
 }
 
 /**
- * \brief Add data to an initialized MAC calculation.
+ * \brief   Add data to an initialized MAC calculation. The chaining value is encrypted
+ *          when a block begins and the data is XORed into it as it comes, so nothing is copied
+ *          and the encryption needs no data (IV = E(IV) ^ data for every complete block).
  *
  * \param[in]   ctx     XTEA context.
  * \param[in]   data    Data to be added.
@@ -302,13 +485,15 @@ static void xteaCfbMacUpdate(xteaCtx_t *ctx, const uint8_t data[], const uint32_
         return;
     }
 
-    for (uint32_t idx = 0; idx < length; idx++) {
-        ctx->data[ctx->dataLength++] = data[idx];
-        if (XTEA_BLOCK_SIZE == ctx->dataLength)
+    for (const uint8_t *end = data + length; data != end; data++)
+    {
+        if (0x00 == ctx->dataLength)
         {
-            xteaCfbBlock(&(ctx->cipher), ctx->data);
-            ctx->dataLength = 0x00;
+            xteaEcbEncryptCtx(&(ctx->cipher.base), ctx->cipher.iv, ctx->cipher.iv);
         }
+        XTEA_INPUT_HOOK(data + 1);
+        ctx->cipher.iv[ctx->dataLength] ^= *data;
+        ctx->dataLength = (ctx->dataLength + 1) & (XTEA_BLOCK_SIZE - 1);
     }
 }
 
@@ -326,17 +511,16 @@ static void xteaCfbMacFinish(xteaCtx_t *ctx)
         return;
     }
 
-    register uint_fast8_t idx = ctx->dataLength;
-
-    // Pad whatever data is left in the buffer.
-    ctx->data[idx++] = 0x80;
-    while (idx < XTEA_BLOCK_SIZE)
+    // Pad whatever data is left in the block, padding alone takes a block of its own.
+    if (0x00 == ctx->dataLength)
     {
-        ctx->data[idx++] = 0x00;
+        xteaEcbEncryptCtx(&(ctx->cipher.base), ctx->cipher.iv, ctx->cipher.iv);
     }
-    xteaCfbBlock(&(ctx->cipher), ctx->data);
+    ctx->cipher.iv[ctx->dataLength] ^= 0x80;
+    memcpy(ctx->data, ctx->cipher.iv, XTEA_BLOCK_SIZE);
 
     memcpy(&(ctx->cipher.base.key), &(ctx->secondKey), XTEA_KEY_SIZE);
+    xteaKeySchedule(&(ctx->cipher.base));
     xteaCfbBlock(&(ctx->cipher), ctx->data);
 }
 